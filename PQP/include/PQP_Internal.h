@@ -71,6 +71,16 @@ public:
   int EndModel();
   int MemUsage(int msg);  // returns model mem usage.  
                           // prints message to stderr if msg == TRUE
+
+  // moves the triangles of a built model and refits it, see PQP.h
+
+  int UpdateVertices(const PQP_REAL *verts, const int *tri_verts,
+                     PQP_REAL max_spread = 1.5);
+  int Refit(PQP_REAL max_spread = 1.5);
+
+  PQP_REAL build_spread;   // model_spread() right after the last full build
+  int num_refits;          // refits since the last full build
+  int num_rebuilds;        // full builds Refit() fell back to
 };
 
 struct CollisionPair
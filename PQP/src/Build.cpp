@@ -549,3 +549,114 @@ build_model(PQP_Model *m)
 
   return PQP_OK;
 }
+
+// finds the contiguous range of tris under every BV -- build_recurse
+// partitions the tris in place, so the two children of a BV cover
+// adjacent ranges
+
+static void
+tri_ranges(PQP_Model *m, int bn, int *first, int *count)
+{
+  BV *b = m->child(bn);
+  if (b->Leaf())
+  {
+    first[bn] = -b->first_child - 1;
+    count[bn] = 1;
+    return;
+  }
+  int c = b->first_child;
+  tri_ranges(m, c, first, count);
+  tri_ranges(m, c + 1, first, count);
+  first[bn] = first[c];
+  count[bn] = count[c] + count[c + 1];
+}
+
+// refits m->child(bn) with its world orientation parentR * R, then its
+// children relative to the refit BV, and finally makes the BV parent
+// relative again
+
+static void
+refit_recurse(PQP_Model *m, int bn, const int *first, const int *count,
+              const PQP_REAL parentR[3][3]
+#if PQP_BV_TYPE & RSS_TYPE
+              ,const PQP_REAL parentTr[3]
+#endif
+#if PQP_BV_TYPE & OBB_TYPE
+              ,const PQP_REAL parentTo[3]
+#endif
+             )
+{
+  BV *b = m->child(bn);
+  PQP_REAL R[3][3], T[3];
+  MxM(R, parentR, b->R);
+
+  BV fit;
+  fit.FitToTris(R, &m->tris[first[bn]], count[bn]);
+
+  if (!b->Leaf())
+  {
+    refit_recurse(m, b->first_child, first, count, R
+#if PQP_BV_TYPE & RSS_TYPE
+                  ,fit.Tr
+#endif
+#if PQP_BV_TYPE & OBB_TYPE
+                  ,fit.To
+#endif
+                  );
+    refit_recurse(m, b->first_child + 1, first, count, R
+#if PQP_BV_TYPE & RSS_TYPE
+                  ,fit.Tr
+#endif
+#if PQP_BV_TYPE & OBB_TYPE
+                  ,fit.To
+#endif
+                  );
+  }
+
+#if PQP_BV_TYPE & RSS_TYPE
+  VmV(T, fit.Tr, parentTr);
+  MTxV(b->Tr, parentR, T);
+  b->l[0] = fit.l[0];
+  b->l[1] = fit.l[1];
+  b->r = fit.r;
+#endif
+#if PQP_BV_TYPE & OBB_TYPE
+  VmV(T, fit.To, parentTo);
+  MTxV(b->To, parentR, T);
+  VcV(b->d, fit.d);
+#endif
+}
+
+int
+refit_model(PQP_Model *m)
+{
+  int *first = new int[m->num_bvs];
+  int *count = new int[m->num_bvs];
+  tri_ranges(m, 0, first, count);
+
+  PQP_REAL R[3][3],T[3];
+  Midentity(R);
+  Videntity(T);
+
+  refit_recurse(m, 0, first, count, R
+#if PQP_BV_TYPE & RSS_TYPE
+                ,T
+#endif
+#if PQP_BV_TYPE & OBB_TYPE
+                ,T
+#endif
+                );
+
+  delete [] first;
+  delete [] count;
+  return PQP_OK;
+}
+
+PQP_REAL
+model_spread(PQP_Model *m)
+{
+  PQP_REAL sum = 0.0;
+  for (int i = 0; i < m->num_bvs; i++) sum += m->child(i)->GetSize();
+  PQP_REAL root = m->child(0)->GetSize();
+  return root > 0.0 ? sum / root : 0.0;
+}
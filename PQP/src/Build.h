@@ -46,4 +46,15 @@
 int
 build_model(PQP_Model *m);
 
+// refits every BV to the current triangle positions, keeping the tree
+// topology and the BV orientations
+
+int
+refit_model(PQP_Model *m);
+
+// sum of the sizes of all BVs over the size of the root
+
+PQP_REAL
+model_spread(PQP_Model *m);
+
 #endif
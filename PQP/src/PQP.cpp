@@ -40,6 +40,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include "PQP.h"
 #include "BVTQ.h"
 #include "Build.h"
@@ -70,6 +76,10 @@ PQP_Model::PQP_Model()
 
   last_tri = 0;
 
+  build_spread = 0.0;
+  num_refits = 0;
+  num_rebuilds = 0;
+
   build_state = PQP_BUILD_STATE_EMPTY;
 }
 
@@ -235,11 +245,64 @@ PQP_Model::EndModel()
   build_model(this);
   build_state = PQP_BUILD_STATE_PROCESSED;
 
+  build_spread = model_spread(this);
+  num_refits = 0;
+
   last_tri = tris;
 
   return PQP_OK;
 }
 
+int
+PQP_Model::UpdateVertices(const PQP_REAL *verts, const int *tri_verts,
+                          PQP_REAL max_spread)
+{
+  if (build_state != PQP_BUILD_STATE_PROCESSED)
+  {
+    fprintf(stderr,"PQP Error! UpdateVertices() called on model \n"
+                   "that hasn't been ended with EndModel()\n");
+    return PQP_ERR_UNPROCESSED_MODEL;
+  }
+
+  // the tris were reordered by the build, the id says where they came from
+
+  for (int i = 0; i < num_tris; i++)
+  {
+    const int *v = &tri_verts[3 * tris[i].id];
+    VcV(tris[i].p1, &verts[3 * v[0]]);
+    VcV(tris[i].p2, &verts[3 * v[1]]);
+    VcV(tris[i].p3, &verts[3 * v[2]]);
+  }
+
+  return Refit(max_spread);
+}
+
+int
+PQP_Model::Refit(PQP_REAL max_spread)
+{
+  if (build_state != PQP_BUILD_STATE_PROCESSED)
+  {
+    fprintf(stderr,"PQP Error! Refit() called on model \n"
+                   "that hasn't been ended with EndModel()\n");
+    return PQP_ERR_UNPROCESSED_MODEL;
+  }
+
+  refit_model(this);
+  num_refits++;
+
+  if (model_spread(this) > max_spread * build_spread)
+  {
+    // the old orientations fit too poorly, start over from the current tris
+
+    build_model(this);
+    build_spread = model_spread(this);
+    num_refits = 0;
+    num_rebuilds++;
+  }
+
+  return PQP_OK;
+}
+
 int
 PQP_Model::MemUsage(int msg)
 {
@@ -591,6 +654,235 @@ CollideRecurse(PQP_CollideResult *res,
   }
 }
 
+// A BV pair the parallel traversal left for a thread to descend, and where
+// that thread put what it found
+
+struct CollideTask
+{
+  PQP_REAL R[3][3], T[3];
+  int b1, b2;
+
+  int thread;
+  int first_pair, num_pairs;
+  int num_bv_tests, num_tri_tests;
+};
+
+// Walks the top of the traversal like CollideRecurse, but stops at depth 0
+// and at leaf pairs, which become tasks in the order CollideRecurse would
+// have reached them.  The BV tests of the task pairs are left to the tasks.
+
+void
+CollideExpand(PQP_CollideResult *res, std::vector<CollideTask> &tasks,
+              PQP_REAL R[3][3], PQP_REAL T[3],
+              PQP_Model *o1, int b1,
+              PQP_Model *o2, int b2, int depth)
+{
+  int l1 = o1->child(b1)->Leaf();
+  int l2 = o2->child(b2)->Leaf();
+
+  if (depth == 0 || (l1 && l2))
+  {
+    CollideTask t;
+    McM(t.R,R);
+    VcV(t.T,T);
+    t.b1 = b1;
+    t.b2 = b2;
+    tasks.push_back(t);
+    return;
+  }
+
+  res->num_bv_tests++;
+
+  if (!BV_Overlap(R, T, o1->child(b1), o2->child(b2))) return;
+
+  PQP_REAL sz1 = o1->child(b1)->GetSize();
+  PQP_REAL sz2 = o2->child(b2)->GetSize();
+
+  PQP_REAL Rc[3][3],Tc[3],Ttemp[3];
+
+  if (l2 || (!l1 && (sz1 > sz2)))
+  {
+    int c1 = o1->child(b1)->first_child;
+
+    for (int c = c1; c <= c1 + 1; c++)
+    {
+      MTxM(Rc,o1->child(c)->R,R);
+#if PQP_BV_TYPE & OBB_TYPE
+      VmV(Ttemp,T,o1->child(c)->To);
+#else
+      VmV(Ttemp,T,o1->child(c)->Tr);
+#endif
+      MTxV(Tc,o1->child(c)->R,Ttemp);
+      CollideExpand(res,tasks,Rc,Tc,o1,c,o2,b2,depth-1);
+    }
+  }
+  else
+  {
+    int c1 = o2->child(b2)->first_child;
+
+    for (int c = c1; c <= c1 + 1; c++)
+    {
+      MxM(Rc,R,o2->child(c)->R);
+#if PQP_BV_TYPE & OBB_TYPE
+      MxVpV(Tc,R,o2->child(c)->To,T);
+#else
+      MxVpV(Tc,R,o2->child(c)->Tr,T);
+#endif
+      CollideExpand(res,tasks,Rc,Tc,o1,b1,o2,c,depth-1);
+    }
+  }
+}
+
+// Takes tasks off the shared counter until none are left, appending their
+// pairs to this thread's own result
+
+void
+CollideTasks(PQP_CollideResult *local, std::vector<CollideTask> *tasks,
+             std::atomic<int> *next, int thread,
+             PQP_Model *o1, PQP_Model *o2)
+{
+  int count = (int)tasks->size();
+
+  for (int i = (*next)++; i < count; i = (*next)++)
+  {
+    CollideTask &t = (*tasks)[i];
+    int bv_tests = local->num_bv_tests;
+    int tri_tests = local->num_tri_tests;
+
+    t.thread = thread;
+    t.first_pair = local->num_pairs;
+    CollideRecurse(local,t.R,t.T,o1,t.b1,o2,t.b2,PQP_ALL_CONTACTS);
+    t.num_pairs = local->num_pairs - t.first_pair;
+    t.num_bv_tests = local->num_bv_tests - bv_tests;
+    t.num_tri_tests = local->num_tri_tests - tri_tests;
+  }
+}
+
+// Worker threads kept from one PQP_Collide call to the next, so a query
+// doesn't pay for starting and joining threads.  Run() hands the job to
+// workers 1 to num_threads - 1, runs it as number 0 on the calling thread
+// and returns when all of them are done.  Workers are started the first
+// time that many are asked for.  Queries from several threads at once take
+// turns.
+
+class CollidePool
+{
+public:
+  CollidePool() : generation(0), active(0), busy(0), stop(false), job(0) {}
+
+  ~CollidePool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (int i = 0; i < (int)workers.size(); i++) workers[i].join();
+  }
+
+  void Run(int num_threads, const std::function<void(int)> &f)
+  {
+    std::lock_guard<std::mutex> turn(run_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    while ((int)workers.size() < num_threads - 1)
+      workers.push_back(std::thread(&CollidePool::Work,this,
+                                    (int)workers.size() + 1,generation));
+    job = &f;
+    active = num_threads - 1;
+    busy = active;
+    generation++;
+    lock.unlock();
+    wake.notify_all();
+
+    f(0);
+
+    lock.lock();
+    while (busy > 0) done.wait(lock);
+    job = 0;
+  }
+
+private:
+  void Work(int index, int seen)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+      while (!stop && generation == seen) wake.wait(lock);
+      if (stop) return;
+      seen = generation;
+      if (index > active) continue;
+      const std::function<void(int)> *f = job;
+      lock.unlock();
+      (*f)(index);
+      lock.lock();
+      if (--busy == 0) done.notify_one();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex run_mutex, mutex;
+  std::condition_variable wake, done;
+  int generation, active, busy;
+  bool stop;
+  const std::function<void(int)> *job;
+};
+
+static CollidePool collide_pool;
+
+// Runs the traversal from the top BV pair [R,T] on several threads and
+// returns 0 if it is too small to be worth splitting up, in which case
+// res hasn't been touched
+
+int
+CollideParallel(PQP_CollideResult *res,
+                PQP_REAL R[3][3], PQP_REAL T[3],
+                PQP_Model *o1, PQP_Model *o2)
+{
+  int num_threads = PQP_COLLIDE_THREADS;
+  if (num_threads == 0) num_threads = (int)std::thread::hardware_concurrency();
+  if (num_threads <= 1) return 0;
+
+  std::vector<CollideTask> tasks;
+  int bv_tests = res->num_bv_tests;
+  CollideExpand(res,tasks,R,T,o1,0,o2,0,PQP_COLLIDE_TASK_DEPTH);
+  if (tasks.size() < 2)
+  {
+    res->num_bv_tests = bv_tests;
+    return 0;
+  }
+  if (num_threads > (int)tasks.size()) num_threads = (int)tasks.size();
+
+  PQP_CollideResult *locals = new PQP_CollideResult[num_threads];
+  std::atomic<int> next(0);
+  for (int i = 0; i < num_threads; i++)
+  {
+    McM(locals[i].R,res->R);
+    VcV(locals[i].T,res->T);
+  }
+  collide_pool.Run(num_threads, [&](int thread) {
+    CollideTasks(&locals[thread],&tasks,&next,thread,o1,o2);
+  });
+
+  // merge in task order, which is the order of the serial traversal
+
+  int num_pairs = res->num_pairs;
+  for (int i = 0; i < num_threads; i++) num_pairs += locals[i].num_pairs;
+  if (num_pairs > res->num_pairs_alloced) res->SizeTo(num_pairs);
+
+  for (int i = 0; i < (int)tasks.size(); i++)
+  {
+    const CollideTask &t = tasks[i];
+    memcpy(&res->pairs[res->num_pairs], &locals[t.thread].pairs[t.first_pair],
+           t.num_pairs*sizeof(CollisionPair));
+    res->num_pairs += t.num_pairs;
+    res->num_bv_tests += t.num_bv_tests;
+    res->num_tri_tests += t.num_tri_tests;
+  }
+
+  delete [] locals;
+  return 1;
+}
+
 int 
 PQP_Collide(PQP_CollideResult *res,
             PQP_REAL R1[3][3], PQP_REAL T1[3], PQP_Model *o1,
@@ -643,7 +935,8 @@ PQP_Collide(PQP_CollideResult *res,
 
   // now start with both top level BVs  
 
-  CollideRecurse(res,R,T,o1,0,o2,0,flag);
+  if (flag != PQP_ALL_CONTACTS || !CollideParallel(res,R,T,o1,o2))
+    CollideRecurse(res,R,T,o1,0,o2,0,flag);
   
   double t2 = GetTime();
   res->query_time_secs = t2 - t1;
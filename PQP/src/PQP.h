@@ -141,7 +141,24 @@ const int PQP_ERR_BUILD_EMPTY_MODEL = -5;
 //    int EndModel();
 //    int MemUsage(int msg);  // returns model mem usage in bytes
 //                            // prints message to stderr if msg == TRUE
+//
+//    int UpdateVertices(const PQP_REAL *verts, const int *tri_verts,
+//                       PQP_REAL max_spread = 1.5);
+//    int Refit(PQP_REAL max_spread = 1.5);
 //  };
+//
+//  UpdateVertices() moves the triangles of a model that has been ended,
+//  for a deforming object. Triangle id k gets the vertices
+//  tri_verts[3k], tri_verts[3k+1] and tri_verts[3k+2] from verts, which
+//  holds three PQP_REALs per vertex. Every id from 0 to the number of
+//  triangles - 1 must have been used in AddTri(). It then calls Refit().
+//
+//  Refit() keeps the tree and the orientation of every BV, and only fits
+//  their extents to the current triangles. That avoids the covariance fits
+//  and partitioning of EndModel(). As the triangles move, BVs of the old
+//  orientations get looser. When the summed BV size relative to the root
+//  grows past max_spread times its value after the last full build, the
+//  tree is built again from scratch instead.
 
 //----------------------------------------------------------------------------
 //
@@ -198,6 +215,10 @@ const int PQP_ERR_BUILD_EMPTY_MODEL = -5;
 //  CR->NumPairs() will be at most 1, and if 1, CR->Id1(0) and
 //  CR->Id2(0) give the ids of the colliding triangle pair.
 //
+//  PQP_ALL_CONTACTS queries on large models are split over several
+//  threads, see PQP_COLLIDE_THREADS in PQP_Compile.h.  The pairs come
+//  out in the same order as from the single threaded traversal.
+//
 //----------------------------------------------------------------------------
 
 const int PQP_ALL_CONTACTS = 1;  // find all pairwise intersecting triangles
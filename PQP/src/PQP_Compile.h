@@ -98,4 +98,24 @@ typedef double PQP_REAL;
 
 #define PQP_BV_TYPE  RSS_TYPE | OBB_TYPE
 
+//-------------------------------------------------------------------------
+//
+// PQP_COLLIDE_THREADS, PQP_COLLIDE_TASK_DEPTH
+//
+// PQP_Collide() with PQP_ALL_CONTACTS descends PQP_COLLIDE_TASK_DEPTH
+// levels of the traversal on the calling thread, then hands the BV pairs
+// it reached out as tasks to PQP_COLLIDE_THREADS threads.  Each thread
+// collects pairs in its own buffer; they are merged in the order the
+// serial traversal would have found them, so results and test counts
+// are the same as with one thread.  0 threads means one per core, and
+// 1 turns the parallel traversal off.  PQP_FIRST_CONTACT queries always
+// run on the calling thread.  The threads are started by the first
+// parallel query and wait for the next one, so a query only pays for
+// waking them.
+//
+//-------------------------------------------------------------------------
+
+#define PQP_COLLIDE_THREADS     0
+#define PQP_COLLIDE_TASK_DEPTH  10
+
 #endif
@@ -3,6 +3,7 @@
 #include "Eigen/Dense"
 #include "Eigen/IterativeLinearSolvers"
 #include <iostream>
+#include <algorithm>
 #include <math.h>
 
 #ifdef COLLISION_SELFCCD
@@ -12,14 +13,22 @@
 #ifdef COLLISION_PQP
 #include "collision_system_pqp.h"
 static int initialFaceSize;
+// One vertex per corner of the object's faces, refit every step
+static std::vector<Eigen::Vector3d> objectVerts;
+static std::vector<int> objectTris;
 #endif
 static std::vector<int> faceToOut;
+// Rollback rounds per step when the step controller can shorten the next
+// step instead
+static const int adaptiveRollbacks = 4;
 void ParticleSystem::HandleCollisions(double timestep) {
   faceToOut.clear();
+  impactTime = 1;
   if (useColSys) {
 #ifdef COLLISION_SELFCCD
+    // sleeping vertices don't move, the collision system still has them
     for (int i = 0; i < outsidePoints.size(); i++) {
-      if (outsidePoints[i] >= 0) {
+      if (outsidePoints[i] >= 0 && !VertexAsleep(outsidePoints[i])) {
         colSys->UpdateVertex(i, particles[outsidePoints[i]].x);
       }
     }
@@ -28,6 +37,9 @@ void ParticleSystem::HandleCollisions(double timestep) {
     std::vector<float> veToFaTime;
     std::vector<float> edToEdTime;
     colSys->GetCollisions(vertexToFace, edgeToEdge, veToFaTime, edToEdTime);
+    // Contacts still open when the rollback limit is hit get the direct
+    // response below instead of being dropped, which would let them tunnel
+    bool respond = !colRolBack;
     if (colRolBack) {
       int colCount = 0;
       int earliestIndex = 0;
@@ -43,7 +55,7 @@ void ParticleSystem::HandleCollisions(double timestep) {
           p2_i = outsidePoints[faceToOut[3 * vertexToFace[i + 1] + 1]];
           p3_i = outsidePoints[faceToOut[3 * vertexToFace[i + 1] + 2]];
           v1_i = outsidePoints[vertexToFace[i]];
-          if (p1_i < 0 && v1_i >= 0) {
+          if (p1_i < 0 && v1_i >= 0 && !VertexAsleep(v1_i)) {
             if (earliestIndex == -1 || veToFaTime[i/2] < eTime) {
               eTime = veToFaTime[i/2];
               earliestIndex = i;
@@ -52,7 +64,8 @@ void ParticleSystem::HandleCollisions(double timestep) {
           }
         }
         if (earliestIndex >= 0) {
-            Particle *p1, *p2, *p3, *v1;
+            if (colCount == 0) impactTime = eTime;
+            ParticlePtr p1, p2, p3, v1;
             int p1_i, p2_i, p3_i, v1_i;
             p1_i = outsidePoints[faceToOut[3 * vertexToFace[earliestIndex + 1]]];
             p2_i = outsidePoints[faceToOut[3 * vertexToFace[earliestIndex + 1] + 1]];
@@ -83,11 +96,11 @@ void ParticleSystem::HandleCollisions(double timestep) {
 
             for (int i = 0; i < particles.size(); i++) {
               Eigen::Vector3d temp;
-              temp = eTime * particles[i].x + (1 - eTime) * prevPos[i];
+              temp = eTime * particles[i].x + (1 - eTime) * prevPos.segment<3>(i * 3);
               particles[i].x = temp;
-              temp = eTime * particles[i].v + (1 - eTime) * prevVel[i];
+              temp = eTime * particles[i].v + (1 - eTime) * prevVel.segment<3>(i * 3);
               particles[i].v = temp;
-              temp = eTime * particles[i].f + (1 - eTime) * prevFEXT[i];
+              temp = eTime * particles[i].f + (1 - eTime) * prevFEXT.segment<3>(i * 3);
               particles[i].f = temp;
             }
             v1->x[0] = planePoint[0];
@@ -98,7 +111,7 @@ void ParticleSystem::HandleCollisions(double timestep) {
             v1->v[2] = 0;
 
             for (int i = 0; i < outsidePoints.size(); i++) {
-              if (outsidePoints[i] >= 0) {
+              if (outsidePoints[i] >= 0 && !VertexAsleep(outsidePoints[i])) {
                 colSys->UpdateVertex(i, particles[outsidePoints[i]].x);
               }
             }
@@ -111,27 +124,32 @@ void ParticleSystem::HandleCollisions(double timestep) {
             ImplicitEulerSparse(curTimeStep * (1 - eTime));
             curTimeStep -= eTime * curTimeStep;
             for (int i = 0; i < outsidePoints.size(); i++) {
-              if (outsidePoints[i] >= 0) {
+              if (outsidePoints[i] >= 0 && !VertexAsleep(outsidePoints[i])) {
                 colSys->UpdateVertex(i, particles[outsidePoints[i]].x);
               }
             }
             colSys->GetCollisions(vertexToFace, edgeToEdge, veToFaTime, edToEdTime);
             colCount += 1;
             //fprintf(stderr, "c: %i curTimeStep: %f ", colCount, curTimeStep);
-            if (colCount > 60) break;
+            if (colCount > (solverSettings.adaptiveTimestep ? adaptiveRollbacks : 60)) {
+              respond = true;
+              break;
+            }
         }
       }
       fprintf(stderr, "ColCount: %i\n", colCount);
-    } else {
+    }
+    if (respond) {
     for (int i = 0; i < vertexToFace.size(); i += 2) {
       // calculate normal of tri
-      Particle *p1, *p2, *p3, *v1;
+      ParticlePtr p1, p2, p3, v1;
       int p1_i, p2_i, p3_i, v1_i;
       p1_i = outsidePoints[faceToOut[3 * vertexToFace[i + 1]]];
       p2_i = outsidePoints[faceToOut[3 * vertexToFace[i + 1] + 1]];
       p3_i = outsidePoints[faceToOut[3 * vertexToFace[i + 1] + 2]];
       v1_i = outsidePoints[vertexToFace[i]];
-      if (p1_i < 0 && v1_i >= 0) {
+      if (p1_i < 0 && v1_i >= 0 && !VertexAsleep(v1_i)) {
+        impactTime = std::min(impactTime, (double)veToFaTime[i/2]);
         GetPointP(p1_i, p1);
         GetPointP(p2_i, p2);
         GetPointP(p3_i, p3);
@@ -168,7 +186,7 @@ void ParticleSystem::HandleCollisions(double timestep) {
     }
     for (int i = 0; i < edgeToEdge.size(); i += 4) {
       // calculate normal of tri
-      Particle *p1, *p2, *p3, *p4;
+      ParticlePtr p1, p2, p3, p4;
       int p1_i, p2_i, p3_i, p4_i;
       p1_i = outsidePoints[edgeToEdge[i]];
       p2_i = outsidePoints[edgeToEdge[i + 1]];
@@ -187,7 +205,7 @@ void ParticleSystem::HandleCollisions(double timestep) {
         switched = true;
       }
 
-      if (p1_i >= 0 && p2_i >= 0 && p3_i < 0 && p4_i < 0) {
+      if (p1_i >= 0 && p2_i >= 0 && p3_i < 0 && p4_i < 0 && !(VertexAsleep(p1_i) && VertexAsleep(p2_i))) {
         GetPointP(p1_i, p1);
         GetPointP(p2_i, p2);
         GetPointP(p3_i, p3);
@@ -225,10 +243,10 @@ void ParticleSystem::HandleCollisions(double timestep) {
 //v1->v = newVelocity;
 
       //if (p1_i >= 0 && p2_i >= 0 && p3_i >= 0 && v1_i >= 0) {
-      //  p1 = &(particles[p1_i]);
-      //  p2 = &(particles[p2_i]);
-      //  p3 = &(particles[p3_i]);
-      //  v1 = &(particles[v1_i]);
+      //  p1 = particles.Ptr(p1_i);
+      //  p2 = particles.Ptr(p2_i);
+      //  p3 = particles.Ptr(p3_i);
+      //  v1 = particles.Ptr(v1_i);
       //  Eigen::Vector3d temp1, temp2;
       //  temp1 = p2->x - p1->x;
       //  temp2 = p3->x - p1->x;
@@ -278,16 +296,11 @@ void ParticleSystem::HandleCollisions(double timestep) {
   }
 #endif // COLLISION_SELFCCD
 #ifdef COLLISION_PQP
-  // reinit object
-  std::vector<Eigen::Vector3d> verts;
-  std::vector<int> otris;
+  // refit object, sleeping vertices are still where they were
   for (int i = 0; i < initialFaceSize; ++i) {
-    Particle*x;
-    GetPointP(faces[i], x);
-    verts.push_back(x->x);
-    otris.push_back(i);
+    if (!VertexAsleep(faces[i])) objectVerts[i] = particles[faces[i]].x;
   }
-  colSys->InitObjectModel(verts, otris);
+  colSys->UpdateObjectModel(objectVerts, objectTris);
 
   std::vector<unsigned int> vertexToFace;
   std::vector<unsigned int> edgeToEdge;
@@ -295,19 +308,19 @@ void ParticleSystem::HandleCollisions(double timestep) {
   std::vector<double> edgeU;
   colSys->GetCollisions(vertexToFace, edgeToEdge, edgeU, moveEdge);
   for (int i = 0; i < edgeToEdge.size(); i += 2) {
-    Particle *v1, *v2;
+    ParticlePtr v1, v2;
     int v1_i, v2_i;
     v1_i = faces[edgeToEdge[i]];
     v2_i = faces[edgeToEdge[i + 1]];
     //fprintf(stderr, "got collisions with face %i %i %i and vertex %i\n", p1_i, p2_i, p3_i, v1_i);
-    if (v1_i >= 0 && v2_i >= 0) {
+    if (v1_i >= 0 && v2_i >= 0 && !(VertexAsleep(v1_i) && VertexAsleep(v2_i))) {
       GetPointP(v1_i, v1);
       GetPointP(v2_i, v2);
       //fprintf(stderr, "v1_i %i v2_i %i prevPos size %i\n", v1_i, v2_i, prevPos.size());
       double u = edgeU[i/2];
       double mu = 1.0 / (fabs(.5 - u) + .5);
-      v1->x = prevPos[v1_i];
-      v2->x = prevPos[v2_i];
+      v1->x = prevPos.segment<3>(v1_i * 3);
+      v2->x = prevPos.segment<3>(v2_i * 3);
       Eigen::Matrix<double, 9, 9> m;
       m << 1, 0, 0,  0, 0, 0,  1 - u, 0, 0,
            0, 1, 0,  0, 0, 0,  0, 1 - u, 0,
@@ -337,14 +350,14 @@ void ParticleSystem::HandleCollisions(double timestep) {
     }
   }
   for (int i = 0; i < vertexToFace.size(); i += 2) {
-      Particle *p1, *p2, *p3, *v1;
+      ParticlePtr p1, p2, p3, v1;
       int p1_i, p2_i, p3_i, v1_i;
       p1_i = faces[vertexToFace[i + 1] + initialFaceSize];
       p2_i = faces[vertexToFace[i + 1] + 1 + initialFaceSize];
       p3_i = faces[vertexToFace[i + 1] + 2 + initialFaceSize];
       v1_i = faces[vertexToFace[i]];
       //fprintf(stderr, "got collisions with face %i %i %i and vertex %i\n", p1_i, p2_i, p3_i, v1_i);
-      if (p1_i < 0 && v1_i >= 0) {
+      if (p1_i < 0 && v1_i >= 0 && !VertexAsleep(v1_i)) {
         GetPointP(p1_i, p1);
         GetPointP(p2_i, p2);
         GetPointP(p3_i, p3);
@@ -386,15 +399,14 @@ void ParticleSystem::HandleCollisions(double timestep) {
 }
 void ParticleSystem::SetupCollisions(double lowestpoint) {
   initialFaceSize = faces.size();
-  Particle *g1,* g2,* g3, * g4, *g5, *g6, *g7, *g8;
-  g1 = new Particle();
-  g2 = new Particle();
-  g3 = new Particle();
-  g4 = new Particle();
-  g5 = new Particle();
-  g6 = new Particle();
-  g7 = new Particle();
-  g8 = new Particle();
+  int first = fixed_points.size();
+  for (int i = 0; i < 8; ++i) {
+    fixed_points.emplace_back();
+  }
+  ParticlePtr g1 = fixed_points.Ptr(first), g2 = fixed_points.Ptr(first + 1),
+              g3 = fixed_points.Ptr(first + 2), g4 = fixed_points.Ptr(first + 3),
+              g5 = fixed_points.Ptr(first + 4), g6 = fixed_points.Ptr(first + 5),
+              g7 = fixed_points.Ptr(first + 6), g8 = fixed_points.Ptr(first + 7);
   g1->x << 2, lowestpoint + 1, 2;
   g1->v << 0, 0, 0;
   g2->x << -2, lowestpoint + 1, 2;
@@ -413,23 +425,6 @@ void ParticleSystem::SetupCollisions(double lowestpoint) {
   g7->v << 0, 0, 0;
   g8->x << 2, lowestpoint + 5, -2;
   g8->v << 0, 0, 0;
-
-  fixed_points.push_back(*g1);
-  fixed_points.push_back(*g2);
-  fixed_points.push_back(*g3);
-  fixed_points.push_back(*g4);
-  fixed_points.push_back(*g5);
-  fixed_points.push_back(*g6);
-  fixed_points.push_back(*g7);
-  fixed_points.push_back(*g8);
-  delete g1;
-  delete g2;
-  delete g3;
-  delete g4;
-  delete g5;
-  delete g6;
-  delete g7;
-  delete g8;
   //outsidePoints.push_back(-1 * fixed_points.size()); // 1, 3, -1
   //outsidePoints.push_back(-1 * fixed_points.size() + 1); // -1, 3 -1
   //outsidePoints.push_back(-1 * fixed_points.size() + 2); // -1, 3, 1
@@ -481,7 +476,7 @@ void ParticleSystem::SetupCollisions(double lowestpoint) {
 #ifdef COLLISION_SELFCCD
   std::vector<Eigen::Vector3d> verts;
   for (int i = 0; i < outsidePoints.size(); ++i) {
-    Particle* x;
+    ParticlePtr x;
     //printf("Getting point %i\n", outsidePoints[i]);
     GetPointP(outsidePoints[i], x);
     verts.push_back(x->x);
@@ -490,25 +485,25 @@ void ParticleSystem::SetupCollisions(double lowestpoint) {
   colSys->InitSystem(verts, faceToOut);
 #endif
 #ifdef COLLISION_PQP
-  std::vector<Eigen::Vector3d> verts;
-  std::vector<int> otris;
+  objectVerts.clear();
+  objectTris.clear();
   for (int i = 0; i < initialFaceSize; ++i) {
-    Particle*x;
+    ParticlePtr x;
     GetPointP(faces[i], x);
-    verts.push_back(x->x);
-    otris.push_back(i);
+    objectVerts.push_back(x->x);
+    objectTris.push_back(i);
   }
-  printf("size of verts %i, size of otris %i\n", verts.size(), otris.size());
+  printf("size of verts %i, size of otris %i\n", objectVerts.size(), objectTris.size());
   std::vector<Eigen::Vector3d> groundverts;
   std::vector<int> gtris;
   for (int i = initialFaceSize; i < faces.size(); ++i) {
-    Particle*x;
+    ParticlePtr x;
     GetPointP(faces[i], x);
     groundverts.push_back(x->x);
     gtris.push_back(i - initialFaceSize);
   }
   colSys->InitGroundModel(groundverts, gtris);
-  colSys->InitObjectModel(verts, otris);
+  colSys->InitObjectModel(objectVerts, objectTris);
 #endif
 }
 
@@ -2,30 +2,27 @@
 #include "ccdAPI.h"
 #include "stdio.h"
 
-static vec3f_list vecList;
-static tri_list triList;
-static std::vector<unsigned int>* vToF = NULL;
-static std::vector<float>* vToFTime = NULL;
-static float earlyC = 1;
-static int earlyCType = 0;
-static int earlyCIndex = 0;
+struct CollisionSystem::State {
+  ccdContext* context;
+  vec3f_list vecList;
+  tri_list triList;
+  bool initialized;
+};
 
-static std::vector<unsigned int>* eToE = NULL;
-static std::vector<float>* eToETime = NULL;
-static bool initialized = false;
-
-CollisionSystem::CollisionSystem() {}
+CollisionSystem::CollisionSystem() {
+  state = new State();
+  state->context = ccdCreateContext();
+  state->initialized = false;
+}
 CollisionSystem::~CollisionSystem() {
-  if (initialized) {
-    ccdQuitModel();
-  }
+  ccdDestroyContext(state->context);
+  delete state;
 }
 
 void CollisionSystem::InitSystem(const std::vector<Eigen::Vector3d>& verts, const std::vector<int>& tris) {
-  if (initialized) {
-    ccdQuitModel();
-  }
-  initialized = true;
+  state->initialized = true;
+  vec3f_list& vecList = state->vecList;
+  tri_list& triList = state->triList;
   vecList.clear();
   triList.clear();
   for (int i = 0; i < verts.size(); i++) {
@@ -34,48 +31,30 @@ void CollisionSystem::InitSystem(const std::vector<Eigen::Vector3d>& verts, cons
   for (int i = 0; i < tris.size(); i += 3) {
     triList.push_back(tri3f(tris[i], tris[i + 1], tris[i + 2]));
   }
-  ccdInitModel(vecList, triList);
+  ccdInitModel(state->context, vecList, triList);
 }
 
 void CollisionSystem::UpdateVertex(unsigned int index, const Eigen::Vector3d& vec) {
-  vecList[index].x = vec[0];
-  vecList[index].y = vec[1];
-  vecList[index].z = vec[2];
-}
-void EECallback(unsigned int e1_v1, unsigned e1_v2,
-				unsigned int e2_v1, unsigned int e2_v2, float t) {
-  if (t < earlyC) {
-    earlyCType = 1;
-    earlyCIndex = eToE->size();
-    earlyC = t;
-  }
-  eToETime->push_back(t);
-  eToE->push_back(e1_v1);
-  eToE->push_back(e1_v2);
-  eToE->push_back(e2_v1);
-  eToE->push_back(e2_v2);
-	//printf("EE result: e1(%d, %d), e2(%d, %d) @ t=%f\n", e1_v1, e1_v2, e2_v1, e2_v2, t);
-}
-void VFCallback(unsigned int vid, unsigned int fid, float t) {
-	//printf("VF result: v=%d, f=%d @ t=%f\n", vid, fid, t);
-  if (t < earlyC) {
-    earlyCType = 0;
-    earlyCIndex = vToF->size();
-    earlyC = t;
-  }
-  vToFTime->push_back(t);
-  vToF->push_back(vid);
-  vToF->push_back(fid);
+  state->vecList[index] = vec3f(vec[0], vec[1], vec[2]);
 }
 
 void CollisionSystem::GetCollisions(std::vector<unsigned int>& vertexToFace, std::vector<unsigned int>& edgeToEdge, std::vector<float>& veToFaTime, std::vector<float>& edToEdTime) {
-  vToF = &vertexToFace;
-  eToE = &edgeToEdge;
-  vToFTime = &veToFaTime;
-  eToETime = &edToEdTime;
-  earlyC = 1;
-  ccdUpdateVtxs(vecList);
-  ccdSetEECallback(EECallback);
-  ccdSetVFCallback(VFCallback);
-  ccdChecking(true);
+  if (!state->initialized) return;
+  ccdUpdateVtxs(state->context, state->vecList);
+  ccdChecking(state->context, true);
+
+  const std::vector<ccdEEResult>& ee = ccdGetEEResults(state->context);
+  for (int i = 0; i < ee.size(); i++) {
+    edToEdTime.push_back(ee[i].t);
+    edgeToEdge.push_back(ee[i].e1_v1);
+    edgeToEdge.push_back(ee[i].e1_v2);
+    edgeToEdge.push_back(ee[i].e2_v1);
+    edgeToEdge.push_back(ee[i].e2_v2);
+  }
+  const std::vector<ccdVFResult>& vf = ccdGetVFResults(state->context);
+  for (int i = 0; i < vf.size(); i++) {
+    veToFaTime.push_back(vf[i].t);
+    vertexToFace.push_back(vf[i].vid);
+    vertexToFace.push_back(vf[i].fid);
+  }
 }
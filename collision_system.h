@@ -3,6 +3,8 @@
 #include "../Eigen/Core"
 #include <vector>
 
+// Self-CCD of one deformable. Every instance has its own ccdContext, so
+// several bodies can be checked independently and from different threads.
 class CollisionSystem {
  public:
   CollisionSystem();
@@ -10,5 +12,10 @@ class CollisionSystem {
   void GetCollisions(std::vector<unsigned int>& vertexToFace, std::vector<unsigned int>& edgeToEdge, std::vector<float>& veToFaTime, std::vector<float>& edToEdTime);
   void UpdateVertex(unsigned int index, const Eigen::Vector3d& vec);
   void InitSystem(const std::vector<Eigen::Vector3d>& verts, const std::vector<int>& tris);
+
+ private:
+  // Keeps the self-ccd headers out of this one
+  struct State;
+  State* state;
 };
 #endif
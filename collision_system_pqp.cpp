@@ -66,6 +66,21 @@ void CollisionSystemPQP::InitObjectModel(const std::vector<Eigen::Vector3d>& ver
   object.EndModel();
 }
 
+void CollisionSystemPQP::UpdateObjectModel(const std::vector<Eigen::Vector3d>& verts, const std::vector<int>& tris) {
+  if (tris != otris || object.num_tris != tris.size() / 3) {
+    InitObjectModel(verts, tris);
+    return;
+  }
+  overts = verts;
+  std::vector<PQP_REAL> flat(verts.size() * 3);
+  for (int i = 0; i < verts.size(); ++i) {
+    flat[i * 3] = verts[i][0];
+    flat[i * 3 + 1] = verts[i][1];
+    flat[i * 3 + 2] = verts[i][2];
+  }
+  object.UpdateVertices(flat.data(), tris.data());
+}
+
 void CollisionSystemPQP::GetCollisions(std::vector<unsigned int>& objectVertexToFace, std::vector<unsigned int>& edgeToEdge, std::vector<double>& edgeU, std::vector<Eigen::Vector3d>& moveEdge) {
   PQP_REAL translation[3];
   translation[0] = 0;
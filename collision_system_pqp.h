@@ -9,6 +9,9 @@ class CollisionSystemPQP {
   ~CollisionSystemPQP();
   void InitGroundModel(const std::vector<Eigen::Vector3d>& verts, const std::vector<int>& tris);
   void InitObjectModel(const std::vector<Eigen::Vector3d>& verts, const std::vector<int>& tris);
+  // Moves the object's vertices and refits its BVH in place, the tris have to
+  // be the ones it was built with, otherwise it is rebuilt from scratch
+  void UpdateObjectModel(const std::vector<Eigen::Vector3d>& verts, const std::vector<int>& tris);
 
   void GetCollisions(std::vector<unsigned int>& objectVertexToFace, std::vector<unsigned int>& edgeToEdge, std::vector<double>& edgeU, std::vector<Eigen::Vector3d>& moveEdge);
 };
@@ -0,0 +1,178 @@
+#include "domain_decomposition.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <functional>
+
+void SubdomainSolver::Partition(const std::vector<Eigen::Vector3d>& points, const std::vector<int>& tetVertices,
+                                int parts) {
+  int tetCount = tetVertices.size() / 4;
+  parts = std::max(std::min(parts, tetCount), 1);
+  std::vector<Eigen::Vector3d> centers(tetCount);
+  for (int t = 0; t < tetCount; ++t) {
+    centers[t].setZero();
+    for (int k = 0; k < 4; ++k) centers[t] += points[tetVertices[t * 4 + k]] / 4;
+  }
+
+  // Bisect [begin, end) of order into parts pieces, the sides get tets in
+  // proportion to the parts they are split into further
+  std::vector<int> order(tetCount);
+  for (int t = 0; t < tetCount; ++t) order[t] = t;
+  std::vector<int> domainOf(tetCount);
+  int next = 0;
+  std::function<void(int, int, int)> bisect = [&](int begin, int end, int count) {
+    if (count == 1) {
+      for (int k = begin; k < end; ++k) domainOf[order[k]] = next;
+      next++;
+      return;
+    }
+    Eigen::Vector3d lo = centers[order[begin]], hi = lo;
+    for (int k = begin + 1; k < end; ++k) {
+      lo = lo.cwiseMin(centers[order[k]]);
+      hi = hi.cwiseMax(centers[order[k]]);
+    }
+    int axis;
+    (hi - lo).maxCoeff(&axis);
+    int leftCount = count / 2;
+    int mid = begin + (long long)(end - begin) * leftCount / count;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                     [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+    bisect(begin, mid, leftCount);
+    bisect(mid, end, count - leftCount);
+  };
+  if (tetCount > 0) bisect(0, tetCount, parts);
+
+  std::vector<std::vector<int> > vertexTets(points.size());
+  for (int t = 0; t < tetCount; ++t) {
+    for (int k = 0; k < 4; ++k) vertexTets[tetVertices[t * 4 + k]].push_back(t);
+  }
+  std::vector<std::vector<int> > domainTets(parts);
+  for (int t = 0; t < tetCount; ++t) domainTets[domainOf[t]].push_back(t);
+
+  domains.assign(parts, std::vector<int>());
+  // seen[v] == d + 1 once vertex v is in subdomain d
+  std::vector<int> seen(points.size(), 0);
+  std::vector<int> vertices;
+  for (int d = 0; d < parts; ++d) {
+    vertices.clear();
+    for (int k = 0; k < domainTets[d].size(); ++k) {
+      const int* to = &tetVertices[domainTets[d][k] * 4];
+      for (int j = 0; j < 4; ++j) {
+        if (seen[to[j]] != d + 1) {
+          seen[to[j]] = d + 1;
+          vertices.push_back(to[j]);
+        }
+      }
+    }
+    int own = vertices.size();
+    for (int k = 0; k < own; ++k) {
+      const std::vector<int>& neighbors = vertexTets[vertices[k]];
+      for (int n = 0; n < neighbors.size(); ++n) {
+        const int* to = &tetVertices[neighbors[n] * 4];
+        for (int j = 0; j < 4; ++j) {
+          if (seen[to[j]] != d + 1) {
+            seen[to[j]] = d + 1;
+            vertices.push_back(to[j]);
+          }
+        }
+      }
+    }
+    std::sort(vertices.begin(), vertices.end());
+    std::vector<int>& dofs = domains[d];
+    dofs.resize(vertices.size() * 3);
+    for (int k = 0; k < vertices.size(); ++k) {
+      for (int j = 0; j < 3; ++j) dofs[k * 3 + j] = vertices[k] * 3 + j;
+    }
+  }
+  size = points.size() * 3;
+  patternNonZeros = -1;
+}
+
+void SubdomainSolver::BuildLocalPatterns(const Eigen::SparseMatrix<double>& A) {
+  int count = domains.size();
+  local.resize(count);
+  gather.resize(count);
+  factors.resize(count);
+  localResults.resize(count);
+  const int* outer = A.outerIndexPtr();
+  const int* inner = A.innerIndexPtr();
+  ThreadPool::ParallelFor(count, [&](int begin, int end) {
+    for (int d = begin; d < end; ++d) {
+      const std::vector<int>& dofs = domains[d];
+      int n = dofs.size();
+      // dofs and the rows of every column of A are sorted, so one merge per
+      // column finds the rows inside the subdomain in local order
+      Eigen::VectorXi perColumn(n);
+      std::vector<int>& slots = gather[d];
+      slots.clear();
+      std::vector<int> rows;
+      for (int j = 0; j < n; ++j) {
+        int start = slots.size();
+        int k = 0;
+        for (int s = outer[dofs[j]]; s < outer[dofs[j] + 1]; ++s) {
+          while (k < n && dofs[k] < inner[s]) k++;
+          if (k == n) break;
+          if (dofs[k] == inner[s]) {
+            slots.push_back(s);
+            rows.push_back(k);
+          }
+        }
+        perColumn[j] = slots.size() - start;
+      }
+      Eigen::SparseMatrix<double>& m = local[d];
+      m.resize(n, n);
+      m.reserve(perColumn);
+      int s = 0;
+      for (int j = 0; j < n; ++j) {
+        for (int k = 0; k < perColumn[j]; ++k, ++s) {
+          m.insert(rows[s], j) = 0;
+        }
+      }
+      m.makeCompressed();
+      factors[d].reset(new Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> >());
+      factors[d]->analyzePattern(m);
+    }
+  });
+  patternNonZeros = A.nonZeros();
+}
+
+bool SubdomainSolver::Factorize(const Eigen::SparseMatrix<double>& A) {
+  Eigen::SparseMatrix<double> compressed;
+  const Eigen::SparseMatrix<double>* m = &A;
+  if (!A.isCompressed()) {
+    compressed = A;
+    compressed.makeCompressed();
+    m = &compressed;
+  }
+  if (m->rows() != size) return false;
+  if (m->nonZeros() != patternNonZeros) BuildLocalPatterns(*m);
+  const double* values = m->valuePtr();
+  std::vector<char> ok(domains.size());
+  ThreadPool::ParallelFor(domains.size(), [&](int begin, int end) {
+    for (int d = begin; d < end; ++d) {
+      double* localValues = local[d].valuePtr();
+      const std::vector<int>& slots = gather[d];
+      for (int k = 0; k < slots.size(); ++k) {
+        localValues[k] = values[slots[k]];
+      }
+      factors[d]->factorize(local[d]);
+      ok[d] = factors[d]->info() == Eigen::Success;
+    }
+  });
+  return std::find(ok.begin(), ok.end(), 0) == ok.end();
+}
+
+void SubdomainSolver::Apply(const Eigen::VectorXd& b, Eigen::VectorXd& x) const {
+  ThreadPool::ParallelFor(domains.size(), [&](int begin, int end) {
+    for (int d = begin; d < end; ++d) {
+      const std::vector<int>& dofs = domains[d];
+      Eigen::VectorXd r(dofs.size());
+      for (int k = 0; k < dofs.size(); ++k) r[k] = b[dofs[k]];
+      localResults[d] = factors[d]->solve(r);
+    }
+  });
+  x.setZero(b.size());
+  for (int d = 0; d < domains.size(); ++d) {
+    const std::vector<int>& dofs = domains[d];
+    for (int k = 0; k < dofs.size(); ++k) x[dofs[k]] += localResults[d][k];
+  }
+}
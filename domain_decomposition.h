@@ -0,0 +1,96 @@
+#ifndef DOMAIN_DECOMPOSITION_H__
+#define DOMAIN_DECOMPOSITION_H__
+
+#include "Eigen/Sparse"
+#include "Eigen/Dense"
+#include "Eigen/SparseCholesky"
+#include <memory>
+#include <vector>
+
+// Overlapping subdomains of a tet mesh and the factored blocks of A on them.
+// Lives across frames so the partition, the extraction of the blocks and
+// their symbolic analysis are only redone when the mesh or A's pattern change.
+class SubdomainSolver {
+ public:
+  SubdomainSolver() : size(0), patternNonZeros(-1) {}
+
+  // Splits the tets into parts subdomains of about equal size by recursive
+  // coordinate bisection of their centroids, always across the longest side.
+  // A subdomain's dofs are the vertices of its tets and of every tet sharing
+  // a vertex with them, which is one ring of overlap.
+  void Partition(const std::vector<Eigen::Vector3d>& points, const std::vector<int>& tetVertices, int parts);
+  int Count() const { return domains.size(); }
+
+  // Factors every subdomain's block of A on its own thread
+  bool Factorize(const Eigen::SparseMatrix<double>& A);
+  // x = sum_i R_i^T A_i^-1 R_i b, the solves run in parallel and are summed
+  // in subdomain order so the result doesn't depend on the thread count
+  void Apply(const Eigen::VectorXd& b, Eigen::VectorXd& x) const;
+
+ private:
+  void BuildLocalPatterns(const Eigen::SparseMatrix<double>& A);
+
+  int size;
+  int patternNonZeros;
+  // Sorted dofs of every subdomain
+  std::vector<std::vector<int> > domains;
+  std::vector<Eigen::SparseMatrix<double> > local;
+  // Per subdomain, the offset in A's values of every value of the local matrix
+  std::vector<std::vector<int> > gather;
+  std::vector<std::unique_ptr<Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > > > factors;
+  mutable std::vector<Eigen::VectorXd> localResults;
+};
+
+// One level additive Schwarz as the preconditioner of Eigen's
+// ConjugateGradient. The sum over the subdomains is symmetric positive
+// definite, which CG needs, and the overlap keeps the interfaces coupled.
+class SchwarzPreconditioner {
+ public:
+  typedef Eigen::VectorXd::StorageIndex StorageIndex;
+  enum {
+    ColsAtCompileTime = Eigen::Dynamic,
+    MaxColsAtCompileTime = Eigen::Dynamic
+  };
+
+  SchwarzPreconditioner() : solver(NULL), size(0), status(Eigen::InvalidInput) {}
+
+  // Has to outlive the preconditioner
+  void setSolver(SubdomainSolver* s) { solver = s; }
+
+  Eigen::Index rows() const { return size; }
+  Eigen::Index cols() const { return size; }
+
+  template<typename MatType>
+  SchwarzPreconditioner& analyzePattern(const MatType&) { return *this; }
+
+  SchwarzPreconditioner& factorize(const Eigen::SparseMatrix<double>& mat) {
+    size = mat.rows();
+    status = solver->Factorize(mat) ? Eigen::Success : Eigen::NumericalIssue;
+    return *this;
+  }
+
+  SchwarzPreconditioner& compute(const Eigen::SparseMatrix<double>& mat) {
+    return factorize(mat);
+  }
+
+  template<typename Rhs, typename Dest>
+  void _solve_impl(const Rhs& b, Dest& x) const {
+    Eigen::VectorXd result;
+    solver->Apply(b, result);
+    x = result;
+  }
+
+  template<typename Rhs>
+  inline const Eigen::Solve<SchwarzPreconditioner, Rhs> solve(const Eigen::MatrixBase<Rhs>& b) const {
+    return Eigen::Solve<SchwarzPreconditioner, Rhs>(*this, b.derived());
+  }
+
+  Eigen::ComputationInfo info() { return status; }
+
+ private:
+  SubdomainSolver* solver;
+  int size;
+  Eigen::ComputationInfo status;
+};
+
+#endif
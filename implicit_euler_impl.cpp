@@ -3,6 +3,15 @@
 #include "Eigen/Sparse"
 #include "Eigen/Dense"
 #include "Eigen/IterativeLinearSolvers"
+#include <algorithm>
+#include <math.h>
+#include "thread_pool.h"
+#include "preconditioners.h"
+#include "multigrid.h"
+#include "domain_decomposition.h"
+#include "meshgen.h"
+#include "rotation_batch.h"
+#include "modal.h"
 
 namespace {
   void PushbackMatrix3d(std::vector<Eigen::Triplet<double>>& tlist, Eigen::Matrix3d& temp, int startcol, int startrow, int mul) {
@@ -25,18 +34,367 @@ Eigen::VectorXd vdiffprev;
 //std::vector<Eigen::Triplet<double>> iesdfdxtriplet;
 //std::vector<Eigen::Triplet<double>> iesdfdvtriplet;
 
+// Sparsity pattern shared by the stiffness and system matrices. Built once per
+// mesh, after which the element blocks are accumulated straight into valuePtr.
+bool hasPattern = false;
+Eigen::SparseMatrix<double> patternK;
+Eigen::SparseMatrix<double> patternA;
+// Per tet, 16 blocks of 3 columns: offset of the block's first row in valuePtr
+std::vector<int> tetBlockSlots;
+// Per dof, offset of the diagonal entry in valuePtr
+std::vector<int> diagSlots;
+
+// Tets grouped by color, no two tets of a color share a vertex.
+// Color c is colorTets[colorOffsets[c]] up to colorTets[colorOffsets[c + 1]].
+bool hasColoring = false;
+std::vector<int> colorTets;
+std::vector<int> colorOffsets;
+
+// Runs fn(i) for every tet, one color at a time, each color across threads
+template <typename F>
+void ForEachTetByColor(F& fn) {
+  if (ThreadPool::GetNumThreads() == 1) {
+    // in order is friendlier to the cache when nothing runs concurrently
+    for (int i = 0; i < colorTets.size(); i++) {
+      fn(i);
+    }
+    return;
+  }
+  for (int c = 0; c + 1 < colorOffsets.size(); ++c) {
+    const int* colored = &(colorTets[colorOffsets[c]]);
+    ThreadPool::ParallelFor(colorOffsets[c + 1] - colorOffsets[c], [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        fn(colored[k]);
+      }
+    });
+  }
+}
+
+int FindSlot(const Eigen::SparseMatrix<double>& m, int row, int col) {
+  const int* begin = m.innerIndexPtr() + m.outerIndexPtr()[col];
+  const int* end = m.innerIndexPtr() + m.outerIndexPtr()[col + 1];
+  const int* it = std::lower_bound(begin, end, row);
+  return it - m.innerIndexPtr();
+}
+
+void ScatterMatrix3d(double* values, const int* slots, const Eigen::Matrix3d& temp) {
+  for (int j = 0; j < 3; ++j) {
+    for (int i = 0; i < 3; ++i) {
+      values[slots[j] + i] += temp(i, j);
+    }
+  }
+}
+
+// Linear (non corotational) system and its factorization, with the timestep
+// and material they were built for
+bool hasLinearFactor = false;
+Eigen::SparseMatrix<double> linearK;
+Eigen::SparseMatrix<double> linearA;
+Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > linearFactor;
+double linearATimestep;
+double factorTimestep;
+double factorStiffness;
+double factorVolConserve;
+double factorDampness;
+// A couldn't be factored for the pins, masses and the material in
+// factorStiffness, factorVolConserve and factorDampness. Prefactored steps
+// fall back to CG until one of them changes.
+bool linearFailed = false;
+
+// Stale factorization of A used as the CG preconditioner in corotational mode
+bool hasLaggedFactor = false;
+Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > laggedFactor;
+int laggedNonZeros;
+int framesSinceFactor;
+int laggedIterations;
+
+// Prolongations from each multigrid level to the next finer one, finest first
+bool hasMultigrid = false;
+int multigridLevels;
+std::vector<Eigen::SparseMatrix<double> > prolongations;
+
+// Overlapping subdomains of the mesh for the additive Schwarz preconditioner
+bool hasSubdomains = false;
+int subdomainCount;
+SubdomainSolver subdomains;
+
+// Projective dynamics global matrix (1 + h c) M / h^2 + sum w G^T G, one
+// particle per row since x, y and z share it. pdL keeps the rows and columns
+// of pinned vertices for moving their coupling to the right hand side.
+// pdExact is pdFiltered with the mass term for pdExactTimestep, a timestep
+// close enough to the factored one to be solved with CG preconditioned by
+// pdFactor.
+bool hasPDFactor = false;
+// The global matrix couldn't be factored for the pins, masses and the
+// material in pdStiffness, pdVolConserve and pdDampness. Projective dynamics
+// steps fall back to CG until one of them changes.
+bool pdFailed = false;
+Eigen::SparseMatrix<double> pdL;
+Eigen::SparseMatrix<double> pdFiltered;
+Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > pdFactor;
+Eigen::SparseMatrix<double> pdExact;
+double pdExactTimestep;
+double pdTimestep;
+double pdStiffness;
+double pdVolConserve;
+double pdDampness;
+
+// Reduced modal model: the lowest modes of the rest stiffness over the free
+// dofs, M-orthonormal and zero on pinned dofs, their omega^2, and the
+// rotation vector every mode gives each vertex for modal warping. The state
+// is the mode amplitudes q, their velocities and the particle velocities the
+// last modal step wrote.
+bool hasModes = false;
+bool hasModalState = false;
+Eigen::MatrixXd modeBasis;
+Eigen::VectorXd modeEigenvalues;
+Eigen::MatrixXd modeRotations;
+Eigen::VectorXd modeQ;
+Eigen::VectorXd modeQDot;
+Eigen::VectorXd modeWrittenVel;
+int modeCount;
+double modeStiffness;
+double modeVolConserve;
+
+// FNV-1a over the bytes of count doubles, continuing from hash, for the
+// modal cache key
+unsigned long long HashDoubles(const double* values, int count,
+                               unsigned long long hash = 14695981039346656037ULL) {
+  const unsigned char* bytes = (const unsigned char*) values;
+  for (int i = 0; i < count * (int) sizeof(double); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// A 64 bit hash as two key entries, each exact in a double
+void PushHash(std::vector<double>& key, unsigned long long hash) {
+  key.push_back((double) (hash >> 32));
+  key.push_back((double) (hash & 0xffffffffULL));
+}
+
+// Float copy of the system matrix for mixed precision solves
+bool hasMixedPattern = false;
+Eigen::SparseMatrix<float> mixedA;
+
+// Element stiffness of a tet, K_ij = B_i^T D B_j, kept as the shape
+// gradients y_i that make up B and the three distinct entries of D. That is
+// 15 doubles instead of the 144 of the 16 blocks, which are rebuilt where
+// they are needed.
+struct TetStiffness {
+  Eigen::Vector3d y[4];
+  double a, b, c; // diagonal and off diagonal of the normal part of D, shear part
+};
+
+// Element stiffness of every tet, shared by every solver path. Built with
+// isPlasticTet and rotInverse by BuildElementCache.
+bool hasElements = false;
+std::vector<TetStiffness> strainForTets;
+
+// Tets whose rest shape plastic flow has moved off startPos, and the force
+// sum K_t (rest_t - startPos_t) they add up to. The linear model measures x
+// from startPos, so it subtracts this to get each tet's own rest shape.
+std::vector<int> plasticTets;
+std::vector<char> isPlasticTet;
+Eigen::VectorXd plasticForce;
+// linearK got value updates the linear factorization doesn't have yet
+bool linearKChanged = false;
+
+// K_ij = b y_i y_j^T + c y_j y_i^T + c (y_i . y_j) I + (a - b - 2c) diag(y_i * y_j)
+Eigen::Matrix3d TetBlock(const TetStiffness& s, int i, int j) {
+  const Eigen::Vector3d& yi = s.y[i];
+  const Eigen::Vector3d& yj = s.y[j];
+  Eigen::Matrix3d block = s.b * yi * yj.transpose() + s.c * yj * yi.transpose();
+  block.diagonal() += s.c * yi.dot(yj) * Eigen::Vector3d::Ones() + (s.a - s.b - 2 * s.c) * yi.cwiseProduct(yj);
+  return block;
+}
+
+// All 16 blocks of a tet, the ones below the diagonal are transposes since K
+// is symmetric
+void TetBlocks(const TetStiffness& s, Eigen::Matrix3d* blocks) {
+  for (int i = 0; i < 4; ++i) {
+    for (int j = i; j < 4; ++j) {
+      blocks[i * 4 + j] = TetBlock(s, i, j);
+      if (j != i) blocks[j * 4 + i] = blocks[i * 4 + j].transpose();
+    }
+  }
+}
+
+// out_i = sum_j K_ij u_j, by way of the strain B u and the stress D B u
+void ApplyTetStiffness(const TetStiffness& s, const Eigen::Vector3d* u, Eigen::Vector3d* out) {
+  Eigen::Vector3d normal = Eigen::Vector3d::Zero();
+  Eigen::Vector3d shear = Eigen::Vector3d::Zero();
+  for (int j = 0; j < 4; ++j) {
+    const Eigen::Vector3d& y = s.y[j];
+    normal += y.cwiseProduct(u[j]);
+    shear[0] += y[1] * u[j][0] + y[0] * u[j][1];
+    shear[1] += y[2] * u[j][1] + y[1] * u[j][2];
+    shear[2] += y[2] * u[j][0] + y[0] * u[j][2];
+  }
+  normal = s.b * normal.sum() * Eigen::Vector3d::Ones() + (s.a - s.b) * normal;
+  shear *= s.c;
+  for (int i = 0; i < 4; ++i) {
+    const Eigen::Vector3d& y = s.y[i];
+    out[i] = y.cwiseProduct(normal);
+    out[i][0] += y[1] * shear[0] + y[2] * shear[2];
+    out[i][1] += y[0] * shear[0] + y[2] * shear[1];
+    out[i][2] += y[1] * shear[1] + y[0] * shear[2];
+  }
+}
+// Rotation of every tet this step, from ComputeRotations
+std::vector<Eigen::Matrix3d> tetRot;
+// m (1 + h c) per dof for the matrix free product
+Eigen::VectorXd mfMass;
+
+// Structure of arrays copies of every tet's edges and inversePos for the
+// batched rotation kernels, and the rotations they return
+std::vector<double> rotEdges;
+std::vector<double> rotInverse;
+std::vector<double> rotBatch;
+// The tets outside sleeping islands while any sleep, and their inversePos
+// gathered like rotInverse, so the kernels only see those
+std::vector<int> awakeTets;
+std::vector<double> rotAwakeInverse;
+
 double curTime;
 double tripletTime = 0;
 double fromTripletTime = 0;
 double equationSetupTime = 0;
 double solveTime = 0;
+double preconditionerTime = 0;
+int solveCount = 0;
+int iterationCount = 0;
+double residualSum = 0;
+double lastResidual = 0;
+
+void RecordSolve(int iterations, double residual) {
+  solveCount++;
+  iterationCount += iterations;
+  residualSum += residual;
+  lastResidual = residual;
+}
+
+// Filters the pinned dofs out of A: their rows and columns are cleared apart
+// from the diagonal, so with their entries of b zeroed they solve to v = 0
+// and don't couple to the free dofs. The pattern is left as it is.
+void FilterPinned(Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& freeDofs) {
+  for (int k = 0; k < A.outerSize(); ++k) {
+    for (Eigen::SparseMatrix<double>::InnerIterator it(A, k); it; ++it) {
+      if (it.row() != it.col()) it.valueRef() *= freeDofs[it.row()] * freeDofs[it.col()];
+    }
+  }
+}
+
+// CG on the assembled system, x holds the guess when useGuess is set
+template <typename CG>
+int RunCG(CG& cg, const Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& b, Eigen::VectorXd& x,
+          bool useGuess, const SolverSettings& settings) {
+  cg.setTolerance(settings.tolerance);
+  cg.setMaxIterations(settings.maxIterations);
+
+  double start = glfwGetTime();
+  cg.compute(A);
+  double end = glfwGetTime();
+  preconditionerTime += end - start;
+
+  if (useGuess) x = cg.solveWithGuess(b, x);
+  else x = cg.solve(b);
+  solveTime += glfwGetTime() - end;
+  RecordSolve(cg.iterations(), cg.error());
+  return cg.iterations();
+}
+
+template <typename Preconditioner>
+int SolveCG(const Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& b, Eigen::VectorXd& x,
+            bool useGuess, const SolverSettings& settings) {
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>, Eigen::Lower | Eigen::Upper, Preconditioner> cg;
+  return RunCG(cg, A, b, x, useGuess, settings);
+}
+
+// Same, preconditioned by a factorization of a nearby or older A
+int SolveCGFactored(const Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& b, Eigen::VectorXd& x,
+                    bool useGuess, const SolverSettings& settings,
+                    const FactorizationPreconditioner::Factorization& factor) {
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>, Eigen::Lower | Eigen::Upper, FactorizationPreconditioner> cg;
+  cg.preconditioner().setFactorization(&factor);
+  return RunCG(cg, A, b, x, useGuess, settings);
+}
+
+// Iterative refinement: the correction for the double residual is solved by
+// float CG on a float copy of A, which halves the traffic of the SpMVs. The
+// float iterations of all the steps share the settings' iteration budget.
+int SolveMixed(const Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& b, Eigen::VectorXd& x,
+               bool useGuess, const SolverSettings& settings) {
+  double start = glfwGetTime();
+  if (hasMixedPattern && mixedA.nonZeros() == A.nonZeros() && mixedA.rows() == A.rows()) {
+    const double* values = A.valuePtr();
+    float* mixedValues = mixedA.valuePtr();
+    for (int i = 0; i < A.nonZeros(); i++) {
+      mixedValues[i] = values[i];
+    }
+  } else {
+    mixedA = A.cast<float>();
+    mixedA.makeCompressed();
+    hasMixedPattern = true;
+  }
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<float>, Eigen::Lower | Eigen::Upper> cg;
+  cg.compute(mixedA);
+  double end = glfwGetTime();
+  preconditionerTime += end - start;
+
+  if (!useGuess) x.setZero(b.size());
+  double bnorm = b.norm();
+  double error = 0;
+  int iterations = 0;
+  for (int step = 0; step <= settings.refinementSteps; ++step) {
+    Eigen::VectorXd r = b - A * x;
+    error = bnorm > 0 ? r.norm() / bnorm : 0;
+    if (error <= settings.tolerance || iterations >= settings.maxIterations || step == settings.refinementSteps) break;
+    // float CG bottoms out around 1e-6 on its own
+    cg.setTolerance(std::max(settings.tolerance / error, 1e-5));
+    cg.setMaxIterations(settings.maxIterations - iterations);
+    Eigen::VectorXf d = cg.solve(r.cast<float>());
+    x += d.cast<double>();
+    iterations += cg.iterations();
+  }
+  solveTime += glfwGetTime() - end;
+  RecordSolve(iterations, error);
+  return iterations;
+}
+
+// Refactors the lagged preconditioner every refactorInterval frames or after
+// a solve that needed more than refactorIterations, otherwise keeps the old one.
+// The symbolic analysis is only redone when the pattern of A changes.
+bool UpdateLaggedFactor(const Eigen::SparseMatrix<double>& A, const SolverSettings& settings) {
+  framesSinceFactor++;
+  if (hasLaggedFactor && framesSinceFactor < settings.refactorInterval &&
+      laggedIterations <= settings.refactorIterations) {
+    return true;
+  }
+  double start = glfwGetTime();
+  if (!hasLaggedFactor || A.nonZeros() != laggedNonZeros) {
+    laggedFactor.analyzePattern(A);
+    laggedNonZeros = A.nonZeros();
+  }
+  laggedFactor.factorize(A);
+  preconditionerTime += glfwGetTime() - start;
+  hasLaggedFactor = laggedFactor.info() == Eigen::Success;
+  framesSinceFactor = 0;
+  laggedIterations = 0;
+  return hasLaggedFactor;
+}
 };
 
-void ParticleSystem::GetProfileInfo(double& triplet, double& fromTriplet, double& solve, double& setupTime) {
+void ParticleSystem::GetProfileInfo(double& triplet, double& fromTriplet, double& solve, double& setupTime,
+                                    double& preconditioner, int& solves, int& iterations, double& residual) {
    triplet = tripletTime;
    fromTriplet = fromTripletTime;
    solve = solveTime;
    setupTime = equationSetupTime;
+   preconditioner = preconditionerTime;
+   solves = solveCount;
+   iterations = iterationCount;
+   residual = residualSum;
 }
 
 void ParticleSystem::Reset() {
@@ -44,16 +402,466 @@ void ParticleSystem::Reset() {
   fixed_points.clear();
   tets.clear();
   hasPrev = false;
+  hasElements = false;
+  hasPattern = false;
+  hasColoring = false;
+  hasLinearFactor = false;
+  linearFailed = false;
+  hasLaggedFactor = false;
+  hasMultigrid = false;
+  hasSubdomains = false;
+  hasMixedPattern = false;
+  hasPDFactor = false;
+  pdFailed = false;
+  hasModes = false;
+  hasConstraints = false;
+  hasIslands = false;
+  sleepingIslands = 0;
+  plasticTets.clear();
+  isPlasticTet.clear();
+  springs.clear();
+  meshFromBar = false;
+  substep = solverSettings.maxSubstep;
+  meshFile.clear();
+  startIMass.clear();
+  freeDofs.resize(0);
+  unpinnedDofs.resize(0);
+  pinnedPos.resize(0);
+  massDiag.resize(0);
   faces.clear();
   facetotet.clear();
   outsidePoints.clear();
   useColSys = false;
 }
 
+void ParticleSystem::PinVertices(const std::vector<int>& vertices, bool pin) {
+  if (unpinnedDofs.size() != particles.size() * 3) {
+    unpinnedDofs.setOnes(particles.size() * 3);
+    pinnedPos = particles.Positions();
+  }
+  Eigen::Map<Eigen::VectorXd> x = particles.Positions();
+  for (int k = 0; k < vertices.size(); ++k) {
+    int i = vertices[k];
+    unpinnedDofs.segment<3>(i * 3).setConstant(pin ? 0 : 1);
+    pinnedPos.segment<3>(i * 3) = x.segment<3>(i * 3);
+  }
+  WakeUp();
+  ApplySleepMask();
+  PinsChanged();
+}
+
+void ParticleSystem::UnpinAll() {
+  unpinnedDofs.setOnes(particles.size() * 3);
+  WakeUp();
+  ApplySleepMask();
+  PinsChanged();
+}
+
+// The pins are filtered out of the cached factorizations and the modes
+void ParticleSystem::PinsChanged() {
+  hasLinearFactor = false;
+  linearFailed = false;
+  hasLaggedFactor = false;
+  hasPDFactor = false;
+  pdFailed = false;
+  hasModes = false;
+}
+
+// freeDofs from the pins and the sleeping islands, and the tets still awake.
+// The factorizations and modes only have the pins filtered out, and with
+// no system coupling two islands the sleeping ones just get masked out of
+// their results, so they stay valid.
+void ParticleSystem::ApplySleepMask() {
+  freeDofs = unpinnedDofs;
+  awakeTets.clear();
+  if (hasIslands && sleepingIslands > 0) {
+    for (int i = 0; i < particles.size(); i++) {
+      if (islandAsleep[vertexIsland[i]]) freeDofs.segment<3>(i * 3).setZero();
+    }
+    for (int i = 0; i < tets.size(); i++) {
+      if (!TetAsleep(i)) awakeTets.push_back(i);
+    }
+  }
+  // the modal amplitudes of a waking island are of where it fell asleep
+  hasModalState = false;
+}
+
+void ParticleSystem::SetDensity(double density) {
+  for (int i = 0; i < tets.size(); i++) {
+    tets[i].density = density;
+  }
+  ComputeMass();
+  WakeUp();
+  PrefactorSolver();
+}
+
+void ParticleSystem::SetRegionDensity(const std::vector<int>& tetIndices, double density) {
+  for (int k = 0; k < tetIndices.size(); k++) {
+    tets[tetIndices[k]].density = density;
+  }
+  ComputeMass();
+  WakeUp();
+  PrefactorSolver();
+}
+
+// Lumped mass, a quarter of every tet's density * volume on each of its
+// vertices. Particles without a tet of nonzero density get back the mass the
+// scene gave them. Fills massDiag for the solver from the result.
+void ParticleSystem::ComputeMass() {
+  std::vector<double> mass(particles.size(), 0.0);
+  for (int i = 0; i < tets.size(); i++) {
+    double quarter = tets[i].density * fabs(tets[i].posDet) / 24;
+    for (int j = 0; j < 4; ++j) {
+      mass[tets[i].to[j]] += quarter;
+    }
+  }
+  massDiag.resize(particles.size() * 3);
+  for (int i = 0; i < particles.size(); i++) {
+    if (mass[i] > 0) {
+      particles.iMass[i] = 1 / mass[i];
+    } else if (i < startIMass.size()) {
+      particles.iMass[i] = startIMass[i];
+    }
+    massDiag.segment<3>(i * 3).setConstant(1 / particles.iMass[i]);
+  }
+  // M is in every cached factorization
+  hasLinearFactor = false;
+  linearFailed = false;
+  hasLaggedFactor = false;
+  hasPDFactor = false;
+  pdFailed = false;
+  hasModes = false;
+}
+
+// Puts pinned vertices back after collisions, the ground or the mouse moved them
+void ParticleSystem::ApplyPins() {
+  if (freeDofs.size() != particles.size() * 3) return;
+  Eigen::Map<Eigen::VectorXd> x = particles.Positions();
+  Eigen::Map<Eigen::VectorXd> v = particles.Velocities();
+  x.array() = freeDofs.array() * x.array() + (1 - freeDofs.array()) * pinnedPos.array();
+  v.array() *= freeDofs.array();
+}
+
+SolverSettings::SolverSettings() {
+  solver = SOLVER_EIGEN_CG;
+  persistentPattern = true;
+  numThreads = 0;
+  preconditioner = PRECONDITIONER_DIAGONAL;
+  maxIterations = 20;
+  tolerance = .000001;
+  prefactorLinear = false;
+  refactorTimestepChange = .1;
+  refactorInterval = 30;
+  refactorIterations = 10;
+  multigridLevels = 2;
+  domainCount = 0;
+  mixedPrecision = false;
+  refinementSteps = 3;
+  polarRotations = false;
+  pdIterations = 10;
+  modalCount = 16;
+  modalWarping = true;
+  xpbdIterations = 10;
+  xpbdEdges = false;
+  adaptiveTimestep = false;
+  minSubstep = 1.0 / 960;
+  maxSubstep = 1.0 / 60;
+  substepTolerance = .01;
+  frameBudget = 1.0 / 30;
+  sleeping = false;
+  sleepEnergy = 1e-6;
+  sleepForce = 1e-2;
+  sleepFrames = 30;
+}
+
+// Backward Euler is off from the trapezoid rule by about h/2 |v_1 - v_0| in
+// position, and a CG that stopped at relative residual r leaves about
+// h r |v| more. The error is O(h^2), so the size scales with the square root
+// of tolerance over error. An impact early in the step also shortens the
+// next one so contact is resolved in smaller steps instead of rollbacks.
+double ParticleSystem::NextSubstep(double timestep) {
+  double error = 0;
+  if (vdiffprev.size() == prevVel.size()) {
+    error = .5 * timestep * (vdiffprev - prevVel).lpNorm<Eigen::Infinity>() +
+            timestep * lastResidual * vdiffprev.lpNorm<Eigen::Infinity>();
+  }
+  double scale = error > 0 ? .9 * sqrt(solverSettings.substepTolerance / error) : 2;
+  scale = std::min(std::max(scale, .2), 2.0);
+  if (impactTime < 1) scale = std::min(scale, std::max(impactTime, .2));
+  return std::min(std::max(timestep * scale, solverSettings.minSubstep), solverSettings.maxSubstep);
+}
+
+void ParticleSystem::BuildSystemPattern() {
+  int vSize = 3 * particles.size();
+  std::vector<Eigen::Triplet<double>> patterntriplet;
+  Eigen::Matrix3d ones = Eigen::Matrix3d::Ones();
+  for (int i = 0; i < tets.size(); i++) {
+    for (int index1 = 0; index1 < 4; ++index1) {
+      for (int index2 = 0; index2 < 4; ++index2) {
+        PushbackMatrix3d(patterntriplet, ones, tets[i].to[index1] * 3, tets[i].to[index2] * 3, 1);
+      }
+    }
+  }
+  // the mass sits on the diagonal even for particles outside every tet
+  for (int i = 0; i < vSize; i++) {
+    patterntriplet.push_back(Eigen::Triplet<double>(i, i, 1));
+  }
+  patternK.resize(vSize, vSize);
+  patternK.setFromTriplets(patterntriplet.begin(), patterntriplet.end());
+  patternK.makeCompressed();
+
+  tetBlockSlots.resize(tets.size() * 16 * 3);
+  for (int i = 0; i < tets.size(); i++) {
+    for (int index1 = 0; index1 < 4; ++index1) {
+      for (int index2 = 0; index2 < 4; ++index2) {
+        int* slots = &(tetBlockSlots[(i * 16 + index1 * 4 + index2) * 3]);
+        for (int j = 0; j < 3; ++j) {
+          slots[j] = FindSlot(patternK, tets[i].to[index1] * 3, tets[i].to[index2] * 3 + j);
+        }
+      }
+    }
+  }
+  diagSlots.resize(vSize);
+  for (int i = 0; i < vSize; i++) {
+    diagSlots[i] = FindSlot(patternK, i, i);
+  }
+  patternA = patternK;
+  hasPattern = true;
+}
+
+// Greedy coloring of the tets so that tets sharing a vertex differ
+void ParticleSystem::ColorTets() {
+  std::vector<std::vector<int> > vertexTets(particles.size());
+  for (int i = 0; i < tets.size(); i++) {
+    for (int j = 0; j < 4; ++j) {
+      vertexTets[tets[i].to[j]].push_back(i);
+    }
+  }
+  std::vector<int> color(tets.size(), -1);
+  std::vector<int> usedBy;
+  int colorCount = 0;
+  for (int i = 0; i < tets.size(); i++) {
+    for (int j = 0; j < 4; ++j) {
+      const std::vector<int>& neighbors = vertexTets[tets[i].to[j]];
+      for (int k = 0; k < neighbors.size(); ++k) {
+        int c = color[neighbors[k]];
+        if (c >= 0) usedBy[c] = i;
+      }
+    }
+    int c = 0;
+    while (c < colorCount && usedBy[c] == i) c++;
+    if (c == colorCount) {
+      colorCount++;
+      usedBy.push_back(-1);
+    }
+    color[i] = c;
+  }
+  colorOffsets.assign(colorCount + 1, 0);
+  for (int i = 0; i < tets.size(); i++) {
+    colorOffsets[color[i] + 1]++;
+  }
+  for (int c = 0; c < colorCount; ++c) {
+    colorOffsets[c + 1] += colorOffsets[c];
+  }
+  colorTets.resize(tets.size());
+  std::vector<int> fill(colorOffsets.begin(), colorOffsets.end() - 1);
+  for (int i = 0; i < tets.size(); i++) {
+    colorTets[fill[color[i]]++] = i;
+  }
+  printf("Tet colors: %i\n", colorCount);
+  hasColoring = true;
+}
+
+// Element stiffness of tet i for the rest shape, see TetStiffness
+void ParticleSystem::ComputeTetStiffness(int i) {
+  TetStiffness& s = strainForTets[i];
+  s.y[1] << tets[i].inversePos(0,0), tets[i].inversePos(0,1), tets[i].inversePos(0,2);
+  s.y[2] << tets[i].inversePos(1,0), tets[i].inversePos(1,1), tets[i].inversePos(1,2);
+  s.y[3] << tets[i].inversePos(2,0), tets[i].inversePos(2,1), tets[i].inversePos(2,2);
+
+  s.y[0] = -1* s.y[1] - s.y[2] - s.y[3];
+
+  double v = volConserve;
+  s.a =  tets[i].posDet * tets[i].k * (1 - v) / ((1 + v) * (1 - 2 * v));
+  s.b =  tets[i].posDet * tets[i].k *  v / ((1 + v) * (1 - 2 * v));
+  s.c =  tets[i].posDet * tets[i].k * (1 - 2 * v) / ((1 + v) * (1 - 2 * v));
+}
+
+// Rest positions of tet i's vertices. Plastic flow only changes the edges,
+// so they hang off the rest position of its first vertex.
+void ParticleSystem::TetRestPositions(int i, Eigen::Vector3d* rest) {
+  const int* to = tets[i].to;
+  rest[0] = startPos[to[0]];
+  for (int j = 1; j < 4; ++j) {
+    rest[j] = isPlasticTet[i] ? Eigen::Vector3d(rest[0] + tets[i].oldPos[j - 1]) : startPos[to[j]];
+  }
+}
+
+void ParticleSystem::SetPlasticity(bool enabled, double yield, double creep, double maxStrain, double refit) {
+  plastiscity = enabled;
+  plasticYield = yield;
+  plasticCreep = creep;
+  plasticMax = maxStrain;
+  plasticRefit = refit;
+  WakeUp();
+}
+
+// Plastic flow tet by tet. The elastic strain is the symmetric part of
+// R^T F - I against the rest shape the tet has now, minus the plastic strain
+// it picked up since. Above plasticYield a plasticCreep share of it per
+// second becomes plastic strain, whose size is capped at plasticMax. Only
+// tets whose plastic strain moved plasticRefit away from the one their rest
+// shape was built with get a new rest shape and element stiffness, and the
+// linear K takes the difference of their blocks in place.
+void ParticleSystem::UpdatePlasticity(double timestep) {
+  int count = tets.size();
+  bool rotations = corotational && tetRot.size() == count;
+  std::vector<char> changed(count, 0);
+  ThreadPool::ParallelFor(count, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      if (TetAsleep(i)) continue;
+      Tetrahedra& t = tets[i];
+      ParticlePtr p[4];
+      GetTetP(i, p[0], p[1], p[2], p[3]);
+      Eigen::Matrix3d Ds;
+      Ds << p[1]->x - p[0]->x, p[2]->x - p[0]->x, p[3]->x - p[0]->x;
+      Eigen::Matrix3d F = Ds * t.inversePos;
+      if (rotations) F = tetRot[i].transpose() * F;
+      Eigen::Matrix3d elastic = .5 * (F + F.transpose()) - Eigen::Matrix3d::Identity() -
+                                (t.plasticStrain - t.restStrain);
+      double size = elastic.norm();
+      if (size <= plasticYield) continue;
+      t.plasticStrain += std::min(timestep * plasticCreep, 1.0) * (1 - plasticYield / size) * elastic;
+      double plastic = t.plasticStrain.norm();
+      if (plastic > plasticMax) t.plasticStrain *= plasticMax / plastic;
+      changed[i] = (t.plasticStrain - t.restStrain).norm() > plasticRefit;
+    }
+  });
+
+  std::vector<int> yielded;
+  for (int i = 0; i < count; i++) {
+    if (changed[i]) yielded.push_back(i);
+  }
+  if (yielded.empty()) return;
+
+  bool updateLinear = hasLinearFactor && linearK.nonZeros() == patternK.nonZeros();
+  std::vector<TetStiffness> before(yielded.size());
+  ThreadPool::ParallelFor(yielded.size(), [&](int begin, int end) {
+    for (int k = begin; k < end; k++) {
+      int i = yielded[k];
+      Tetrahedra& t = tets[i];
+      const int* to = t.to;
+      Eigen::Matrix3d start;
+      start << startPos[to[1]] - startPos[to[0]], startPos[to[2]] - startPos[to[0]], startPos[to[3]] - startPos[to[0]];
+      t.restStrain = t.plasticStrain;
+      Eigen::Matrix3d edges = (Eigen::Matrix3d::Identity() + t.restStrain) * start;
+      for (int j = 0; j < 3; ++j) {
+        t.oldPos[j] = edges.col(j);
+      }
+      t.posDet = edges.determinant();
+      t.inversePos = edges.inverse();
+      before[k] = strainForTets[i];
+      ComputeTetStiffness(i);
+      for (int c = 0; c < 9; ++c) {
+        rotInverse[c * count + i] = t.inversePos(c % 3, c / 3);
+      }
+    }
+  });
+
+  if (updateLinear) {
+    double* kvalues = linearK.valuePtr();
+    for (int k = 0; k < yielded.size(); k++) {
+      int i = yielded[k];
+      Eigen::Matrix3d oldBlocks[16], newBlocks[16];
+      TetBlocks(before[k], oldBlocks);
+      TetBlocks(strainForTets[i], newBlocks);
+      for (int b = 0; b < 16; b++) {
+        ScatterMatrix3d(kvalues, &(tetBlockSlots[(i * 16 + b) * 3]), newBlocks[b] - oldBlocks[b]);
+      }
+    }
+    linearKChanged = true;
+  }
+
+  for (int k = 0; k < yielded.size(); k++) {
+    if (!isPlasticTet[yielded[k]]) {
+      isPlasticTet[yielded[k]] = 1;
+      plasticTets.push_back(yielded[k]);
+    }
+  }
+  plasticForce.setZero(particles.size() * 3);
+  for (int k = 0; k < plasticTets.size(); k++) {
+    int i = plasticTets[k];
+    Eigen::Vector3d rest[4], offset[4], force[4];
+    TetRestPositions(i, rest);
+    for (int j = 0; j < 4; ++j) {
+      offset[j] = rest[j] - startPos[tets[i].to[j]];
+    }
+    ApplyTetStiffness(strainForTets[i], offset, force);
+    for (int j = 0; j < 4; ++j) {
+      plasticForce.segment<3>(tets[i].to[j] * 3) += force[j];
+    }
+  }
+  // the projective dynamics weights and rest shapes are in its factorization,
+  // and the modes are of the stiffness from before. A factorization that
+  // failed may work with the new stiffness.
+  hasPDFactor = false;
+  pdFailed = false;
+  linearFailed = false;
+  hasModes = false;
+}
+
+// Element stiffness, plastic flags and the rotation kernels' inverse rest
+// shapes of every tet
+void ParticleSystem::BuildElementCache() {
+  strainForTets.resize(tets.size());
+  isPlasticTet.resize(tets.size(), 0);
+  printf("Number of tets: %i\n", tets.size());
+  ThreadPool::ParallelFor(tets.size(), [this](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      ComputeTetStiffness(i);
+    }
+  });
+  int count = tets.size();
+  rotInverse.resize(count * 9);
+  for (int i = 0; i < count; i++) {
+    for (int c = 0; c < 9; ++c) {
+      rotInverse[c * count + i] = tets[i].inversePos(c % 3, c / 3);
+    }
+  }
+  hasElements = true;
+}
+
+// Does the setup the first step would otherwise pay for: the element cache
+// and, for projective dynamics, its factorization at the current substep
+void ParticleSystem::PrefactorSolver() {
+  if (tets.empty() || freeDofs.size() != particles.size() * 3) return;
+  if (!hasElements) BuildElementCache();
+  if (solverSettings.solver == SOLVER_PROJECTIVE_DYNAMICS && !pdFailed) {
+    if (!hasColoring) ColorTets();
+    double start = glfwGetTime();
+    FactorProjectiveDynamics(substep);
+    printf("Projective dynamics factored in %f s\n", glfwGetTime() - start);
+  }
+}
+
 void ParticleSystem::ImplicitEulerSparse(double timestep) {
   double tempTime = glfwGetTime();
   double curTime = tempTime;
 
+  if (solverSettings.solver == SOLVER_XPBD) {
+    // the edge springs take their rest lengths from TetRestPositions
+    if (!hasElements) BuildElementCache();
+    Eigen::VectorXd newv;
+    double residual = PositionBasedStep(timestep, newv);
+    tempTime = glfwGetTime();
+    solveTime += tempTime - curTime;
+    RecordSolve(solverSettings.xpbdIterations, residual);
+    hasModalState = false;
+    vdiffprev = newv;
+    StoreVelocities(newv, timestep);
+    return;
+  }
+
   int vSize = 3 * particles.size();
   static Eigen::SparseMatrix<double> iesA;
   static Eigen::VectorXd iesb;
@@ -62,69 +870,32 @@ void ParticleSystem::ImplicitEulerSparse(double timestep) {
 
   static std::vector<Eigen::Triplet<double>> iesdfdxtriplet;
 
-  static std::vector<Eigen::Matrix3d> strainForTets;
+  if (!hasElements) {
+    BuildElementCache();
+  } else if (hasPrev && plastiscity) {
+    UpdatePlasticity(timestep);
+  }
 
-  if (!hasPrev || plastiscity) {
-    strainForTets.resize(tets.size() * 16);
-    printf("Number of tets: %i\n", tets.size());
-    for (int i = 0; i < tets.size(); i++) {
-      Particle *p1,*p2,*p3,*p4;
-      GetTetP(i, p1, p2, p3, p4);
+  if (solverSettings.solver == SOLVER_MODAL) {
+    ModalStep(timestep);
+    return;
+  }
+  // whatever runs now moves the particles off the modal state
+  hasModalState = false;
 
-      Eigen::Vector3d y0, y1, y2, y3;
-
-      y1 << tets[i].inversePos(0,0), tets[i].inversePos(0,1), tets[i].inversePos(0,2);
-      y2 << tets[i].inversePos(1,0), tets[i].inversePos(1,1), tets[i].inversePos(1,2);
-      y3 << tets[i].inversePos(2,0), tets[i].inversePos(2,1), tets[i].inversePos(2,2);
-
-      y0 = -1* y1 - y2 - y3;
-
-      double v = volConserve;
-      double a =  tets[i].posDet * tets[i].k * (1 - v) / ((1 + v) * (1 - 2 * v));
-      double b =  tets[i].posDet * tets[i].k *  v / ((1 + v) * (1 - 2 * v));
-      double c =  tets[i].posDet * tets[i].k * (1 - 2 * v) / ((1 + v) * (1 - 2 * v));
-      Eigen::Matrix3d middle1, middle2;
-      Eigen::Matrix3d temp, temp1,temp2,temp3,temp4;
-      middle1 << a, b, b,
-                 b, a, b,
-                 b, b, a;
-      middle2 << c, 0, 0,
-                 0, c, 0,
-                 0, 0, c;
-
-      for (int index1 = 0; index1 < 4; ++index1) {
-        Eigen::Vector3d *j0;
-        switch(index1) {
-          case 0: j0 = &y0; break;
-          case 1: j0 = &y1; break;
-          case 2: j0 = &y2; break;
-          case 3: j0 = &y3; break;
-        }
-        temp1 << (*j0)[0], 0, 0,
-                 0, (*j0)[1], 0,
-                 0, 0, (*j0)[2];
-        temp3 << (*j0)[1], 0, (*j0)[2],
-                 (*j0)[0], (*j0)[2], 0,
-                 0, (*j0)[1], (*j0)[0];
-        for (int index2 = 0; index2 < 4; ++index2) {
-          Eigen::Vector3d *j1;
-          switch(index2) {
-            case 0: j1 = &y0; break;
-            case 1: j1 = &y1; break;
-            case 2: j1 = &y2; break;
-            case 3: j1 = &y3; break;
-          }
-          temp2 << (*j1)[0], 0, 0,
-                   0, (*j1)[1], 0,
-                   0, 0, (*j1)[2];
-          temp4 << (*j1)[1], (*j1)[0], 0,
-                   0, (*j1)[2], (*j1)[1],
-                   (*j1)[2], 0, (*j1)[0];
-          temp = temp1 * middle1 * temp2 + temp3 * middle2 * temp4;
-          strainForTets[i * 16 + index1 * 4 + index2] = temp;
-        }
-      }
-    }
+  if (solverSettings.solver == SOLVER_PROJECTIVE_DYNAMICS) {
+    if (!hasColoring) ColorTets();
+    if (ProjectiveDynamics(timestep)) return;
+  }
+
+  if (!corotational && solverSettings.prefactorLinear && ImplicitEulerPrefactored(timestep)) {
+    return;
+  }
+
+  if (solverSettings.solver == SOLVER_MATRIX_FREE_CG) {
+    if (!hasColoring) ColorTets();
+    ImplicitEulerMatrixFree(timestep);
+    return;
   }
 
   iesA.resize(vSize, vSize);
@@ -133,25 +904,24 @@ void ParticleSystem::ImplicitEulerSparse(double timestep) {
 
   iesdfdxtriplet.clear();
 
+  bool persistent = solverSettings.persistentPattern;
+  if (!hasColoring) ColorTets();
+  if (persistent) {
+    if (!hasPattern) BuildSystemPattern();
+    std::fill(patternK.valuePtr(), patternK.valuePtr() + patternK.nonZeros(), 0.0);
+  }
+  double* kvalues = patternK.valuePtr();
+
   Eigen::VectorXd f_0(vSize);
   f_0.setZero();
 
-  for (int i = 0; i < tets.size(); i++) {
-    Particle *p1,*p2,*p3,*p4;
-    GetTetP(i, p1, p2, p3, p4);
-
+  if (corotational) ComputeRotations(solverSettings.polarRotations);
+  auto assembleTet = [&](int i) {
+    // sleeping rows are filtered down to their mass anyway
+    if (TetAsleep(i)) return;
     Eigen::Matrix3d Rot;
     if (corotational) {
-      Eigen::Matrix3d m1,m2;
-      Eigen::Vector3d r0,r1,r2;
-      m1 << p2->x - p1->x, p3->x - p1->x, p4->x - p1->x;
-      m2 = m1 * tets[i].inversePos;
-      r0 = (m2.col(0)).normalized();
-      r1 = (m2.col(1) - r0.dot(m2.col(1)) * r0).normalized();
-      r2 = r0.cross(r1);
-      Rot.col(0) = r0;
-      Rot.col(1) = r1;
-      Rot.col(2) = r2;
+      Rot = tetRot[i];
 
       //Eigen::Matrix3d mapping1, mapping2;
       //mapping1 << p2->x - p1->x, p3->x - p1->x, p4->x - p1->x;
@@ -160,121 +930,918 @@ void ParticleSystem::ImplicitEulerSparse(double timestep) {
       //trans1 = mapping2;
       //Rot = trans1.rotation();
     }
+    Eigen::Matrix3d blocks[16];
+    TetBlocks(strainForTets[i], blocks);
+    Eigen::Vector3d rest[4];
+    if (corotational) TetRestPositions(i, rest);
     // for all combos
     for (int index1 = 0; index1 < 4; ++index1) {
       for (int index2 = 0; index2 < 4; ++index2) {
-        Eigen::Matrix3d* temp = &(strainForTets[i * 16 + index1 * 4 + index2]);
+        Eigen::Matrix3d* temp = &(blocks[index1 * 4 + index2]);
         Eigen::Matrix3d kelement;
         if (corotational) {
-          if (tets[i].to[index1] >= 0) {
-            kelement = Rot * (*temp) * Rot.transpose();
-            Eigen::Vector3d oPos;
-
-
-            if (tets[i].to[index2] >= 0) {
-              oPos = startPos[tets[i].to[index2]];
-              Eigen::Vector3d force = (Rot * (*temp) * oPos);
-              f_0[tets[i].to[index1] * 3] += force[0];
-              f_0[tets[i].to[index1] * 3 + 1] += force[1];
-              f_0[tets[i].to[index1] * 3 + 2] += force[2];
-              PushbackMatrix3d(iesdfdxtriplet, kelement, tets[i].to[index1] * 3, tets[i].to[index2] * 3, 1);
-            } else {
-              switch(index2) {
-                case 0: oPos = p1->x; break;
-                case 1: oPos = p2->x; break;
-                case 2: oPos = p3->x; break;
-                case 3: oPos = p4->x; break;
-              }
-              Eigen::Vector3d force = (Rot * (*temp) * oPos);
-              force -= kelement * oPos; // since the fixed point doesn't exist in the solver
-              f_0[tets[i].to[index1] * 3] += force[0];
-              f_0[tets[i].to[index1] * 3 + 1] += force[1];
-              f_0[tets[i].to[index1] * 3 + 2] += force[2];
-            }
-          }
+          kelement = Rot * (*temp) * Rot.transpose();
+          Eigen::Vector3d force = (Rot * (*temp) * rest[index2]);
+          f_0[tets[i].to[index1] * 3] += force[0];
+          f_0[tets[i].to[index1] * 3 + 1] += force[1];
+          f_0[tets[i].to[index1] * 3 + 2] += force[2];
         } else {
-          if (tets[i].to[index1] < 0 || tets[i].to[index2] < 0) continue;
           kelement = *temp;
+        }
+        if (persistent) {
+          ScatterMatrix3d(kvalues, &(tetBlockSlots[(i * 16 + index1 * 4 + index2) * 3]), kelement);
+        } else {
           PushbackMatrix3d(iesdfdxtriplet, kelement, tets[i].to[index1] * 3, tets[i].to[index2] * 3, 1);
         }
       }
     }
+  };
+  if (persistent) {
+    // tets of one color share no vertex, so their writes into f_0 and
+    // the pattern never overlap
+    ForEachTetByColor(assembleTet);
+  } else {
+    for (int i = 0; i < tets.size(); i++) {
+      assembleTet(i);
+    }
   }
+  if (!corotational && !plasticTets.empty()) f_0 = plasticForce;
   tempTime = glfwGetTime();
   tripletTime += tempTime - curTime;
   curTime = tempTime;
 
-  iesdfdx.setFromTriplets(iesdfdxtriplet.begin(), iesdfdxtriplet.end());
+  if (!persistent) {
+    // explicit zeros so particles outside every tet still have a diagonal
+    for (int i = 0; i < vSize; i++) {
+      iesdfdxtriplet.push_back(Eigen::Triplet<double>(i, i, 0));
+    }
+    iesdfdx.setFromTriplets(iesdfdxtriplet.begin(), iesdfdxtriplet.end());
+  }
 
   tempTime = glfwGetTime();
   fromTripletTime += tempTime - curTime;
   curTime = tempTime;
 
-  Eigen::VectorXd v_0(vSize);
-  Eigen::VectorXd x_0(vSize);
-  Eigen::VectorXd f_ext(vSize);
+  // the particle arrays are used in place, only the linear model needs x
+  // relative to the rest shape
+  Eigen::Map<Eigen::VectorXd> v_0 = particles.Velocities();
+  Eigen::VectorXd relative;
+  if (!corotational) {
+    relative = particles.Positions();
+    for (int i = 0; i < particles.size(); i++) {
+      relative.segment<3>(i * 3) -= startPos[i];
+    }
+  }
+  Eigen::Ref<const Eigen::VectorXd> x_0 = corotational ? Eigen::Ref<const Eigen::VectorXd>(particles.Positions())
+                                                       : Eigen::Ref<const Eigen::VectorXd>(relative);
+  Eigen::VectorXd f_ext = particles.Forces();
+  for (int i = 0; i < particles.size(); i++) {
+    f_ext[i * 3 + 1] += gravity * massDiag[i * 3 + 1];
+  }
+  Eigen::VectorXd newv(vSize);
+  //newv = v_0 + timestep * iesdfdx * x_0;
+
+  if (persistent) {
+    // A = M + h c M - h^2 K, written over the values of the fixed pattern
+    double* avalues = patternA.valuePtr();
+    for (int i = 0; i < patternA.nonZeros(); i++) {
+      avalues[i] = -timestep * timestep * kvalues[i];
+    }
+    for (int i = 0; i < vSize; i++) {
+      avalues[diagSlots[i]] += massDiag[i] * (1 + timestep * dampness);
+    }
+    iesb = massDiag.cwiseProduct(v_0) + timestep * (patternK * x_0 - f_0 + f_ext);
+  } else {
+    // the diagonal of K is in the triplets, so the mass is added in place
+    iesb = massDiag.cwiseProduct(v_0) + timestep * (iesdfdx * x_0 - f_0 + f_ext);
+    iesA = -timestep * timestep * iesdfdx;
+    iesA.diagonal() += (1 + timestep * dampness) * massDiag;
+  }
+  FilterPinned(persistent ? patternA : iesA, freeDofs);
+  iesb = iesb.cwiseProduct(freeDofs);
+  tempTime = glfwGetTime();
+  equationSetupTime += tempTime - curTime;
+  curTime = tempTime;
+
+  const Eigen::SparseMatrix<double>& A = persistent ? patternA : iesA;
+  if (hasPrev) newv = vdiffprev;
+  // mixed precision only has Eigen's diagonal preconditioner in float
+  if (solverSettings.mixedPrecision) {
+    SolveMixed(A, iesb, newv, hasPrev, solverSettings);
+  } else switch (solverSettings.preconditioner) {
+    case PRECONDITIONER_DIAGONAL:
+      SolveCG<Eigen::DiagonalPreconditioner<double> >(A, iesb, newv, hasPrev, solverSettings);
+      break;
+    case PRECONDITIONER_BLOCK_JACOBI:
+      SolveCG<BlockJacobiPreconditioner>(A, iesb, newv, hasPrev, solverSettings);
+      break;
+    case PRECONDITIONER_INCOMPLETE_CHOLESKY:
+      SolveCG<Eigen::IncompleteCholesky<double> >(A, iesb, newv, hasPrev, solverSettings);
+      break;
+    case PRECONDITIONER_LAGGED_FACTORIZATION:
+      if (UpdateLaggedFactor(A, solverSettings)) {
+        laggedIterations = SolveCGFactored(A, iesb, newv, hasPrev, solverSettings, laggedFactor);
+      } else {
+        SolveCG<BlockJacobiPreconditioner>(A, iesb, newv, hasPrev, solverSettings);
+      }
+      break;
+    case PRECONDITIONER_MULTIGRID: {
+      if (!hasMultigrid || multigridLevels != solverSettings.multigridLevels) BuildMultigrid();
+      Eigen::ConjugateGradient<Eigen::SparseMatrix<double>, Eigen::Lower | Eigen::Upper, MultigridPreconditioner> cg;
+      cg.preconditioner().setProlongations(&prolongations);
+      RunCG(cg, A, iesb, newv, hasPrev, solverSettings);
+      break;
+    }
+    case PRECONDITIONER_DOMAIN_DECOMPOSITION: {
+      int count = solverSettings.domainCount > 0 ? solverSettings.domainCount : ThreadPool::GetNumThreads();
+      if (!hasSubdomains || subdomainCount != count) BuildSubdomains();
+      Eigen::ConjugateGradient<Eigen::SparseMatrix<double>, Eigen::Lower | Eigen::Upper, SchwarzPreconditioner> cg;
+      cg.preconditioner().setSolver(&subdomains);
+      RunCG(cg, A, iesb, newv, hasPrev, solverSettings);
+      break;
+    }
+  }
+
+  tempTime = glfwGetTime();
+  curTime = tempTime;
+
+  // preconditioners like multigrid leave a little velocity on pinned dofs
+  newv = newv.cwiseProduct(freeDofs);
+  vdiffprev = newv;
+  hasPrev = true;
+
+  StoreVelocities(newv, timestep);
+}
+
+// Regenerates the mesh with tetgen at coarser volume bounds and interpolates
+// every level onto the one above it at rest. Scenes that weren't generated
+// from a PLC get no levels, which leaves a direct solve.
+void ParticleSystem::BuildMultigrid() {
+  std::vector<std::vector<double> > levelPoints;
+  std::vector<std::vector<int> > levelTets;
+  int levels = solverSettings.multigridLevels;
+  if (meshFromBar) {
+    MeshGen::GenerateBarLevels(levels, levelPoints, levelTets);
+  } else if (!meshFile.empty()) {
+    MeshGen::GenerateMeshLevels(levels, levelPoints, levelTets, meshFile.c_str());
+  }
+  prolongations.clear();
+  std::vector<Eigen::Vector3d> nodes = startPos;
+  for (int l = 0; l < levelPoints.size(); ++l) {
+    std::vector<Eigen::Vector3d> kept;
+    prolongations.push_back(Multigrid::BarycentricProlongation(nodes, levelPoints[l], levelTets[l], kept));
+    nodes.swap(kept);
+    printf("Multigrid level %i: %i nodes\n", l + 1, nodes.size());
+  }
+  multigridLevels = levels;
+  hasMultigrid = true;
+}
+
+// Splits the rest mesh into one subdomain per thread, or domainCount of them
+void ParticleSystem::BuildSubdomains() {
+  subdomainCount = solverSettings.domainCount > 0 ? solverSettings.domainCount : ThreadPool::GetNumThreads();
+  std::vector<int> tetVertices(tets.size() * 4);
+  for (int i = 0; i < tets.size(); i++) {
+    for (int j = 0; j < 4; ++j) {
+      tetVertices[i * 4 + j] = tets[i].to[j];
+    }
+  }
+  subdomains.Partition(startPos, tetVertices, subdomainCount);
+  printf("Subdomains: %i\n", subdomains.Count());
+  hasSubdomains = true;
+}
+
+// Linear FEM step against a cached factorization of A. The factorization is
+// only redone when the material or the timestep changes, returns false when
+// A can't be factored, now or before with the same pins, masses and
+// material, so the caller falls back to CG.
+bool ParticleSystem::ImplicitEulerPrefactored(double timestep) {
+  double tempTime = glfwGetTime();
+  double curTime = tempTime;
+
+  int vSize = 3 * particles.size();
+  bool materialChanged = stiffness != factorStiffness || volConserve != factorVolConserve || dampness != factorDampness;
+  if (linearFailed && !materialChanged) return false;
+  linearFailed = false;
+  bool material = !hasLinearFactor || materialChanged;
+  if (material) {
+    if (!hasPattern) BuildSystemPattern();
+    linearK = patternK;
+    double* kvalues = linearK.valuePtr();
+    std::fill(kvalues, kvalues + linearK.nonZeros(), 0.0);
+    for (int i = 0; i < tets.size(); i++) {
+      Eigen::Matrix3d blocks[16];
+      TetBlocks(strainForTets[i], blocks);
+      for (int k = 0; k < 16; k++) {
+        ScatterMatrix3d(kvalues, &(tetBlockSlots[(i * 16 + k) * 3]), blocks[k]);
+      }
+    }
+    linearA = linearK;
+  }
+  // plastic flow only updated the values of the yielding tets in linearK
+  bool values = material || linearKChanged;
+  linearKChanged = false;
+  tempTime = glfwGetTime();
+  tripletTime += tempTime - curTime;
+  curTime = tempTime;
 
-  std::vector<Eigen::Triplet<double>> masstriplet;
+  if (values || timestep != linearATimestep) {
+    // A = M + h c M - h^2 K
+    const double* kvalues = linearK.valuePtr();
+    double* avalues = linearA.valuePtr();
+    for (int i = 0; i < linearA.nonZeros(); i++) {
+      avalues[i] = -timestep * timestep * kvalues[i];
+    }
+    for (int i = 0; i < vSize; i++) {
+      avalues[diagSlots[i]] += (1 + timestep * dampness) * massDiag[i];
+    }
+    FilterPinned(linearA, unpinnedDofs);
+    linearATimestep = timestep;
+  }
 
+  Eigen::VectorXd x_0 = particles.Positions();
+  Eigen::VectorXd b = timestep * particles.Forces() + massDiag.cwiseProduct(particles.Velocities());
   for (int i = 0; i < particles.size(); i++) {
-    v_0[i * 3] = particles[i].v[0];
-    v_0[i * 3 + 1] = particles[i].v[1];
-    v_0[i * 3 + 2] = particles[i].v[2];
-    if (corotational) {
-      x_0[i * 3] = particles[i].x[0];
-      x_0[i * 3 + 1] = particles[i].x[1];
-      x_0[i * 3 + 2] = particles[i].x[2];
-    } else {
-      x_0[i * 3] = particles[i].x[0] - startPos[i][0];
-      x_0[i * 3 + 1] = particles[i].x[1] - startPos[i][1];
-      x_0[i * 3 + 2] = particles[i].x[2] - startPos[i][2];
+    x_0.segment<3>(i * 3) -= startPos[i];
+    b[i * 3 + 1] += timestep * gravity * massDiag[i * 3 + 1];
+  }
+  b += timestep * (linearK * x_0);
+  if (!plasticTets.empty()) b -= timestep * plasticForce;
+  b = b.cwiseProduct(freeDofs);
+  tempTime = glfwGetTime();
+  equationSetupTime += tempTime - curTime;
+  curTime = tempTime;
+
+  if (values || fabs(timestep - factorTimestep) > solverSettings.refactorTimestepChange * factorTimestep) {
+    if (material) linearFactor.analyzePattern(linearA);
+    linearFactor.factorize(linearA);
+    if (linearFactor.info() != Eigen::Success) {
+      printf("Could not factor the linear system, falling back to CG\n");
+      hasLinearFactor = false;
+      linearFailed = true;
+      factorStiffness = stiffness;
+      factorVolConserve = volConserve;
+      factorDampness = dampness;
+      return false;
     }
-    f_ext[i * 3] = particles[i].f[0];
-    f_ext[i * 3 + 1] = gravity/particles[i].iMass + particles[i].f[1];
-    f_ext[i * 3 + 2] = particles[i].f[2];
-    masstriplet.push_back(Eigen::Triplet<double>(i*3,i*3,1/particles[i].iMass));
-    masstriplet.push_back(Eigen::Triplet<double>(i*3+1,i*3+1,1/particles[i].iMass));
-    masstriplet.push_back(Eigen::Triplet<double>(i*3+2,i*3+2,1/particles[i].iMass));
+    hasLinearFactor = true;
+    factorTimestep = timestep;
+    factorStiffness = stiffness;
+    factorVolConserve = volConserve;
+    factorDampness = dampness;
+    tempTime = glfwGetTime();
+    preconditionerTime += tempTime - curTime;
+    curTime = tempTime;
   }
+
   Eigen::VectorXd newv(vSize);
-  //newv = v_0 + timestep * iesdfdx * x_0;
+  if (timestep == factorTimestep) {
+    newv = linearFactor.solve(b);
+    double bnorm = b.norm();
+    RecordSolve(0, bnorm > 0 ? (linearA * newv - b).norm() / bnorm : 0);
+    solveTime += glfwGetTime() - curTime;
+  } else {
+    // the factorization is of a nearby A, close enough that CG on the exact
+    // system converges in a couple of iterations
+    if (hasPrev) newv = vdiffprev;
+    SolveCGFactored(linearA, b, newv, hasPrev, solverSettings, linearFactor);
+  }
+  // A only has the pins filtered out, sleeping islands solve to zero on their
+  // own but are masked out exactly
+  newv = newv.cwiseProduct(freeDofs);
 
-  iesA.setFromTriplets(masstriplet.begin(), masstriplet.end());
+  vdiffprev = newv;
+  hasPrev = true;
 
-  iesb = iesA * v_0 + timestep * (iesdfdx * x_0 - f_0 + f_ext);
-  iesA = iesA - (timestep * -1 * dampness * iesA + timestep * timestep * iesdfdx);
-  Eigen::ConjugateGradient<Eigen::SparseMatrix<double> > cg;
-  cg.setTolerance(.000001);
-  cg.setMaxIterations(20);
+  StoreVelocities(newv, timestep);
+  return true;
+}
 
+// Projective dynamics global matrix and its factorization for timestep.
+// Returns false and sets pdFailed when it can't be factored.
+bool ParticleSystem::FactorProjectiveDynamics(double timestep) {
+  int n = particles.size();
+  double h2 = timestep * timestep;
+  Eigen::VectorXd unpinnedVerts(n);
+  for (int i = 0; i < n; i++) {
+    unpinnedVerts[i] = unpinnedDofs[i * 3];
+  }
+  std::vector<Eigen::Triplet<double> > triplets;
+  for (int i = 0; i < n; i++) {
+    triplets.push_back(Eigen::Triplet<double>(i, i, (1 + timestep * dampness) * massDiag[i * 3] / h2));
+  }
+  for (int i = 0; i < tets.size(); i++) {
+    const TetStiffness& s = strainForTets[i];
+    for (int a = 0; a < 4; ++a) {
+      for (int b = 0; b < 4; ++b) {
+        triplets.push_back(Eigen::Triplet<double>(tets[i].to[a], tets[i].to[b], fabs(s.c) * s.y[a].dot(s.y[b])));
+      }
+    }
+  }
+  pdL.resize(n, n);
+  pdL.setFromTriplets(triplets.begin(), triplets.end());
+  pdFiltered = pdL;
+  FilterPinned(pdFiltered, unpinnedVerts);
+  if (!hasPDFactor) pdFactor.analyzePattern(pdFiltered);
+  pdFactor.factorize(pdFiltered);
+  if (pdFactor.info() != Eigen::Success) {
+    printf("Could not factor the projective dynamics system, falling back to CG\n");
+    hasPDFactor = false;
+    pdFailed = true;
+    pdStiffness = stiffness;
+    pdVolConserve = volConserve;
+    pdDampness = dampness;
+    return false;
+  }
+  hasPDFactor = true;
+  pdTimestep = timestep;
+  pdExactTimestep = timestep;
+  pdStiffness = stiffness;
+  pdVolConserve = volConserve;
+  pdDampness = dampness;
+  return true;
+}
+
+// Projective dynamics step on the energy w/2 |F - R|^2 per tet, w the size
+// of the shear term of the tet's stiffness (posDet is negative for the
+// flipped meshes). The local step fits every tet's rotation to
+// its deformation gradient, the global step solves the prefactored system for
+// x, y and z at once. The matrix is only refactored when the material or the
+// pins change or the timestep moves by more than refactorTimestepChange.
+// Smaller timestep changes only change the mass term on the diagonal, so
+// the global step runs CG on the exact matrix preconditioned by the factor.
+// Returns false when it can't be factored, now or before with the same pins,
+// masses and material, so the caller falls back to CG.
+bool ParticleSystem::ProjectiveDynamics(double timestep) {
+  double tempTime = glfwGetTime();
+  double curTime = tempTime;
+
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor> Coords;
+  int n = particles.size();
+  double h2 = timestep * timestep;
+  Eigen::VectorXd unpinnedVerts(n);
+  for (int i = 0; i < n; i++) {
+    unpinnedVerts[i] = unpinnedDofs[i * 3];
+  }
+
+  bool materialChanged = stiffness != pdStiffness || volConserve != pdVolConserve || dampness != pdDampness;
+  if (pdFailed && !materialChanged) return false;
+  pdFailed = false;
+  bool material = !hasPDFactor || materialChanged;
+  if (material || fabs(timestep - pdTimestep) > solverSettings.refactorTimestepChange * pdTimestep) {
+    if (!FactorProjectiveDynamics(timestep)) return false;
+    tempTime = glfwGetTime();
+    preconditionerTime += tempTime - curTime;
+    curTime = tempTime;
+  }
+  bool exact = timestep != pdTimestep;
+  if (exact && timestep != pdExactTimestep) {
+    pdExact = pdFiltered;
+    double massChange = (1 + timestep * dampness) / h2 - (1 + pdTimestep * dampness) / (pdTimestep * pdTimestep);
+    for (int i = 0; i < n; i++) {
+      pdExact.coeffRef(i, i) += massChange * massDiag[i * 3];
+    }
+    pdExactTimestep = timestep;
+  }
+  const Eigen::SparseMatrix<double>& L = exact ? pdExact : pdFiltered;
+
+  // Inertia, damping and external forces. Pinned rows solve to pinnedPos and
+  // free rows get their coupling to pinned vertices moved to the right side.
+  Eigen::Map<Eigen::VectorXd> x = particles.Positions();
+  Eigen::VectorXd x_0 = x;
+  Eigen::VectorXd inertia = massDiag.cwiseProduct((1 + timestep * dampness) * x_0 + timestep * particles.Velocities()) / h2 +
+                            particles.Forces();
+  for (int i = 0; i < n; i++) {
+    inertia[i * 3 + 1] += gravity * massDiag[i * 3 + 1];
+  }
+  Eigen::VectorXd pinnedVerts = Eigen::VectorXd::Ones(n) - unpinnedVerts;
+  // sleeping islands are solved along with the rest since the matrix only has
+  // the pins filtered out, but they don't couple to anything awake and their
+  // rows are dropped from the result
+  Eigen::VectorXd awakeVerts(n);
+  for (int i = 0; i < n; i++) {
+    awakeVerts[i] = freeDofs[i * 3];
+  }
+  Coords pinned = pinnedVerts.asDiagonal() * Eigen::Map<const Coords>(pinnedPos.data(), n, 3);
+  Coords fixedB = unpinnedVerts.asDiagonal() * Eigen::Map<const Coords>(inertia.data(), n, 3) +
+                  L.diagonal().asDiagonal() * pinned - unpinnedVerts.asDiagonal() * (pdL * pinned);
 
+  Eigen::Map<Coords> X(x.data(), n, 3);
+  x += timestep * particles.Velocities();
+  X = unpinnedVerts.asDiagonal() * X + pinned;
+  if (!corotational) {
+    tetRot.assign(tets.size(), Eigen::Matrix3d::Identity());
+  }
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>, Eigen::Lower | Eigen::Upper, FactorizationPreconditioner> cg;
+  if (exact) {
+    cg.setTolerance(solverSettings.tolerance);
+    cg.setMaxIterations(solverSettings.maxIterations);
+    cg.preconditioner().setFactorization(&pdFactor);
+    cg.compute(pdExact);
+  }
   tempTime = glfwGetTime();
   equationSetupTime += tempTime - curTime;
   curTime = tempTime;
 
-  cg.compute(iesA);
-  if (hasPrev) newv = cg.solveWithGuess(iesb, vdiffprev);
-  else newv = cg.solve(iesb);
+  int iterations = corotational ? solverSettings.pdIterations : 1;
+  double change = 0;
+  Coords B;
+  for (int it = 0; it < iterations; ++it) {
+    // local step, w G^T R for every tet
+    if (corotational) ComputeRotations(true);
+    B = fixedB;
+    auto localTet = [&](int i) {
+      if (TetAsleep(i)) return;
+      const TetStiffness& s = strainForTets[i];
+      const Eigen::Matrix3d& Rot = tetRot[i];
+      for (int a = 0; a < 4; ++a) {
+        int to = tets[i].to[a];
+        B.row(to) += (unpinnedVerts[to] * fabs(s.c)) * (Rot * s.y[a]).transpose();
+      }
+    };
+    ForEachTetByColor(localTet);
+    tempTime = glfwGetTime();
+    tripletTime += tempTime - curTime;
+    curTime = tempTime;
+
+    // global step, CG from the current positions when off the factored timestep
+    Eigen::MatrixXd solved;
+    if (exact) {
+      solved.resize(n, 3);
+      for (int c = 0; c < 3; ++c) {
+        Eigen::VectorXd rhs = B.col(c);
+        Eigen::VectorXd guess = X.col(c);
+        solved.col(c) = cg.solveWithGuess(rhs, guess);
+      }
+    } else {
+      solved = pdFactor.solve(Eigen::MatrixXd(B));
+    }
+    double norm = (awakeVerts.asDiagonal() * solved).norm();
+    change = norm > 0 ? (awakeVerts.asDiagonal() * (solved - X)).norm() / norm : 0;
+    X = solved;
+    tempTime = glfwGetTime();
+    solveTime += tempTime - curTime;
+    curTime = tempTime;
+  }
+  RecordSolve(iterations, change);
+
+  Eigen::VectorXd newv = freeDofs.cwiseProduct(x - x_0) / timestep;
+  x = x_0;
+  vdiffprev = newv;
+  hasPrev = true;
+
+  StoreVelocities(newv, timestep);
+  return true;
+}
 
+// Lowest modes of K over the unpinned dofs against the lumped mass, from the
+// cache next to the mesh file when one was written for the same mesh,
+// material, masses and pins. Then the rotation every mode gives each vertex, the
+// volume weighted average of half the curl of the mode over its tets.
+void ParticleSystem::BuildModes() {
+  int vSize = 3 * particles.size();
+  std::vector<int> freeIndex(vSize, -1);
+  int freeCount = 0;
+  for (int i = 0; i < vSize; i++) {
+    if (unpinnedDofs[i] != 0) freeIndex[i] = freeCount++;
+  }
+  // the pins, the rest shape and the element stiffness (which has the
+  // material and any plastic rest shapes) go in whole as hashes
+  unsigned long long restHash = HashDoubles(startPos.empty() ? NULL : startPos[0].data(), startPos.size() * 3);
+  for (int i = 0; i < tets.size(); i++) {
+    const TetStiffness& s = strainForTets[i];
+    for (int a = 0; a < 4; ++a) {
+      restHash = HashDoubles(s.y[a].data(), 3, restHash);
+    }
+    double d[3] = { s.a, s.b, s.c };
+    restHash = HashDoubles(d, 3, restHash);
+  }
+  std::vector<double> key;
+  key.push_back(vSize);
+  key.push_back(tets.size());
+  key.push_back(solverSettings.modalCount);
+  PushHash(key, HashDoubles(unpinnedDofs.data(), vSize));
+  PushHash(key, HashDoubles(massDiag.data(), vSize));
+  PushHash(key, restHash);
+  // a basis for a plastic rest shape is only good until the next yield, so
+  // it would just replace the one for the original shape
+  std::string cache = meshFile.empty() || !plasticTets.empty() ? "" : meshFile + ".modes";
+  if (cache.empty() || !Modal::LoadBasis(cache, key, modeBasis, modeEigenvalues)) {
+    double start = glfwGetTime();
+    std::vector<Eigen::Triplet<double> > triplets;
+    for (int i = 0; i < tets.size(); i++) {
+      Eigen::Matrix3d blocks[16];
+      TetBlocks(strainForTets[i], blocks);
+      for (int a = 0; a < 4; ++a) {
+        for (int b = 0; b < 4; ++b) {
+          for (int r = 0; r < 3; ++r) {
+            for (int c = 0; c < 3; ++c) {
+              int row = freeIndex[tets[i].to[a] * 3 + r];
+              int col = freeIndex[tets[i].to[b] * 3 + c];
+              // K is the force derivative, the eigenproblem wants -K
+              if (row >= 0 && col >= 0) {
+                triplets.push_back(Eigen::Triplet<double>(row, col, -blocks[a * 4 + b](r, c)));
+              }
+            }
+          }
+        }
+      }
+    }
+    Eigen::SparseMatrix<double> K(freeCount, freeCount);
+    K.setFromTriplets(triplets.begin(), triplets.end());
+    Eigen::VectorXd mass(freeCount);
+    for (int i = 0; i < vSize; i++) {
+      if (freeIndex[i] >= 0) mass[freeIndex[i]] = massDiag[i];
+    }
+    Eigen::MatrixXd freeBasis;
+    Modal::LowestModes(K, mass, solverSettings.modalCount, freeBasis, modeEigenvalues);
+    modeBasis.setZero(vSize, freeBasis.cols());
+    for (int i = 0; i < vSize; i++) {
+      if (freeIndex[i] >= 0) modeBasis.row(i) = freeBasis.row(freeIndex[i]);
+    }
+    printf("%i modes in %f s\n", (int)modeBasis.cols(), glfwGetTime() - start);
+    if (!cache.empty()) Modal::SaveBasis(cache, key, modeBasis, modeEigenvalues);
+  }
+
+  int r = modeBasis.cols();
+  modeRotations.setZero(vSize, r);
+  std::vector<double> weight(particles.size(), 0.0);
+  for (int i = 0; i < tets.size(); i++) {
+    const TetStiffness& s = strainForTets[i];
+    // y_a x u_a summed over the vertices is the curl
+    Eigen::MatrixXd curl = Eigen::MatrixXd::Zero(3, r);
+    for (int a = 0; a < 4; ++a) {
+      Eigen::Matrix3d cross;
+      cross << 0, -s.y[a][2], s.y[a][1],
+               s.y[a][2], 0, -s.y[a][0],
+               -s.y[a][1], s.y[a][0], 0;
+      curl += cross * modeBasis.middleRows<3>(tets[i].to[a] * 3);
+    }
+    double volume = fabs(tets[i].posDet);
+    for (int a = 0; a < 4; ++a) {
+      modeRotations.middleRows<3>(tets[i].to[a] * 3) += (.5 * volume) * curl;
+      weight[tets[i].to[a]] += volume;
+    }
+  }
+  for (int i = 0; i < particles.size(); i++) {
+    if (weight[i] > 0) modeRotations.middleRows<3>(i * 3) /= weight[i];
+  }
+  modeCount = solverSettings.modalCount;
+  modeStiffness = stiffness;
+  modeVolConserve = volConserve;
+  hasModes = true;
+  hasModalState = false;
+}
+
+// Implicit Euler on the mode amplitudes, the reduced system is diagonal so
+// (1 + h c + h^2 omega^2) qdot = qdot_0 + h (Phi^T f - omega^2 q) is solved
+// mode by mode. Particles are rebuilt as x = rest + Phi q, with modal warping
+// every vertex's displacement is turned by the rotation the modes give it
+// so large bending doesn't stretch the mesh. Contact, the ground and the mouse only
+// reach q through the velocity change they made since the last step.
+void ParticleSystem::ModalStep(double timestep) {
+  double tempTime = glfwGetTime();
+  double curTime = tempTime;
+  if (!hasModes || solverSettings.modalCount != modeCount || stiffness != modeStiffness ||
+      volConserve != modeVolConserve) {
+    BuildModes();
+    tempTime = glfwGetTime();
+    preconditionerTime += tempTime - curTime;
+    curTime = tempTime;
+  }
+  int n = particles.size();
+  Eigen::Map<Eigen::VectorXd> x = particles.Positions();
+  Eigen::Map<Eigen::VectorXd> v = particles.Velocities();
+  Eigen::VectorXd rest(n * 3);
+  for (int i = 0; i < n; i++) {
+    rest.segment<3>(i * 3) = startPos[i];
+  }
+  if (!hasModalState) {
+    // the basis is M-orthonormal, so Phi^T M is the projection onto it
+    modeQ = modeBasis.transpose() * massDiag.cwiseProduct(x - rest);
+    modeQDot = modeBasis.transpose() * massDiag.cwiseProduct(v);
+    modeWrittenVel = v;
+    hasModalState = true;
+  }
+  modeQDot += modeBasis.transpose() * massDiag.cwiseProduct(v - modeWrittenVel);
+
+  Eigen::VectorXd f_ext = particles.Forces();
+  for (int i = 0; i < n; i++) {
+    f_ext[i * 3 + 1] += gravity * massDiag[i * 3 + 1];
+  }
+  // q is measured from startPos, so plastic rest shapes enter as a force
+  if (!plasticTets.empty()) f_ext -= plasticForce;
+  Eigen::VectorXd f_r = modeBasis.transpose() * f_ext;
+  Eigen::ArrayXd denom = 1 + timestep * dampness + timestep * timestep * modeEigenvalues.array();
+  modeQDot = ((modeQDot + timestep * (f_r - modeEigenvalues.cwiseProduct(modeQ))).array() / denom).matrix();
+  modeQ += timestep * modeQDot;
   tempTime = glfwGetTime();
   solveTime += tempTime - curTime;
   curTime = tempTime;
 
+  Eigen::VectorXd target = modeBasis * modeQ;
+  if (corotational && solverSettings.modalWarping) {
+    Eigen::VectorXd w = modeRotations * modeQ;
+    for (int i = 0; i < n; i++) {
+      Eigen::Vector3d axis = w.segment<3>(i * 3);
+      double angle = axis.norm();
+      if (angle > 1e-12) {
+        // rotation averaged over the step from rest, the integral of
+        // R(s w) for s from 0 to 1 like Choi and Ko
+        Eigen::Vector3d k = axis / angle;
+        Eigen::Matrix3d cross;
+        cross << 0, -k[2], k[1],
+                 k[2], 0, -k[0],
+                 -k[1], k[0], 0;
+        Eigen::Matrix3d warp = Eigen::Matrix3d::Identity() + ((1 - cos(angle)) / angle) * cross +
+                               ((angle - sin(angle)) / angle) * cross * cross;
+        target.segment<3>(i * 3) = warp * target.segment<3>(i * 3);
+      }
+    }
+  }
+  target += rest;
+  Eigen::VectorXd newv = freeDofs.cwiseProduct(target - x) / timestep;
+  tempTime = glfwGetTime();
+  equationSetupTime += tempTime - curTime;
+  RecordSolve(0, 0);
   vdiffprev = newv;
   hasPrev = true;
+  StoreVelocities(newv, timestep);
+  modeWrittenVel = newv;
+}
+
+void ParticleSystem::StoreVelocities(const Eigen::VectorXd& newv, double timestep) {
+  prevFEXT = particles.Forces();
+  prevVel = particles.Velocities();
+  prevPos = particles.Positions();
+
+  particles.Forces().setZero();
+  particles.Velocities() = newv;
+  particles.Positions() += timestep * particles.Velocities();
+  particles.LastPositions() = particles.Positions();
+}
+
+void ParticleSystem::MatrixFreeProduct(const Eigen::VectorXd& p, Eigen::VectorXd& y, double timestep) {
+  double h2 = timestep * timestep;
+  y.setZero(p.size());
+  auto productTet = [&](int i) {
+    if (TetAsleep(i)) return;
+    const Eigen::Matrix3d& Rot = tetRot[i];
+    // pinned dofs are masked out of p, they contribute nothing to the product
+    Eigen::Vector3d local[4];
+    for (int index = 0; index < 4; ++index) {
+      int dof = tets[i].to[index] * 3;
+      local[index] = Rot.transpose() * freeDofs.segment<3>(dof).cwiseProduct(p.segment<3>(dof));
+    }
+    Eigen::Vector3d sum[4];
+    ApplyTetStiffness(strainForTets[i], local, sum);
+    for (int index1 = 0; index1 < 4; ++index1) {
+      y.segment<3>(tets[i].to[index1] * 3) -= h2 * (Rot * sum[index1]);
+    }
+  };
+  ForEachTetByColor(productTet);
+  // and the pinned rows only keep their mass
+  y = mfMass.cwiseProduct(p) + freeDofs.cwiseProduct(y);
+}
+
+// Rotation of every tet into tetRot. The edges are gathered into structure of
+// arrays form so the kernels can work on several tets per instruction. While
+// islands sleep only the awake tets are gathered, along with their inverse
+// rest shapes, and the sleeping ones keep their last rotation.
+void ParticleSystem::ComputeRotations(bool polar) {
+  int count = tets.size();
+  tetRot.resize(count);
+  bool gather = sleepingIslands > 0;
+  int batch = gather ? awakeTets.size() : count;
+  if (batch == 0) return;
+  rotEdges.resize(batch * 9);
+  rotBatch.resize(batch * 9);
+  if (gather) rotAwakeInverse.resize(batch * 9);
+  const double* inverse = gather ? &rotAwakeInverse[0] : &rotInverse[0];
+  RotationBatch::Method method = polar ? RotationBatch::POLAR : RotationBatch::GRAM_SCHMIDT;
+  ThreadPool::ParallelFor(batch, [&](int begin, int end) {
+    for (int k = begin; k < end; k++) {
+      int i = gather ? awakeTets[k] : k;
+      ParticlePtr p1, p2, p3, p4;
+      GetTetP(i, p1, p2, p3, p4);
+      for (int j = 0; j < 3; ++j) {
+        rotEdges[j * batch + k] = p2->x[j] - p1->x[j];
+        rotEdges[(3 + j) * batch + k] = p3->x[j] - p1->x[j];
+        rotEdges[(6 + j) * batch + k] = p4->x[j] - p1->x[j];
+      }
+      if (gather) {
+        for (int c = 0; c < 9; ++c) {
+          rotAwakeInverse[c * batch + k] = rotInverse[c * count + i];
+        }
+      }
+    }
+    RotationBatch::Extract(method, begin, end, batch, &rotEdges[0], inverse, &rotBatch[0]);
+    for (int k = begin; k < end; k++) {
+      int i = gather ? awakeTets[k] : k;
+      for (int c = 0; c < 9; ++c) {
+        tetRot[i](c % 3, c / 3) = rotBatch[c * batch + k];
+      }
+    }
+  });
+}
+
+// Solves (M + h c M - h^2 K) v = M v_0 + h (K x_0 - f_0 + f_ext) without ever
+// assembling K: only the per tet rotations and strainForTets are touched.
+void ParticleSystem::ImplicitEulerMatrixFree(double timestep) {
+  double tempTime = glfwGetTime();
+  double curTime = tempTime;
+
+  int vSize = 3 * particles.size();
+  double h2 = timestep * timestep;
+  tetRot.resize(tets.size());
+  mfMass = (1 + timestep * dampness) * massDiag;
+
+  Eigen::VectorXd mv = massDiag.cwiseProduct(particles.Velocities());
+  Eigen::VectorXd f_ext = particles.Forces();
+  Eigen::VectorXd elastic(vSize);
+  std::vector<Eigen::Matrix3d> diagBlocks(particles.size());
+  elastic.setZero();
 
   for (int i = 0; i < particles.size(); i++) {
-    prevFEXT[i] = particles[i].f;
-    prevVel[i] = particles[i].v;
-    prevPos[i] = particles[i].x;
+    f_ext[i * 3 + 1] += gravity * massDiag[i * 3 + 1];
+    diagBlocks[i] = mfMass.segment<3>(i * 3).asDiagonal();
+  }
+
+  // K x_0 - f_0 tet by tet: R K (R^T x - rest)
+  if (corotational) ComputeRotations(solverSettings.polarRotations);
+  auto setupTet = [&](int i) {
+    if (TetAsleep(i)) return;
+    ParticlePtr p[4];
+    GetTetP(i, p[0], p[1], p[2], p[3]);
+    if (!corotational) tetRot[i].setIdentity();
+    const Eigen::Matrix3d& Rot = tetRot[i];
+    Eigen::Vector3d local[4];
+    for (int index = 0; index < 4; ++index) {
+      local[index] = Rot.transpose() * p[index]->x;
+    }
+    Eigen::Vector3d rest[4];
+    TetRestPositions(i, rest);
+    for (int index = 0; index < 4; ++index) {
+      local[index] -= rest[index];
+    }
+    Eigen::Vector3d sum[4];
+    ApplyTetStiffness(strainForTets[i], local, sum);
+    for (int index1 = 0; index1 < 4; ++index1) {
+      int to = tets[i].to[index1];
+      elastic.segment<3>(to * 3) += Rot * sum[index1];
+      diagBlocks[to] -= h2 * (Rot * TetBlock(strainForTets[i], index1, index1) * Rot.transpose());
+    }
+  };
+  ForEachTetByColor(setupTet);
+
+  tempTime = glfwGetTime();
+  tripletTime += tempTime - curTime;
+  curTime = tempTime;
 
-    particles[i].f << 0,0,0;
-    particles[i].v[0] = newv[i * 3];
-    particles[i].v[1] = newv[i * 3 + 1];
-    particles[i].v[2] = newv[i * 3 + 2];
-    particles[i].x += timestep * particles[i].v;
-    particles[i].lx = particles[i].x;
+  Eigen::VectorXd b = freeDofs.cwiseProduct(mv + timestep * (elastic + f_ext));
+  // the diagonal blocks of the filtered system, mass alone on pinned dofs
+  for (int i = 0; i < particles.size(); i++) {
+    Eigen::Matrix3d mass = mfMass[i * 3] * Eigen::Matrix3d::Identity();
+    Eigen::DiagonalMatrix<double, 3> free(freeDofs.segment<3>(i * 3));
+    diagBlocks[i] = mass + free * (diagBlocks[i] - mass) * free;
+  }
+
+  tempTime = glfwGetTime();
+  equationSetupTime += tempTime - curTime;
+  curTime = tempTime;
+
+  // There is no assembled matrix to factor, so incomplete Cholesky, the
+  // lagged factorization and multigrid fall back to the block Jacobi of the
+  // diagonal blocks
+  bool blockJacobi = solverSettings.preconditioner != PRECONDITIONER_DIAGONAL;
+  BlockJacobiPreconditioner blockPreconditioner;
+  Eigen::VectorXd invDiag(vSize);
+  if (blockJacobi) {
+    blockPreconditioner.factorizeBlocks(diagBlocks);
+  } else {
+    for (int i = 0; i < vSize; i++) {
+      invDiag[i] = 1 / diagBlocks[i / 3](i % 3, i % 3);
+    }
+  }
+
+  tempTime = glfwGetTime();
+  preconditionerTime += tempTime - curTime;
+  curTime = tempTime;
+
+  // Preconditioned CG with the same stopping rule as Eigen's
+  Eigen::VectorXd x(vSize), r(vSize), z(vSize), dir(vSize), Ad(vSize);
+  if (hasPrev && vdiffprev.size() == vSize) x = vdiffprev;
+  else x.setZero();
+  double tol = solverSettings.tolerance;
+  int iterations = 0;
+  double bNorm2 = b.squaredNorm();
+  if (bNorm2 == 0) {
+    x.setZero();
+    r.setZero();
+    bNorm2 = 1;
+  } else {
+    MatrixFreeProduct(x, Ad, timestep);
+    r = b - Ad;
+    if (blockJacobi) z = blockPreconditioner.solve(r);
+    else z = invDiag.cwiseProduct(r);
+    dir = z;
+    double rz = r.dot(z);
+    while (iterations < solverSettings.maxIterations && r.squaredNorm() > tol * tol * bNorm2) {
+      MatrixFreeProduct(dir, Ad, timestep);
+      double alpha = rz / dir.dot(Ad);
+      x += alpha * dir;
+      r -= alpha * Ad;
+      if (blockJacobi) z = blockPreconditioner.solve(r);
+      else z = invDiag.cwiseProduct(r);
+      double rzNew = r.dot(z);
+      dir = z + (rzNew / rz) * dir;
+      rz = rzNew;
+      iterations++;
+    }
+  }
+
+  tempTime = glfwGetTime();
+  solveTime += tempTime - curTime;
+  curTime = tempTime;
+  RecordSolve(iterations, sqrt(r.squaredNorm() / bNorm2));
+
+  x = x.cwiseProduct(freeDofs);
+  vdiffprev = x;
+  hasPrev = true;
+  StoreVelocities(x, timestep);
+}
+
+// Runs the same steps from the current state with every solver and prints
+// the time per step, then puts the particles, the plastic rest shapes and
+// the caches that depend on them back the way they were. The prefactored
+// linear solve would stand in for both CG solvers, so it is off meanwhile.
+void ParticleSystem::BenchmarkSolvers(int steps, double timestep) {
+  const char* names[] = { "Eigen CG", "Matrix free CG" };
+  int solverCount = 2;
+  ParticleArray saved = particles;
+  Eigen::VectorXd savedGuess = vdiffprev;
+  bool savedHasPrev = hasPrev;
+  Eigen::VectorXd savedPrev[3] = { prevPos, prevVel, prevFEXT };
+  SolverSettings savedSettings = solverSettings;
+  double savedTimes[5] = { tripletTime, fromTripletTime, equationSetupTime, solveTime, preconditionerTime };
+  int savedCounts[2] = { solveCount, iterationCount };
+  double savedResidual = residualSum;
+  std::vector<Tetrahedra> savedTets = tets;
+  std::vector<TetStiffness> savedStrain = strainForTets;
+  std::vector<int> savedPlasticTets = plasticTets;
+  std::vector<char> savedIsPlastic = isPlasticTet;
+  Eigen::VectorXd savedPlasticForce = plasticForce;
+  std::vector<double> savedRotInverse = rotInverse;
+  std::vector<Eigen::Matrix3d> savedRot = tetRot;
+  Eigen::SparseMatrix<double> savedLinearK = linearK;
+  bool savedFlags[4] = { linearKChanged, hasPDFactor, hasModes, hasModalState };
+  solverSettings.prefactorLinear = false;
+  for (int s = 0; s < solverCount; ++s) {
+    particles = saved;
+    vdiffprev = savedGuess;
+    hasPrev = savedHasPrev;
+    tets = savedTets;
+    strainForTets = savedStrain;
+    plasticTets = savedPlasticTets;
+    isPlasticTet = savedIsPlastic;
+    plasticForce = savedPlasticForce;
+    rotInverse = savedRotInverse;
+    tetRot = savedRot;
+    solverSettings.solver = (SolverType) s;
+    double start = glfwGetTime();
+    for (int i = 0; i < steps; ++i) {
+      ImplicitEulerSparse(timestep);
+    }
+    double elapsed = glfwGetTime() - start;
+    printf("%s: %f ms per step over %i steps\n", names[s], 1000 * elapsed / steps, steps);
   }
+  particles = saved;
+  vdiffprev = savedGuess;
+  hasPrev = savedHasPrev;
+  prevPos = savedPrev[0];
+  prevVel = savedPrev[1];
+  prevFEXT = savedPrev[2];
+  solverSettings = savedSettings;
+  tets = savedTets;
+  strainForTets = savedStrain;
+  plasticTets = savedPlasticTets;
+  isPlasticTet = savedIsPlastic;
+  plasticForce = savedPlasticForce;
+  rotInverse = savedRotInverse;
+  tetRot = savedRot;
+  linearK = savedLinearK;
+  linearKChanged = savedFlags[0];
+  hasPDFactor = savedFlags[1];
+  hasModes = savedFlags[2];
+  hasModalState = savedFlags[3];
+  tripletTime = savedTimes[0];
+  fromTripletTime = savedTimes[1];
+  equationSetupTime = savedTimes[2];
+  solveTime = savedTimes[3];
+  preconditionerTime = savedTimes[4];
+  solveCount = savedCounts[0];
+  iterationCount = savedCounts[1];
+  residualSum = savedResidual;
 }
 
 //void ParticleSystem::ImplicitEulerSparse(double timestep) {
@@ -418,7 +1985,7 @@ void ParticleSystem::ImplicitEulerSparse(double timestep) {
   //Compute spring forces
   int sSize = tets.size();
   for (int i = 0; i < sSize; i++) {
-    Particle *p1,*p2,*p3,*p4;
+    ParticlePtr p1, p2, p3, p4;
     GetTetP(i, p1, p2, p3, p4);
 
     Eigen::Matrix3d temp;
@@ -454,7 +2021,7 @@ void ParticleSystem::ImplicitEulerSparse(double timestep) {
     //stressTensor = greenStrainTensor;
     // Lets loop over faces and apply stress
     for(int j = 0; j < 4; j++) {
-      Particle *j0, *j1, *j2;
+      ParticlePtr j0, j1, j2;
       switch(j) {
         case 0:
           j0 = p1; j1 = p3; j2 = p2; break;
@@ -3,6 +3,8 @@
 #include "draw_delegate.h"
 #include "particle_system.h"
 #include "scene.h"
+#include "rotation_batch.h"
+#include "Eigen/Dense"
 
 #include <imgui.h>
 #include "imgui_impl.h"
@@ -12,6 +14,7 @@
 #include <string.h>
 #include <dirent.h>
 
+#include <algorithm>
 #include <vector>
 #include <string>
 namespace {
@@ -40,6 +43,65 @@ void LoadModelList() {
   }
 }
 
+// The per tet code the batched kernels replace
+Eigen::Matrix3d EigenRotation(const Eigen::Matrix3d& m1, const Eigen::Matrix3d& inversePos) {
+  Eigen::Matrix3d m2, Rot;
+  m2 = m1 * inversePos;
+  Rot.col(0) = m2.col(0).normalized();
+  Rot.col(1) = (m2.col(1) - Rot.col(0).dot(m2.col(1)) * Rot.col(0)).normalized();
+  Rot.col(2) = Rot.col(0).cross(Rot.col(1));
+  return Rot;
+}
+
+// Prints tets per second of the per tet Eigen code and of both batched
+// rotation methods on count random tets
+void BenchmarkRotations(int count) {
+  // rest shapes and deformations within 20% of a random rotation
+  std::vector<double> edges(9 * count), inversePos(9 * count), rot(9 * count);
+  std::vector<Eigen::Matrix3d> edgeMats(count), inverseMats(count), rotMats(count);
+  srand(1);
+  for (int i = 0; i < count; ++i) {
+    Eigen::Matrix3d rest = Eigen::Matrix3d::Identity() + .2 * Eigen::Matrix3d::Random();
+    Eigen::Matrix3d R = Eigen::Quaterniond(Eigen::Vector4d::Random()).normalized().toRotationMatrix();
+    inverseMats[i] = rest.inverse();
+    edgeMats[i] = R * (Eigen::Matrix3d::Identity() + .2 * Eigen::Matrix3d::Random()) * rest;
+    for (int c = 0; c < 9; ++c) {
+      edges[c * count + i] = edgeMats[i](c % 3, c / 3);
+      inversePos[c * count + i] = inverseMats[i](c % 3, c / 3);
+    }
+  }
+  int repeats = 10;
+  double start = glfwGetTime();
+  for (int k = 0; k < repeats; ++k) {
+    for (int i = 0; i < count; ++i) {
+      rotMats[i] = EigenRotation(edgeMats[i], inverseMats[i]);
+    }
+  }
+  double eigenTime = glfwGetTime() - start;
+  printf("Rotations, %s kernels\n", RotationBatch::InstructionSet());
+  printf("  per tet Eigen:          %.2f M tets/s\n", count * repeats / eigenTime * 1e-6);
+  const char* names[] = { "batched Gram-Schmidt", "batched polar" };
+  for (int method = RotationBatch::GRAM_SCHMIDT; method <= RotationBatch::POLAR; ++method) {
+    start = glfwGetTime();
+    for (int k = 0; k < repeats; ++k) {
+      RotationBatch::Extract((RotationBatch::Method) method, 0, count, count, &edges[0], &inversePos[0], &rot[0]);
+    }
+    double time = glfwGetTime() - start;
+    double difference = 0;
+    double orthogonality = 0;
+    for (int i = 0; i < count; ++i) {
+      Eigen::Matrix3d R;
+      for (int c = 0; c < 9; ++c) {
+        R(c % 3, c / 3) = rot[c * count + i];
+      }
+      difference = std::max(difference, (R - rotMats[i]).cwiseAbs().maxCoeff());
+      orthogonality = std::max(orthogonality, (R.transpose() * R - Eigen::Matrix3d::Identity()).cwiseAbs().maxCoeff());
+    }
+    printf("  %s: %.2f M tets/s, max difference from Gram-Schmidt %.2g, from orthogonal %.2g\n",
+           names[method], count * repeats / time * 1e-6, difference, orthogonality);
+  }
+}
+
 void error_callback(int error, const char* description) {
   fprintf(stderr, "%s\n", description);
 }
@@ -322,6 +384,7 @@ int main(int argc, const char **argv) {
       static float strainDisplaySize = strainSize;
       static float groundStiffness = 1000.0f;
       static float mouseStiffness = 10000.0f;
+      static float density = 0.0f;
       ImGui::Text("Stiffness (Young's modulus)");
       ImGui::SliderFloat("##stiffness", &stiffness, 0.0f, 10000.0f, "%.3f", 2.0);
       ImGui::Text("Volume Conservation (Poisson's ratio)");
@@ -336,11 +399,189 @@ int main(int argc, const char **argv) {
       ImGui::SliderFloat("##groundstiffness", &groundStiffness, 0.0f, 10000.0f);
       ImGui::Text("Mouse spring stiffness");
       ImGui::SliderFloat("##mousestiffness", &mouseStiffness, 0.0f, 100000.0f);
+      ImGui::Text("Density (0 keeps the scene's particle masses)");
+      ImGui::SliderFloat("##density", &density, 0.0f, 10.0f);
       static bool useRollback = false;
       ImGui::Checkbox("Use rollback col system?", &useRollback);
+      static bool plasticity = false;
+      static float plasticYield = .05f;
+      static float plasticCreep = 5.0f;
+      static float plasticMax = .5f;
+      ImGui::Checkbox("Plasticity?", &plasticity);
+      if (plasticity) {
+        ImGui::Text("Yield strain");
+        ImGui::SliderFloat("##plasticYield", &plasticYield, 0.0f, 1.0f);
+        ImGui::Text("Creep per second");
+        ImGui::SliderFloat("##plasticCreep", &plasticCreep, 0.0f, 100.0f, "%.3f", 2.0);
+        ImGui::Text("Max plastic strain");
+        ImGui::SliderFloat("##plasticMax", &plasticMax, 0.0f, 2.0f);
+      }
+
+      ImGui::Separator();
+
+      static SolverSettings solverSettings;
+      static float refactorTimestepChange = solverSettings.refactorTimestepChange;
+      const char* solverTypes[] = {
+        "Eigen CG",
+        "Matrix free CG",
+        "Projective dynamics",
+        "XPBD",
+        "Reduced modal"
+      };
+      int solverTypeLength = 5;
+      if (ImGui::Button("Select Solver.."))
+          ImGui::OpenPopup("select_solver");
+      ImGui::SameLine();
+      ImGui::Text(solverTypes[solverSettings.solver]);
+      if (ImGui::BeginPopup("select_solver"))
+      {
+          for (int i = 0; i < solverTypeLength; i++)
+              if (ImGui::Selectable(solverTypes[i])) {
+                  solverSettings.solver = (SolverType) i;
+                  m.SetSolverSettings(solverSettings);
+              }
+          ImGui::EndPopup();
+      }
+      if (ImGui::Checkbox("Persistent sparsity pattern?", &solverSettings.persistentPattern))
+        m.SetSolverSettings(solverSettings);
+      if (solverSettings.solver == SOLVER_PROJECTIVE_DYNAMICS) {
+        ImGui::Text("Projective dynamics iterations");
+        if (ImGui::SliderInt("##pdIterations", &solverSettings.pdIterations, 1, 50))
+          m.SetSolverSettings(solverSettings);
+      }
+      if (solverSettings.solver == SOLVER_XPBD) {
+        ImGui::Text("XPBD iterations");
+        if (ImGui::SliderInt("##xpbdIterations", &solverSettings.xpbdIterations, 1, 50))
+          m.SetSolverSettings(solverSettings);
+        if (ImGui::Checkbox("Tet edge constraints?", &solverSettings.xpbdEdges))
+          m.SetSolverSettings(solverSettings);
+      }
+      if (solverSettings.solver == SOLVER_MODAL) {
+        ImGui::Text("Modes");
+        if (ImGui::SliderInt("##modalCount", &solverSettings.modalCount, 1, 100))
+          m.SetSolverSettings(solverSettings);
+        if (ImGui::Checkbox("Modal warping?", &solverSettings.modalWarping))
+          m.SetSolverSettings(solverSettings);
+      }
+      const char* preconditionerTypes[] = {
+        "Diagonal",
+        "Block Jacobi 3x3",
+        "Incomplete Cholesky",
+        "Lagged factorization",
+        "Multigrid",
+        "Domain decomposition"
+      };
+      int preconditionerTypeLength = 6;
+      if (ImGui::Button("Select Preconditioner.."))
+          ImGui::OpenPopup("select_preconditioner");
+      ImGui::SameLine();
+      ImGui::Text(preconditionerTypes[solverSettings.preconditioner]);
+      if (ImGui::BeginPopup("select_preconditioner"))
+      {
+          for (int i = 0; i < preconditionerTypeLength; i++)
+              if (ImGui::Selectable(preconditionerTypes[i])) {
+                  solverSettings.preconditioner = (PreconditionerType) i;
+                  m.SetSolverSettings(solverSettings);
+              }
+          ImGui::EndPopup();
+      }
+      if (solverSettings.preconditioner == PRECONDITIONER_LAGGED_FACTORIZATION) {
+        ImGui::Text("Frames between refactoring");
+        if (ImGui::SliderInt("##refactorInterval", &solverSettings.refactorInterval, 1, 300))
+          m.SetSolverSettings(solverSettings);
+        ImGui::Text("CG iterations that force a refactor");
+        if (ImGui::SliderInt("##refactorIterations", &solverSettings.refactorIterations, 1, 200))
+          m.SetSolverSettings(solverSettings);
+      }
+      if (solverSettings.preconditioner == PRECONDITIONER_MULTIGRID) {
+        ImGui::Text("Coarse multigrid levels");
+        if (ImGui::SliderInt("##multigridLevels", &solverSettings.multigridLevels, 1, 4))
+          m.SetSolverSettings(solverSettings);
+      }
+      if (solverSettings.preconditioner == PRECONDITIONER_DOMAIN_DECOMPOSITION) {
+        ImGui::Text("Subdomains (0 for one per thread)");
+        if (ImGui::SliderInt("##domainCount", &solverSettings.domainCount, 0, 64))
+          m.SetSolverSettings(solverSettings);
+      }
+      if (ImGui::Checkbox("Polar decomposition rotations?", &solverSettings.polarRotations))
+        m.SetSolverSettings(solverSettings);
+      if (ImGui::Checkbox("Mixed precision CG?", &solverSettings.mixedPrecision))
+        m.SetSolverSettings(solverSettings);
+      if (ImGui::Checkbox("Prefactor linear FEM?", &solverSettings.prefactorLinear))
+        m.SetSolverSettings(solverSettings);
+      ImGui::Text("Timestep change before refactoring");
+      if (ImGui::SliderFloat("##refactorChange", &refactorTimestepChange, 0.0f, 1.0f)) {
+        solverSettings.refactorTimestepChange = refactorTimestepChange;
+        m.SetSolverSettings(solverSettings);
+      }
+      if (ImGui::Checkbox("Adaptive substeps?", &solverSettings.adaptiveTimestep))
+        m.SetSolverSettings(solverSettings);
+      if (solverSettings.adaptiveTimestep) {
+        static float substepTolerance = solverSettings.substepTolerance;
+        static float frameBudget = solverSettings.frameBudget * 1000;
+        ImGui::Text("Substep position error");
+        if (ImGui::SliderFloat("##substepTolerance", &substepTolerance, .0001f, .1f, "%.4f", 4.0)) {
+          solverSettings.substepTolerance = substepTolerance;
+          m.SetSolverSettings(solverSettings);
+        }
+        ImGui::Text("Frame budget ms");
+        if (ImGui::SliderFloat("##frameBudget", &frameBudget, 1.0f, 200.0f)) {
+          solverSettings.frameBudget = frameBudget / 1000;
+          m.SetSolverSettings(solverSettings);
+        }
+        int substeps;
+        double nextSubstep, dropped;
+        m.GetStepInfo(substeps, nextSubstep, dropped);
+        char buffer[1000];
+        snprintf(buffer, 1000, "Substeps %i, next %.2f ms, dropped %.2f ms", substeps, nextSubstep * 1000, dropped * 1000);
+        ImGui::Text(buffer);
+      }
+      if (ImGui::Checkbox("Sleep resting parts?", &solverSettings.sleeping))
+        m.SetSolverSettings(solverSettings);
+      if (solverSettings.sleeping) {
+        ImGui::Text("Quiet frames before sleeping");
+        if (ImGui::SliderInt("##sleepFrames", &solverSettings.sleepFrames, 1, 300))
+          m.SetSolverSettings(solverSettings);
+        int islands, asleep;
+        m.GetSleepInfo(islands, asleep);
+        char buffer[1000];
+        snprintf(buffer, 1000, "%i of %i parts asleep", asleep, islands);
+        ImGui::Text(buffer);
+      }
+      ImGui::Text("Max CG iterations");
+      if (ImGui::SliderInt("##maxIterations", &solverSettings.maxIterations, 1, 200))
+        m.SetSolverSettings(solverSettings);
+      {
+        static int lastSolves = 0, lastIterations = 0;
+        static double lastResidual = 0;
+        double t0, t1, t2, t3, t4, residualSum;
+        int solveSum, iterationSum;
+        m.GetProfileInfo(t0, t1, t2, t3, t4, solveSum, iterationSum, residualSum);
+        if (solveSum > lastSolves) {
+          char buffer[1000];
+          snprintf(buffer, 1000, "CG iterations %.1f, residual %.2g",
+                   (double)(iterationSum - lastIterations) / (solveSum - lastSolves),
+                   (residualSum - lastResidual) / (solveSum - lastSolves));
+          ImGui::Text(buffer);
+        }
+        lastSolves = solveSum;
+        lastIterations = iterationSum;
+        lastResidual = residualSum;
+      }
+      ImGui::Text("Solver threads (0 uses every core)");
+      if (ImGui::SliderInt("##threads", &solverSettings.numThreads, 0, 32))
+        m.SetSolverSettings(solverSettings);
+      if (ImGui::Button("Benchmark solvers"))
+        m.BenchmarkSolvers(60, 1.0/60.0);
+      ImGui::SameLine();
+      if (ImGui::Button("Benchmark rotations"))
+        BenchmarkRotations(100000);
 
       if (ImGui::Button("Apply Changes")) {
         m.SetSpringProperties(stiffness, volumeConservation, damping, gravity, groundStiffness, mouseStiffness, useRollback);
+        m.SetSolverSettings(solverSettings);
+        // rest shapes are only rebuilt once the plastic strain moved a tenth of the yield
+        m.SetPlasticity(plasticity, plasticYield, plasticCreep, plasticMax, plasticYield / 10);
         strainSize = strainDisplaySize;
         switch (selected_config) {
           case 0:
@@ -357,6 +598,7 @@ int main(int argc, const char **argv) {
               m.SetupMeshFile(meshFilename);
             break;
         }
+        if (density > 0) m.SetDensity(density);
       }
     }
     if (scene_p->fpsVec.size() != 0) {
@@ -387,10 +629,14 @@ int main(int argc, const char **argv) {
   printf("Simulate time %f\n", simulatetime/frames);
   printf("Draw time %f\n", drawtime/frames);
   printf("Frames %d\n", frames);
-  double triplet, fromtriplet, solve, setup;
-  m.GetProfileInfo(triplet, fromtriplet, solve, setup);
-  printf("Triplet %f, from %f, solve %f, setup %f\n", triplet/frames, fromtriplet/frames, solve/frames, setup/frames);
-  printf("Total %f\n", triplet + fromtriplet + solve + setup);
+  double triplet, fromtriplet, solve, setup, precondition, residual;
+  int solves, iterations;
+  m.GetProfileInfo(triplet, fromtriplet, solve, setup, precondition, solves, iterations, residual);
+  printf("Triplet %f, from %f, solve %f, setup %f, preconditioner %f\n", triplet/frames, fromtriplet/frames, solve/frames, setup/frames, precondition/frames);
+  printf("Total %f\n", triplet + fromtriplet + solve + setup + precondition);
+  if (solves > 0) {
+    printf("CG iterations per solve %f, relative residual %g\n", (double)iterations/solves, residual/solves);
+  }
 
   ImGui_ImplGlfw_Shutdown();
 
@@ -5,8 +5,8 @@
 #include <vector>
 #include <exception>
 
-void MeshGen::GenerateBar(double*& points, int& psize, std::vector<int>& tets, std::vector<int>& faces, std::vector<int>& facetotet) {
-  tetgenio in, out;
+// The bar's PLC, a 2x2x10 box with 1 based indices
+static void BarInput(tetgenio& in) {
   tetgenio::facet *f;
   tetgenio::polygon *p;
   int i;
@@ -130,6 +130,24 @@ void MeshGen::GenerateBar(double*& points, int& psize, std::vector<int>& tets, s
   in.facetmarkerlist[3] = 0;
   in.facetmarkerlist[4] = 0;
   in.facetmarkerlist[5] = 0;
+}
+
+// Points of a coarse level with z flipped like the regular mesh, and its tets
+// with indices starting from 0
+static void CopyLevel(tetgenio& out, std::vector<double>& points, std::vector<int>& tets) {
+  points.resize(out.numberofpoints*3);
+  for (int i = 0; i < out.numberofpoints*3; ++i) {
+    points[i] = (i%3 == 2) ? -1 * out.pointlist[i] : out.pointlist[i];
+  }
+  tets.resize(out.numberoftetrahedra*4);
+  for (int i = 0; i < out.numberoftetrahedra*4; ++i) {
+    tets[i] = out.tetrahedronlist[i] - out.firstnumber;
+  }
+}
+
+void MeshGen::GenerateBar(double*& points, int& psize, std::vector<int>& tets, std::vector<int>& faces, std::vector<int>& facetotet) {
+  tetgenio in, out;
+  BarInput(in);
 
   // Tetrahedralize the PLC. Switches are chosen to read a PLC (p),
   //   do quality mesh generation (q) with a specified quality bound
@@ -218,3 +236,45 @@ void MeshGen::GenerateMesh(double*& points, int& psize, std::vector<int>& tets,
     }
   }
 }
+
+void MeshGen::GenerateBarLevels(int levels, std::vector<std::vector<double> >& points, std::vector<std::vector<int> >& tets) {
+  tetgenio in;
+  BarInput(in);
+  points.resize(levels);
+  tets.resize(levels);
+  double volume = .5;
+  for (int l = 0; l < levels; ++l) {
+    tetgenio out;
+    char switches[64];
+    volume *= 8;
+    snprintf(switches, 64, "pQq1.414a%g", volume);
+    tetrahedralize(switches, &in, &out);
+    CopyLevel(out, points[l], tets[l]);
+  }
+}
+
+void MeshGen::GenerateMeshLevels(int levels, std::vector<std::vector<double> >& points, std::vector<std::vector<int> >& tets, const char* filename) {
+  tetgenio in;
+  points.clear();
+  tets.clear();
+  in.firstnumber = 0;
+  try{
+    if (!in.load_ply((char*)filename)) {
+      fprintf(stderr, "Load_ply failed\n");
+      return;
+    }
+    double volume = .5;
+    for (int l = 0; l < levels; ++l) {
+      tetgenio out;
+      char switches[64];
+      volume *= 8;
+      snprintf(switches, 64, "pQqa%g", volume);
+      tetrahedralize(switches, &in, &out);
+      points.emplace_back();
+      tets.emplace_back();
+      CopyLevel(out, points.back(), tets.back());
+    }
+  } catch (int e) {
+    fprintf(stderr, "Tetrahedralize aborted with %i\n", e);
+  }
+}
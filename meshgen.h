@@ -5,6 +5,11 @@
 namespace MeshGen {
   void GenerateBar(double*& points, int& psize, std::vector<int>& edges, std::vector<int>& faces, std::vector<int>& facetotet);
   void GenerateMesh(double*& points, int& psize, std::vector<int>& edges, std::vector<int>& faces, std::vector<int>& facetotet, const char*filename);
+  // Coarser tetrahedralizations of the same input for multigrid. Level l
+  // gets a volume bound 8^(l+1) times the regular one, points and tets are
+  // in the same layout as above.
+  void GenerateBarLevels(int levels, std::vector<std::vector<double> >& points, std::vector<std::vector<int> >& tets);
+  void GenerateMeshLevels(int levels, std::vector<std::vector<double> >& points, std::vector<std::vector<int> >& tets, const char* filename);
 };
 
 #endif
@@ -0,0 +1,93 @@
+#include "modal.h"
+#include "Eigen/SparseCholesky"
+#include "Eigen/Eigenvalues"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+
+namespace {
+// Iterations of the subspace iteration, and how little the wanted
+// eigenvalues may still change before it stops early
+const int subspaceIterations = 60;
+const double subspaceTolerance = 1e-8;
+
+const char basisMagic[8] = { 'M', 'O', 'D', 'E', 'S', '0', '0', '1' };
+};
+
+void Modal::LowestModes(const Eigen::SparseMatrix<double>& K, const Eigen::VectorXd& massDiag, int count,
+                        Eigen::MatrixXd& basis, Eigen::VectorXd& eigenvalues) {
+  int n = K.rows();
+  count = std::min(count, n);
+  // a few extra vectors make the wanted ones converge much faster
+  int width = std::min(std::max(count + 8, 2 * count), n);
+  // K + sigma M is positive definite even with rigid modes in K
+  double sigma = 1e-4 * K.diagonal().sum() / massDiag.sum();
+  Eigen::SparseMatrix<double> shifted = K;
+  shifted.diagonal() += sigma * massDiag;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > factor(shifted);
+  if (factor.info() != Eigen::Success) {
+    printf("Could not factor the stiffness for the modes\n");
+    basis.resize(n, 0);
+    eigenvalues.resize(0);
+    return;
+  }
+
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(n, width);
+  Eigen::VectorXd previous = Eigen::VectorXd::Zero(count);
+  Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::MatrixXd> reduced;
+  for (int it = 0; it < subspaceIterations; ++it) {
+    Eigen::MatrixXd Y = factor.solve(massDiag.asDiagonal() * X);
+    // Rayleigh-Ritz in the span of Y
+    Eigen::MatrixXd Kr = Y.transpose() * (K * Y);
+    Eigen::MatrixXd Mr = Y.transpose() * massDiag.asDiagonal() * Y;
+    reduced.compute(Kr, Mr);
+    if (reduced.info() != Eigen::Success) break;
+    X = Y * reduced.eigenvectors();
+    Eigen::VectorXd current = reduced.eigenvalues().head(count);
+    double change = (current - previous).cwiseAbs().maxCoeff();
+    previous = current;
+    if (change <= subspaceTolerance * std::max(current.cwiseAbs().maxCoeff(), 1e-12)) {
+      printf("Modes converged after %i iterations\n", it + 1);
+      break;
+    }
+  }
+  basis = X.leftCols(count);
+  eigenvalues = previous.cwiseMax(0.0);
+}
+
+bool Modal::LoadBasis(const std::string& path, const std::vector<double>& key,
+                      Eigen::MatrixXd& basis, Eigen::VectorXd& eigenvalues) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == NULL) return false;
+  char magic[8];
+  int header[3];
+  bool ok = fread(magic, 1, 8, file) == 8 && std::equal(magic, magic + 8, basisMagic) &&
+            fread(header, sizeof(int), 3, file) == 3 && header[2] == key.size();
+  std::vector<double> fileKey(ok ? header[2] : 0);
+  ok = ok && fread(&fileKey[0], sizeof(double), fileKey.size(), file) == fileKey.size() && fileKey == key;
+  if (ok) {
+    basis.resize(header[0], header[1]);
+    eigenvalues.resize(header[1]);
+    ok = fread(eigenvalues.data(), sizeof(double), header[1], file) == header[1] &&
+         fread(basis.data(), sizeof(double), basis.size(), file) == basis.size();
+  }
+  fclose(file);
+  if (ok) printf("Loaded %i modes from %s\n", header[1], path.c_str());
+  return ok;
+}
+
+void Modal::SaveBasis(const std::string& path, const std::vector<double>& key,
+                      const Eigen::MatrixXd& basis, const Eigen::VectorXd& eigenvalues) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    printf("Could not write %s\n", path.c_str());
+    return;
+  }
+  int header[3] = { (int)basis.rows(), (int)basis.cols(), (int)key.size() };
+  fwrite(basisMagic, 1, 8, file);
+  fwrite(header, sizeof(int), 3, file);
+  fwrite(&key[0], sizeof(double), key.size(), file);
+  fwrite(eigenvalues.data(), sizeof(double), eigenvalues.size(), file);
+  fwrite(basis.data(), sizeof(double), basis.size(), file);
+  fclose(file);
+}
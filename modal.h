@@ -0,0 +1,25 @@
+#ifndef MODAL_H__
+#define MODAL_H__
+
+#include "Eigen/Sparse"
+#include "Eigen/Dense"
+#include <string>
+#include <vector>
+
+namespace Modal {
+  // Lowest count eigenpairs of K phi = omega^2 M phi for a symmetric positive
+  // semidefinite K and diagonal M, by shift and invert subspace iteration.
+  // Rigid modes come out with omega^2 near 0. The columns of basis are
+  // M-orthonormal and eigenvalues are in ascending order.
+  void LowestModes(const Eigen::SparseMatrix<double>& K, const Eigen::VectorXd& massDiag, int count,
+                   Eigen::MatrixXd& basis, Eigen::VectorXd& eigenvalues);
+
+  // Basis cache next to the mesh file. key holds whatever the basis depends
+  // on, a file written for a different key doesn't load.
+  bool LoadBasis(const std::string& path, const std::vector<double>& key,
+                 Eigen::MatrixXd& basis, Eigen::VectorXd& eigenvalues);
+  void SaveBasis(const std::string& path, const std::vector<double>& key,
+                 const Eigen::MatrixXd& basis, const Eigen::VectorXd& eigenvalues);
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "multigrid.h"
+#include <algorithm>
+#include <math.h>
+
+namespace {
+// Sweeps of Gauss-Seidel before and after the coarse correction
+const int smoothingSteps = 2;
+
+// A is symmetric, so column i doubles as row i
+void GaussSeidel(const Eigen::SparseMatrix<double>& A, const Eigen::VectorXd& b, Eigen::VectorXd& x, bool forward) {
+  int n = A.cols();
+  for (int k = 0; k < n; ++k) {
+    int i = forward ? k : n - 1 - k;
+    double sum = 0;
+    double diag = 0;
+    for (Eigen::SparseMatrix<double>::InnerIterator it(A, i); it; ++it) {
+      if (it.row() == i) diag = it.value();
+      else sum += it.value() * x[it.row()];
+    }
+    if (diag != 0) x[i] = (b[i] - sum) / diag;
+  }
+}
+
+// Barycentric coordinates of p in a tet, the smallest one says how far
+// outside the tet p is
+Eigen::Vector4d Barycentric(const Eigen::Vector3d& p, const Eigen::Vector3d* x) {
+  Eigen::Matrix3d m;
+  m << x[1] - x[0], x[2] - x[0], x[3] - x[0];
+  Eigen::Vector3d l = m.inverse() * (p - x[0]);
+  return Eigen::Vector4d(1 - l.sum(), l[0], l[1], l[2]);
+}
+};
+
+Eigen::SparseMatrix<double> Multigrid::BarycentricProlongation(const std::vector<Eigen::Vector3d>& points,
+                                                               const std::vector<double>& coarsePoints,
+                                                               const std::vector<int>& coarseTets,
+                                                               std::vector<Eigen::Vector3d>& keptNodes) {
+  int nodeCount = coarsePoints.size() / 3;
+  int tetCount = coarseTets.size() / 4;
+  std::vector<Eigen::Vector3d> nodes(nodeCount);
+  for (int i = 0; i < nodeCount; ++i) {
+    nodes[i] << coarsePoints[i * 3], coarsePoints[i * 3 + 1], coarsePoints[i * 3 + 2];
+  }
+
+  // Bin the tets by bounding box in a uniform grid of about one tet per cell
+  Eigen::Vector3d lo = nodes[0], hi = nodes[0];
+  for (int i = 1; i < nodeCount; ++i) {
+    lo = lo.cwiseMin(nodes[i]);
+    hi = hi.cwiseMax(nodes[i]);
+  }
+  Eigen::Vector3d extent = (hi - lo).cwiseMax(1e-9);
+  double cell = cbrt(extent.prod() / std::max(tetCount, 1));
+  int dims[3];
+  for (int j = 0; j < 3; ++j) {
+    dims[j] = std::min(std::max((int)(extent[j] / cell), 1), 64);
+  }
+  auto cellOf = [&](const Eigen::Vector3d& p, int* c) {
+    for (int j = 0; j < 3; ++j) {
+      c[j] = std::min(std::max((int)((p[j] - lo[j]) / extent[j] * dims[j]), 0), dims[j] - 1);
+    }
+  };
+  std::vector<std::vector<int> > grid(dims[0] * dims[1] * dims[2]);
+  for (int t = 0; t < tetCount; ++t) {
+    Eigen::Vector3d tlo = nodes[coarseTets[t * 4]], thi = tlo;
+    for (int k = 1; k < 4; ++k) {
+      tlo = tlo.cwiseMin(nodes[coarseTets[t * 4 + k]]);
+      thi = thi.cwiseMax(nodes[coarseTets[t * 4 + k]]);
+    }
+    int c0[3], c1[3];
+    cellOf(tlo, c0);
+    cellOf(thi, c1);
+    for (int z = c0[2]; z <= c1[2]; ++z)
+      for (int y = c0[1]; y <= c1[1]; ++y)
+        for (int x = c0[0]; x <= c1[0]; ++x)
+          grid[(z * dims[1] + y) * dims[0] + x].push_back(t);
+  }
+
+  std::vector<Eigen::Triplet<double> > triplets;
+  std::vector<int> column(nodeCount, -1);
+  keptNodes.clear();
+  for (int i = 0; i < points.size(); ++i) {
+    int c[3];
+    cellOf(points[i], c);
+    const std::vector<int>& candidates = grid[(c[2] * dims[1] + c[1]) * dims[0] + c[0]];
+    int best = -1;
+    Eigen::Vector4d bestWeights;
+    auto test = [&](int t) {
+      Eigen::Vector3d x[4];
+      for (int k = 0; k < 4; ++k) x[k] = nodes[coarseTets[t * 4 + k]];
+      Eigen::Vector4d w = Barycentric(points[i], x);
+      if (best < 0 || w.minCoeff() > bestWeights.minCoeff()) {
+        best = t;
+        bestWeights = w;
+      }
+    };
+    for (int k = 0; k < candidates.size(); ++k) test(candidates[k]);
+    // only points on or just outside the coarse boundary get here
+    if (best < 0 || bestWeights.minCoeff() < -1e-6) {
+      for (int t = 0; t < tetCount; ++t) test(t);
+    }
+    bestWeights = bestWeights.cwiseMax(0);
+    bestWeights /= bestWeights.sum();
+    for (int k = 0; k < 4; ++k) {
+      if (bestWeights[k] == 0) continue;
+      int node = coarseTets[best * 4 + k];
+      if (column[node] < 0) {
+        column[node] = keptNodes.size();
+        keptNodes.push_back(nodes[node]);
+      }
+      for (int j = 0; j < 3; ++j) {
+        triplets.push_back(Eigen::Triplet<double>(i * 3 + j, column[node] * 3 + j, bestWeights[k]));
+      }
+    }
+  }
+  Eigen::SparseMatrix<double> P(points.size() * 3, keptNodes.size() * 3);
+  P.setFromTriplets(triplets.begin(), triplets.end());
+  return P;
+}
+
+void MultigridPreconditioner::Cycle(int level, const Eigen::VectorXd& b, Eigen::VectorXd& x) const {
+  if (level == levels.size() - 1) {
+    x = coarseFactor.solve(b);
+    return;
+  }
+  const Eigen::SparseMatrix<double>& A = levels[level];
+  const Eigen::SparseMatrix<double>& P = (*prolongations)[level];
+  x.setZero(b.size());
+  for (int s = 0; s < smoothingSteps; ++s) GaussSeidel(A, b, x, true);
+  Eigen::VectorXd coarse;
+  Cycle(level + 1, P.transpose() * (b - A * x), coarse);
+  x += P * coarse;
+  for (int s = 0; s < smoothingSteps; ++s) GaussSeidel(A, b, x, false);
+}
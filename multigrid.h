@@ -0,0 +1,87 @@
+#ifndef MULTIGRID_H__
+#define MULTIGRID_H__
+
+#include "Eigen/Sparse"
+#include "Eigen/Dense"
+#include "Eigen/SparseCholesky"
+#include <vector>
+
+namespace Multigrid {
+  // Interpolates the nodes of a coarse tet mesh onto points, 3 dofs per point.
+  // Points outside every coarse tet use the closest one. Coarse nodes no point
+  // depends on are dropped and keptNodes gets the rest in column order.
+  Eigen::SparseMatrix<double> BarycentricProlongation(const std::vector<Eigen::Vector3d>& points,
+                                                      const std::vector<double>& coarsePoints,
+                                                      const std::vector<int>& coarseTets,
+                                                      std::vector<Eigen::Vector3d>& keptNodes);
+};
+
+// One V-cycle as the preconditioner of Eigen's ConjugateGradient. The coarse
+// operators are P^T A P, so fixed points and rotations carry over on their
+// own. Gauss-Seidel runs forward before and backward after the coarse
+// correction to keep the cycle symmetric, the coarsest level is factored.
+class MultigridPreconditioner {
+ public:
+  typedef Eigen::VectorXd::StorageIndex StorageIndex;
+  enum {
+    ColsAtCompileTime = Eigen::Dynamic,
+    MaxColsAtCompileTime = Eigen::Dynamic
+  };
+
+  MultigridPreconditioner() : prolongations(NULL), coarseNonZeros(-1) {}
+
+  // Finest level first, has to outlive the preconditioner
+  void setProlongations(const std::vector<Eigen::SparseMatrix<double> >* p) { prolongations = p; }
+
+  Eigen::Index rows() const { return levels.empty() ? 0 : levels[0].rows(); }
+  Eigen::Index cols() const { return rows(); }
+
+  template<typename MatType>
+  MultigridPreconditioner& analyzePattern(const MatType&) { return *this; }
+
+  template<typename MatType>
+  MultigridPreconditioner& factorize(const MatType& mat) {
+    int count = prolongations ? prolongations->size() : 0;
+    levels.resize(count + 1);
+    levels[0] = mat;
+    for (int l = 0; l < count; ++l) {
+      const Eigen::SparseMatrix<double>& P = (*prolongations)[l];
+      levels[l + 1] = P.transpose() * (levels[l] * P);
+    }
+    if (levels[count].nonZeros() != coarseNonZeros) {
+      coarseFactor.analyzePattern(levels[count]);
+      coarseNonZeros = levels[count].nonZeros();
+    }
+    coarseFactor.factorize(levels[count]);
+    return *this;
+  }
+
+  template<typename MatType>
+  MultigridPreconditioner& compute(const MatType& mat) {
+    return factorize(mat);
+  }
+
+  template<typename Rhs, typename Dest>
+  void _solve_impl(const Rhs& b, Dest& x) const {
+    Eigen::VectorXd result;
+    Cycle(0, b, result);
+    x = result;
+  }
+
+  template<typename Rhs>
+  inline const Eigen::Solve<MultigridPreconditioner, Rhs> solve(const Eigen::MatrixBase<Rhs>& b) const {
+    return Eigen::Solve<MultigridPreconditioner, Rhs>(*this, b.derived());
+  }
+
+  Eigen::ComputationInfo info() { return coarseFactor.info(); }
+
+ private:
+  void Cycle(int level, const Eigen::VectorXd& b, Eigen::VectorXd& x) const;
+
+  const std::vector<Eigen::SparseMatrix<double> >* prolongations;
+  std::vector<Eigen::SparseMatrix<double> > levels;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > coarseFactor;
+  int coarseNonZeros;
+};
+
+#endif
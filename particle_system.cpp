@@ -6,9 +6,11 @@
 #include "Eigen/Dense"
 #include "Eigen/IterativeLinearSolvers"
 #include <iostream>
+#include <algorithm>
 #include <math.h>
 #include "collision_system.h"
 #include "collision_system_pqp.h"
+#include "thread_pool.h"
 
 ParticleSystem::ParticleSystem() {
   stiffness = 1000;
@@ -18,6 +20,11 @@ ParticleSystem::ParticleSystem() {
   groundStiffness = 1000;
   mouseStiffness = 10000;
   plastiscity = false;
+  plasticYield = .05;
+  plasticCreep = 5;
+  plasticMax = .5;
+  plasticRefit = .005;
+  hasConstraints = false;
 #ifdef COLLISION_SELFCCD
   colSys = new CollisionSystem();
 #endif
@@ -26,6 +33,14 @@ ParticleSystem::ParticleSystem() {
 #endif
   useColSys = false;
   colRolBack = false;
+  meshFromBar = false;
+  substep = solverSettings.maxSubstep;
+  frameSubsteps = 0;
+  droppedTime = 0;
+  impactTime = 1;
+  hasIslands = false;
+  sleepingIslands = 0;
+  sleepGroundMode = -1;
 }
 
 ParticleSystem::~ParticleSystem() {
@@ -33,12 +48,53 @@ ParticleSystem::~ParticleSystem() {
 }
 
 void ParticleSystem::Update(double timestep, bool solveWithguess, bool coro, int groundMode) {
-  for (int i = 0; i < particles.size(); ++i) {
-    particles[i].mark = false;
-  }
   // Always solveWithguess
   // coro means whether to use corotational linear FEM or normal linear FEM
   corotational = coro;
+  if (!solverSettings.adaptiveTimestep) {
+    Step(timestep, groundMode);
+    return;
+  }
+  // Substeps from NextSubstep until the frame is covered or the wall clock
+  // budget runs out. Dropping the rest slows the simulation down instead of
+  // making the next frame even slower.
+  double start = glfwGetTime();
+  double remaining = timestep;
+  frameSubsteps = 0;
+  while (remaining > 0) {
+    double h = std::min(substep, remaining);
+    // don't leave a sliver for the next substep
+    if (remaining - h < solverSettings.minSubstep) h = remaining;
+    Step(h, groundMode);
+    frameSubsteps++;
+    remaining -= h;
+    substep = NextSubstep(h);
+    if (glfwGetTime() - start > solverSettings.frameBudget) break;
+  }
+  droppedTime = std::max(remaining, 0.0);
+}
+
+void ParticleSystem::GetStepInfo(int& substeps, double& nextSubstep, double& dropped) {
+  substeps = frameSubsteps;
+  nextSubstep = substep;
+  dropped = droppedTime;
+}
+
+void ParticleSystem::Step(double timestep, int groundMode) {
+  Eigen::VectorXd startVel;
+  if (solverSettings.sleeping) {
+    if (!hasIslands) BuildIslands();
+    if (groundMode != sleepGroundMode) {
+      WakeUp();
+      sleepGroundMode = groundMode;
+    }
+    // nothing moves and nothing can touch it, so there is nothing to do
+    if (sleepingIslands == islandAsleep.size()) return;
+    startVel = particles.Velocities();
+  }
+  for (int i = 0; i < particles.size(); ++i) {
+    particles[i].mark = false;
+  }
   ImplicitEulerSparse(timestep);
   //ExplicitEuler(timestep);
 
@@ -128,6 +184,114 @@ void ParticleSystem::Update(double timestep, bool solveWithguess, bool coro, int
       }
       break;
   }
+  if (solverSettings.sleeping) WakeTouched();
+  ApplyPins();
+  if (solverSettings.sleeping) UpdateSleep(startVel, timestep);
+}
+
+// Islands are the connected components of the tets, a particle outside
+// every tet is one on its own
+void ParticleSystem::BuildIslands() {
+  std::vector<int> parent(particles.size());
+  for (int i = 0; i < particles.size(); ++i) parent[i] = i;
+  auto find = [&](int i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  };
+  for (int i = 0; i < tets.size(); ++i) {
+    for (int j = 1; j < 4; ++j) {
+      int a = find(tets[i].to[0]);
+      int b = find(tets[i].to[j]);
+      if (a != b) parent[std::max(a, b)] = std::min(a, b);
+    }
+  }
+  vertexIsland.resize(particles.size());
+  std::vector<int> islandOf(particles.size(), -1);
+  int count = 0;
+  for (int i = 0; i < particles.size(); ++i) {
+    int root = find(i);
+    if (islandOf[root] < 0) islandOf[root] = count++;
+    vertexIsland[i] = islandOf[root];
+  }
+  islandAsleep.assign(count, 0);
+  islandQuietFrames.assign(count, 0);
+  sleepingIslands = 0;
+  hasIslands = true;
+}
+
+// Counts the steps every awake island stayed below both thresholds and puts
+// it to sleep after sleepFrames of them. The residual force is the velocity
+// change the step made, after the ground and collisions had their say, so a
+// body resting on the ground has none while one at the top of a bounce has
+// gravity.
+void ParticleSystem::UpdateSleep(const Eigen::VectorXd& startVel, double timestep) {
+  std::vector<char> quiet(islandAsleep.size(), 1);
+  Eigen::Map<Eigen::VectorXd> v = particles.Velocities();
+  for (int i = 0; i < particles.size(); ++i) {
+    int island = vertexIsland[i];
+    if (islandAsleep[island] || !quiet[island]) continue;
+    double energy = .5 * v.segment<3>(i * 3).squaredNorm();
+    double force = (v.segment<3>(i * 3) - startVel.segment<3>(i * 3)).norm() / timestep;
+    if (energy > solverSettings.sleepEnergy || force > solverSettings.sleepForce) quiet[island] = 0;
+  }
+  bool changed = false;
+  for (int island = 0; island < islandAsleep.size(); ++island) {
+    if (islandAsleep[island]) continue;
+    if (!quiet[island]) {
+      islandQuietFrames[island] = 0;
+    } else if (++islandQuietFrames[island] >= solverSettings.sleepFrames) {
+      islandAsleep[island] = 1;
+      sleepingIslands++;
+      changed = true;
+    }
+  }
+  if (!changed) return;
+  Eigen::Map<Eigen::VectorXd> x = particles.Positions();
+  for (int i = 0; i < particles.size(); ++i) {
+    if (islandAsleep[vertexIsland[i]]) {
+      v.segment<3>(i * 3).setZero();
+      pinnedPos.segment<3>(i * 3) = x.segment<3>(i * 3);
+    }
+  }
+  ApplySleepMask();
+}
+
+// Contact wakes an island: collision response marked one of its vertices or
+// moved it off where it sleeps
+void ParticleSystem::WakeTouched() {
+  if (sleepingIslands == 0) return;
+  Eigen::Map<Eigen::VectorXd> x = particles.Positions();
+  for (int i = 0; i < particles.size(); ++i) {
+    int island = vertexIsland[i];
+    if (!islandAsleep[island]) continue;
+    if (particles.mark[i] || (x.segment<3>(i * 3) - pinnedPos.segment<3>(i * 3)).squaredNorm() > 1e-12) {
+      WakeIsland(island);
+    }
+  }
+}
+
+void ParticleSystem::WakeIsland(int island) {
+  if (!islandAsleep[island]) return;
+  islandAsleep[island] = 0;
+  islandQuietFrames[island] = 0;
+  sleepingIslands--;
+  ApplySleepMask();
+}
+
+void ParticleSystem::WakeUp() {
+  if (!hasIslands || sleepingIslands == 0) return;
+  islandAsleep.assign(islandAsleep.size(), 0);
+  islandQuietFrames.assign(islandQuietFrames.size(), 0);
+  sleepingIslands = 0;
+  ApplySleepMask();
+}
+
+void ParticleSystem::GetSleepInfo(int& islands, int& asleep) {
+  islands = hasIslands ? islandAsleep.size() : 0;
+  asleep = sleepingIslands;
 }
 // fun code from http://www.gamedev.net/topic/142760-the-fasted-raytriangle-collision-detection/
 
@@ -194,6 +358,7 @@ void ParticleSystem::onMouseDrag(Eigen::Vector3d ori, Eigen::Vector3d ray, doubl
   ray.normalize();
   int point = lastpoint;
   if (lastpoint >= 0) {
+    if (hasIslands) WakeIsland(vertexIsland[point]);
     double temp0 = ray.dot(particles[point].x - ori);
     Eigen::Vector3d closePoint = ori + temp0 * ray;
     Eigen::Vector3d newV = (particles[point].v + mouseStiffness * timestep * (closePoint - particles[point].x)) / (1 + mouseStiffness * timestep * timestep);
@@ -214,7 +379,7 @@ void ParticleSystem::onMousePress(Eigen::Vector3d ori, Eigen::Vector3d ray) {
   int closeCount = 0;
   for (int i = 0; i < faces.size(); i += 3) {
     double t, u, v;
-    Particle*a,*b,*c;
+    ParticlePtr a, b, c;
     GetPointP(faces[i], a);
     GetPointP(faces[i + 1], b);
     GetPointP(faces[i + 2], c);
@@ -277,7 +442,7 @@ float* ParticleSystem::GetTetCenter(int* size) {
   *size = tets.size() * 3;
   posTemp.resize(*size);
   for (int i = 0; i < *size/3; i++) {
-    Particle *p1, *p2, *p3, *p4;
+    ParticlePtr p1, p2, p3, p4;
     GetTetP(i, p1, p2, p3, p4);
     Eigen::Vector3d avg = (p1->x + p2->x + p3->x + p4->x)/4;
     posTemp[i*3] = avg[0];
@@ -292,7 +457,7 @@ float* ParticleSystem::GetCenterColors(int*size, double strainSize) {
   *size = tets.size() * 3;
   colorTemp.resize(*size);
   for (int i = 0; i < *size/3; i++) {
-    Particle *p1, *p2, *p3, *p4;
+    ParticlePtr p1, p2, p3, p4;
     GetTetP(i, p1, p2, p3, p4);
     Eigen::Matrix3d temp;
     temp << p2->x - p1->x, p3->x - p1->x, p4->x - p1->x;
@@ -381,7 +546,7 @@ float* ParticleSystem::GetColors(int* size, double strainSize, float xpos, float
         colorTemp[i*3 + 1] = 0;
         colorTemp[i*3 + 2] = 0;
     } else {
-      Particle* p;
+      ParticlePtr p;
       GetPointP(tets[i/12].to[tetnum], p);
       if (p->mark) {
         colorTemp[i*3] = 0;
@@ -403,7 +568,7 @@ float* ParticleSystem::GetPositions3d(int* size, bool beforeCol) {
   int perTet = 6 * 3 * 2;
   posTemp.resize(*size);
   for (int i = 0; i < tets.size(); i++) {
-    Particle *p1, *p2, *p3, *p4;
+    ParticlePtr p1, p2, p3, p4;
     GetTetP(i, p1, p2, p3, p4);
     int c = 0;
     if (!beforeCol) {
@@ -563,13 +728,13 @@ float* ParticleSystem::GetStrainSurfaceTriColors(int* size, double strainSize) {
   *size = faces.size()*3;
   colorTemp.resize(*size);
   for (int i = 0; i < faces.size(); ++i) {
-    Particle* p1;
+    ParticlePtr p1;
     GetPointP(faces[i], p1);
     p1->numTet = 0;
     p1->stressInc = 0.0;
   }
   for (int i = 0; i < tets.size(); i++) {
-    Particle *p1,*p2,*p3,*p4;
+    ParticlePtr p1, p2, p3, p4;
     GetTetP(i, p1, p2, p3, p4);
 
     Eigen::Matrix3d temp;
@@ -613,7 +778,7 @@ float* ParticleSystem::GetStrainSurfaceTriColors(int* size, double strainSize) {
     p4->numTet += 1;
   }
   for (int i = 0; i < faces.size(); ++i) {
-    Particle* p1;
+    ParticlePtr p1;
     GetPointP(faces[i], p1);
     LerpColors((p1->stressInc/p1->numTet) * strainSize, &(colorTemp[i*3]));
   }
@@ -630,7 +795,7 @@ float* ParticleSystem::GetSurfaceTriangles3d(int* size) {
   *size = faces.size()*3;
   posTemp.resize(*size);
   for (int i = 0; i < faces.size(); i++) {
-    Particle* p1;
+    ParticlePtr p1;
     GetPointP(faces[i], p1);
     posTemp[i*3] = p1->x[0];
     posTemp[i*3+1] = p1->x[1];
@@ -644,7 +809,7 @@ float* ParticleSystem::GetAllTriangles3d(int* size) {
   int perTet = 4 * 3 * 3;
   posTemp.resize(*size);
   for (int i = 0; i < tets.size(); i++) {
-    Particle *p1, *p2, *p3, *p4;
+    ParticlePtr p1, p2, p3, p4;
     GetTetP(i, p1, p2, p3, p4);
     int c = 0;
     // p1 p2 p3
@@ -707,7 +872,7 @@ float* ParticleSystem::GetStrainAllTriColors(int* size, double strainSize) {
   int perTet = 4 * 3 * 3;
   colorTemp.resize(*size);
   for (int i = 0; i < tets.size(); i++) {
-    Particle *p1,*p2,*p3,*p4;
+    ParticlePtr p1, p2, p3, p4;
     GetTetP(i, p1, p2, p3, p4);
 
     Eigen::Matrix3d temp;
@@ -777,7 +942,7 @@ void ParticleSystem::SetupSingleSpring() {
   particles.emplace_back();
   particles.emplace_back();
   particles.emplace_back();
-  //particles.emplace_back();
+  particles.emplace_back();
   particles[0].x << 0, 0, 0;
   particles[0].v << 0, 0.0, 0;
   particles[0].iMass = 1;
@@ -788,28 +953,33 @@ void ParticleSystem::SetupSingleSpring() {
   particles[2].v << 0.0, 0.0, 0.0;
   particles[2].iMass = 1;
 
-  //particles[3].x << 0, -.5, -1;
-  //particles[3].v << 0.0, 0.0, 0.0;
-  //particles[3].iMass = 1;
+  particles[3].x << 0, -.5, -1;
+  particles[3].v << 0.0, 0.0, 0.0;
+  particles[3].iMass = 1;
 
   CopyIntoStartPos();
-  fixed_points.emplace_back();
-  fixed_points[0].x << 0, -.5, -1;
+  PinVertices(std::vector<int>(1, 3), true);
 
-  AddTet(0, 1, 2, -1);
+  AddTet(0, 1, 2, 3);
+  PrefactorSolver();
   //ground = false;
 
 }
 
 void ParticleSystem::CopyIntoStartPos() {
-  prevPos.resize(particles.size());
-  prevVel.resize(particles.size());
-  prevFEXT.resize(particles.size());
+  prevPos.resize(particles.size() * 3);
+  prevVel.resize(particles.size() * 3);
+  prevFEXT.resize(particles.size() * 3);
   startPos.clear();
   for(int i = 0; i < particles.size(); ++i) {
     startPos.emplace_back();
     startPos[i] = particles[i].x;
   }
+  startIMass = particles.iMass;
+  unpinnedDofs.setOnes(particles.size() * 3);
+  freeDofs = unpinnedDofs;
+  pinnedPos = particles.Positions();
+  ComputeMass();
 }
 
 void ParticleSystem::SetupBendingBar() {
@@ -818,6 +988,7 @@ void ParticleSystem::SetupBendingBar() {
   double* points;
   std::vector<int> tets;
   MeshGen::GenerateBar(points, psize, tets, faces, facetotet);
+  meshFromBar = true;
 
   printf("Psize: %d, esize %d\n",psize, tets.size());
 
@@ -827,14 +998,13 @@ void ParticleSystem::SetupBendingBar() {
     particles[i].v << 0, 0, 0;
     particles[i].iMass = psize/20.0;
   }
+  std::vector<int> pinned;
   for (int i = 0; i < psize; ++i) {
     if (particles[i].x[2] == 0) {
-      printf("fixed_point!\n");
-      MakeFixedPoint(i, tets, faces);
-      psize -= 1;
-      i--;
+      pinned.push_back(i);
     }
   }
+  printf("Fixed points: %i\n", pinned.size());
 
   for (int i = 0; i < (tets.size()/4); ++i) {
     AddTet(tets[i*4], tets[i*4+1], tets[i*4 + 2], tets[i*4 + 3]);
@@ -844,6 +1014,8 @@ void ParticleSystem::SetupBendingBar() {
   //}
   SetupCollisions(-10.0);
   CopyIntoStartPos();
+  PinVertices(pinned, true);
+  PrefactorSolver();
   for (int i = 0; i < particles.size(); ++i) {
     //if (particles[i].x[2] < -2)
     //particles[i].v[1] += 5;
@@ -863,6 +1035,7 @@ void ParticleSystem::SetupArmadillo() {
   double* points;
   std::vector<int> tets;
   MeshGen::GenerateMesh(points, psize, tets, faces, facetotet, "Armadillo_simple2.ply");
+  meshFile = "Armadillo_simple2.ply";
 
   printf("Psize: %d, esize %d\n",psize, tets.size());
 
@@ -872,14 +1045,13 @@ void ParticleSystem::SetupArmadillo() {
     particles[i].v << 0, 0, 0;
     particles[i].iMass = psize/20.0;
   }
+  std::vector<int> pinned;
   for (int i = 0; i < psize; ++i) {
     if (particles[i].x[1] < -6 && particles[i].x[0] < 2) {
-      printf("fixed_point!\n");
-      MakeFixedPoint(i, tets, faces);
-      psize -= 1;
-      i--;
+      pinned.push_back(i);
     }
   }
+  printf("Fixed points: %i\n", pinned.size());
 
   for (int i = 0; i < (tets.size()/4); ++i) {
     AddTet(tets[i*4], tets[i*4+1], tets[i*4 + 2], tets[i*4 + 3]);
@@ -889,6 +1061,8 @@ void ParticleSystem::SetupArmadillo() {
   //}
   SetupCollisions(-10.0);
   CopyIntoStartPos();
+  PinVertices(pinned, true);
+  PrefactorSolver();
   //for (int i = 0; i < particles.size(); ++i) {
   //  if (particles[i].x[2] < -6)
   //  particles[i].v[1] += .5;
@@ -912,6 +1086,7 @@ void ParticleSystem::SetupMeshFile(const char* filename) {
   if (points == NULL) {
     return;
   }
+  meshFile = filename;
 
   printf("Psize: %d, Number of tets %d\n",psize, tets.size());
 
@@ -927,12 +1102,10 @@ void ParticleSystem::SetupMeshFile(const char* filename) {
   }
 
   //Make lowest points fixed
+  //std::vector<int> pinned;
   //for (int i = 0; i < psize; ++i) {
   //  if (particles[i].x[1] > lowestpoint - .1) {
-  //    printf("fixed_point!\n");
-  //    MakeFixedPoint(i, tets, faces);
-  //    psize -= 1;
-  //    i--;
+  //    pinned.push_back(i);
   //  }
   //}
 
@@ -984,31 +1157,12 @@ void ParticleSystem::SetupMeshFile(const char* filename) {
 
   SetupCollisions(lowestpoint);
   CopyIntoStartPos();
+  PrefactorSolver();
   groundLevel = lowestpoint + 5;
   delete[] points;
   printf("Number of faces%d\n", faces.size()/3);
 }
 
-void ParticleSystem::MakeFixedPoint(int p, std::vector<int>& edges, std::vector<int>& faces) {
-  fixed_points.emplace_back();
-  fixed_points[fixed_points.size() - 1].x = particles[p].x;
-  for (int i = 0; i < edges.size(); ++i) {
-    if (edges[i] == p) {
-      edges[i] = -1*fixed_points.size();
-    } else if (edges[i] > p) {
-      edges[i] -= 1;
-    }
-  }
-  for (int i = 0; i < faces.size(); ++i) {
-    if (faces[i] == p) {
-      faces[i] = -1*fixed_points.size();
-    } else if (faces[i] > p) {
-      faces[i] -= 1;
-    }
-  }
-  particles.erase(particles.begin() + p);
-}
-
 void ParticleSystem::CalculateParticleMass(int i, float springMass) {
  /* float mass = 0;
   for (int j = 0; j < springs.size(); ++j) {
@@ -1028,6 +1182,14 @@ void ParticleSystem::SetSpringProperties(double k, double vol, double c, double
   groundStiffness = gStiffness;
   mouseStiffness = mStiffness;
   colRolBack = useRollback;
+  WakeUp();
+}
+
+void ParticleSystem::SetSolverSettings(const SolverSettings& settings) {
+  solverSettings = settings;
+  substep = std::min(std::max(substep, settings.minSubstep), settings.maxSubstep);
+  ThreadPool::SetNumThreads(settings.numThreads);
+  WakeUp();
 }
 
 void ParticleSystem::ComputeForces() {}
@@ -1072,8 +1234,11 @@ void ParticleSystem::AddTet(int x1, int x2, int x3, int x4) {
 
   tets[index].k = stiffness;
   tets[index].c = dampness;
+  tets[index].density = 0;
+  tets[index].plasticStrain.setZero();
+  tets[index].restStrain.setZero();
 
-  Particle *p1,*p2,*p3,*p4;
+  ParticlePtr p1, p2, p3, p4;
   GetTetP(index, p1, p2, p3, p4);
   Eigen::Matrix3d temp;
   temp << p2->x - p1->x, p3->x - p1->x, p4->x - p1->x;
@@ -1085,32 +1250,39 @@ void ParticleSystem::AddTet(int x1, int x2, int x3, int x4) {
   tets[index].inversePos = temp.inverse();
 }
 
-void ParticleSystem::GetTetP(int i, Particle*& x1, Particle*& x2, Particle*& x3, Particle*& x4) {
-  if (tets[i].to[0] < 0)
-    x1 = &(fixed_points[tets[i].to[0] * -1 - 1]);
-  else
-    x1 = &(particles[tets[i].to[0]]);
-
-  if (tets[i].to[1] < 0)
-    x2 = &(fixed_points[tets[i].to[1] * -1 - 1]);
-  else
-    x2 = &(particles[tets[i].to[1]]);
+void ParticleArray::clear() {
+  x.clear();
+  v.clear();
+  f.clear();
+  lx.clear();
+  iMass.clear();
+  mark.clear();
+  numTet.clear();
+  stressInc.clear();
+}
 
-  if (tets[i].to[2] < 0)
-    x3 = &(fixed_points[tets[i].to[2] * -1 - 1]);
-  else
-    x3 = &(particles[tets[i].to[2]]);
+void ParticleArray::emplace_back() {
+  x.resize(x.size() + 3, 0.0);
+  v.resize(v.size() + 3, 0.0);
+  f.resize(f.size() + 3, 0.0);
+  lx.resize(lx.size() + 3, 0.0);
+  iMass.push_back(0);
+  mark.push_back(false);
+  numTet.push_back(0);
+  stressInc.push_back(0);
+}
 
-  if (tets[i].to[3] < 0)
-    x4 = &(fixed_points[tets[i].to[3] * -1 - 1]);
-  else
-    x4 = &(particles[tets[i].to[3]]);
+void ParticleSystem::GetTetP(int i, ParticlePtr& x1, ParticlePtr& x2, ParticlePtr& x3, ParticlePtr& x4) {
+  x1 = particles.Ptr(tets[i].to[0]);
+  x2 = particles.Ptr(tets[i].to[1]);
+  x3 = particles.Ptr(tets[i].to[2]);
+  x4 = particles.Ptr(tets[i].to[3]);
 }
 
-void ParticleSystem::GetPointP(int i, Particle*& x1) {
+void ParticleSystem::GetPointP(int i, ParticlePtr& x1) {
   if (i < 0)
-    x1 = &(fixed_points[i * -1 - 1]);
+    x1 = fixed_points.Ptr(i * -1 - 1);
   else
-    x1 = &(particles[i]);
+    x1 = particles.Ptr(i);
 }
 
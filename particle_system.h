@@ -3,18 +3,67 @@
 
 #include "../Eigen/Core"
 #include <vector>
+#include <string>
+class ParticleArray;
+
+// One particle of a ParticleArray. Reads like the plain record it used to be,
+// x, v, f and lx are views into the array's contiguous storage.
 class Particle {
  public:
-  Eigen::Vector3d x;
-  Eigen::Vector3d v;
-  Eigen::Vector3d f;
-  Eigen::Vector3d lx;
-  double iMass;
-  bool mark;
-  int numTet;
-  double stressInc;
+  Particle(ParticleArray& a, int i);
+  Particle* operator->() { return this; }
+  Eigen::Map<Eigen::Vector3d> x;
+  Eigen::Map<Eigen::Vector3d> v;
+  Eigen::Map<Eigen::Vector3d> f;
+  Eigen::Map<Eigen::Vector3d> lx;
+  double& iMass;
+  char& mark;
+  int& numTet;
+  double& stressInc;
+};
+
+// Stands in for a Particle* into a ParticleArray: p->x works as before
+class ParticlePtr {
+ public:
+  ParticlePtr() : array(NULL), index(0) {}
+  ParticlePtr(ParticleArray* a, int i) : array(a), index(i) {}
+  Particle operator->() const { return Particle(*array, index); }
+  Particle operator*() const { return Particle(*array, index); }
+ private:
+  ParticleArray* array;
+  int index;
+};
+
+// Particle state as structure of arrays. The vector fields hold 3 doubles per
+// particle back to back, so the solver can use them as Eigen vectors directly.
+class ParticleArray {
+ public:
+  int size() const { return iMass.size(); }
+  void clear();
+  // Appends a particle with every field zeroed
+  void emplace_back();
+  Particle operator[](int i) { return Particle(*this, i); }
+  ParticlePtr Ptr(int i) { return ParticlePtr(this, i); }
+
+  Eigen::Map<Eigen::VectorXd> Positions() { return Eigen::Map<Eigen::VectorXd>(x.data(), x.size()); }
+  Eigen::Map<Eigen::VectorXd> Velocities() { return Eigen::Map<Eigen::VectorXd>(v.data(), v.size()); }
+  Eigen::Map<Eigen::VectorXd> Forces() { return Eigen::Map<Eigen::VectorXd>(f.data(), f.size()); }
+  Eigen::Map<Eigen::VectorXd> LastPositions() { return Eigen::Map<Eigen::VectorXd>(lx.data(), lx.size()); }
+
+  std::vector<double> x;
+  std::vector<double> v;
+  std::vector<double> f;
+  std::vector<double> lx;
+  std::vector<double> iMass;
+  std::vector<char> mark;
+  std::vector<int> numTet;
+  std::vector<double> stressInc;
 };
 
+inline Particle::Particle(ParticleArray& a, int i)
+    : x(&a.x[i * 3]), v(&a.v[i * 3]), f(&a.f[i * 3]), lx(&a.lx[i * 3]),
+      iMass(a.iMass[i]), mark(a.mark[i]), numTet(a.numTet[i]), stressInc(a.stressInc[i]) {}
+
 class Spring {
  public:
   int to;
@@ -32,7 +81,94 @@ class Tetrahedra {
  double posDet;
  double k;
  double c;
+ double density; // 0 leaves the mass of the vertices to the scene
  double strain;
+ // Plastic strain so far, and the one oldPos, inversePos and posDet were
+ // last rebuilt with
+ Eigen::Matrix3d plasticStrain;
+ Eigen::Matrix3d restStrain;
+};
+
+enum SolverType {
+  SOLVER_EIGEN_CG = 0,       // assemble the sparse system and use Eigen's CG
+  SOLVER_MATRIX_FREE_CG = 1, // CG with the product evaluated tet by tet
+  SOLVER_PROJECTIVE_DYNAMICS = 2, // local rotation fits and a prefactored global solve
+  SOLVER_XPBD = 3,                // constraint projection by color, no linear solve
+  SOLVER_MODAL = 4                // lowest modes of the rest stiffness only
+};
+
+enum PreconditionerType {
+  PRECONDITIONER_DIAGONAL = 0,           // Eigen's default Jacobi
+  PRECONDITIONER_BLOCK_JACOBI = 1,       // inverse of the 3x3 block of every particle
+  PRECONDITIONER_INCOMPLETE_CHOLESKY = 2, // IC(0) of the assembled system
+  PRECONDITIONER_LAGGED_FACTORIZATION = 3, // LDLT of the system from a few frames ago
+  PRECONDITIONER_MULTIGRID = 4,            // V-cycle over coarser tetgen meshes
+  PRECONDITIONER_DOMAIN_DECOMPOSITION = 5  // additive Schwarz, a factored subdomain per thread
+};
+
+// Options for how ImplicitEulerSparse builds and solves its linear system
+class SolverSettings {
+ public:
+  SolverSettings();
+  SolverType solver;
+  // Build the sparsity pattern of the system matrix once per mesh and
+  // scatter the element blocks straight into it instead of using triplets
+  bool persistentPattern;
+  // Worker threads for the per tet loops, 0 uses every core
+  int numThreads;
+  PreconditionerType preconditioner;
+  int maxIterations;
+  // Relative residual CG stops at
+  double tolerance;
+  // Without corotation the system matrix only depends on the timestep and the
+  // material, so factor it once and reuse the factorization every step
+  bool prefactorLinear;
+  // Relative timestep change before refactoring the prefactored linear or the
+  // projective dynamics system, smaller changes solve the exact system with
+  // CG preconditioned by the old factorization
+  double refactorTimestepChange;
+  // Frames between refactoring the lagged factorization preconditioner
+  int refactorInterval;
+  // CG iterations that trigger a refactor on the next frame
+  int refactorIterations;
+  // Coarse meshes below the simulated one for the multigrid preconditioner
+  int multigridLevels;
+  // Subdomains of the additive Schwarz preconditioner, 0 for one per thread
+  int domainCount;
+  // Run CG in float on a float copy of A, refined with double residuals
+  bool mixedPrecision;
+  int refinementSteps;
+  // Rotate tets by the polar decomposition instead of Gram-Schmidt
+  bool polarRotations;
+  // Local/global iterations per projective dynamics step
+  int pdIterations;
+  // Constraint projection sweeps per XPBD step, and whether to add a
+  // distance constraint on every tet edge
+  int xpbdIterations;
+  bool xpbdEdges;
+  // Modes the reduced model keeps, and whether to rotate their displacement
+  // per vertex (modal warping) when corotational
+  int modalCount;
+  bool modalWarping;
+  // Split every frame into substeps sized from an error estimate instead of
+  // taking one step of the frame time
+  bool adaptiveTimestep;
+  double minSubstep;
+  double maxSubstep;
+  // Position error allowed per substep
+  double substepTolerance;
+  // Wall clock seconds per frame, simulated time left over is dropped
+  double frameBudget;
+  // Freeze every connected part of the mesh whose kinetic energy and
+  // residual force per unit mass stayed below the thresholds for sleepFrames
+  // steps. Frozen parts are held like pinned ones and their tets and faces
+  // are left out of the step, once all of them are the step is skipped.
+  // The parts don't share rows in any system matrix, so the factorizations
+  // and modes built over the pins alone stay valid as they fall asleep.
+  bool sleeping;
+  double sleepEnergy;
+  double sleepForce;
+  int sleepFrames;
 };
 
 class CollisionSystem;
@@ -63,33 +199,113 @@ class ParticleSystem {
   void SetupMeshFile(const char*filename);
   void Reset();
   void SetSpringProperties(double k, double volumeConservation, double c, double grav, double gStiffness, double mStiffness, bool useRollback);
+  void SetSolverSettings(const SolverSettings& settings);
+  // Plastic flow above a yield strain, see UpdatePlasticity
+  void SetPlasticity(bool enabled, double yield, double creep, double maxStrain, double refit);
+  // Pins or unpins a set of vertices where they are now. Pinned vertices
+  // stay in particles and keep their dofs, the solver holds them through
+  // freeDofs. Linear in the number of particles however many are changed.
+  void PinVertices(const std::vector<int>& vertices, bool pin);
+  void UnpinAll();
+  bool IsPinned(int i) const { return unpinnedDofs[i * 3] == 0; }
+  // Wakes every sleeping part of the mesh
+  void WakeUp();
+  // Masses from the tet volumes instead of the scene's per particle masses,
+  // for every tet or for a region of them
+  void SetDensity(double density);
+  void SetRegionDensity(const std::vector<int>& tetIndices, double density);
 
-  void GetProfileInfo(double& triplet, double& fromtriplet, double& solve, double& equationSetupTime);
+  void GetProfileInfo(double& triplet, double& fromtriplet, double& solve, double& equationSetupTime,
+                      double& preconditioner, int& solves, int& iterations, double& residual);
+  void BenchmarkSolvers(int steps, double timestep);
+  // Substeps of the last frame, the size the next one starts with and the
+  // simulated time the frame budget dropped
+  void GetStepInfo(int& substeps, double& nextSubstep, double& dropped);
+  // Connected parts of the mesh and how many of them sleep
+  void GetSleepInfo(int& islands, int& asleep);
 
   std::vector<Tetrahedra> tets;
-  std::vector<Particle> particles;
-  std::vector<Particle> fixed_points;
+  // Distance constraints of the XPBD solver, made from the tet edges
+  std::vector<Spring> springs;
+  ParticleArray particles;
+  // Static collision geometry, faces refer to it with negative indices
+  ParticleArray fixed_points;
   double groundLevel;
  private:
+  void Step(double timestep, int groundMode);
+  double NextSubstep(double timestep);
   void HandleCollisions(double timestep);
   void SetupCollisions(double lowestpoint);
-  void MakeFixedPoint(int i, std::vector<int>& edges, std::vector<int>& faces);
+  void ApplyPins();
+  void BuildIslands();
+  void UpdateSleep(const Eigen::VectorXd& startVel, double timestep);
+  void WakeTouched();
+  void WakeIsland(int island);
+  void ApplySleepMask();
+  void PinsChanged();
+  void ComputeMass();
   void ComputeForces();
   void ExplicitEuler(double timestep);
   void ImplicitEulerSparse(double timestep);
+  void BuildElementCache();
+  void PrefactorSolver();
+  void BuildSystemPattern();
+  void ImplicitEulerMatrixFree(double timestep);
+  bool ImplicitEulerPrefactored(double timestep);
+  bool FactorProjectiveDynamics(double timestep);
+  bool ProjectiveDynamics(double timestep);
+  double PositionBasedStep(double timestep, Eigen::VectorXd& newv);
+  void BuildConstraints();
+  void BuildModes();
+  void ModalStep(double timestep);
+  void MatrixFreeProduct(const Eigen::VectorXd& p, Eigen::VectorXd& y, double timestep);
+  void StoreVelocities(const Eigen::VectorXd& newv, double timestep);
+  void ComputeTetStiffness(int i);
+  void TetRestPositions(int i, Eigen::Vector3d* rest);
+  void UpdatePlasticity(double timestep);
+  void ColorTets();
+  void ComputeRotations(bool polar);
+  void BuildMultigrid();
+  void BuildSubdomains();
 
   void CopyIntoStartPos();
   std::vector<Eigen::Vector3d> startPos;
+  // Inverse masses the scene gave the particles, for ComputeMass
+  std::vector<double> startIMass;
   std::vector<float> posTemp;
   std::vector<float> colorTemp;
   std::vector<double> phaseTemp;
   std::vector<int> faces;
   std::vector<int> facetotet;
   std::vector<int> outsidePoints;
+  // What the mesh was generated from, to generate the multigrid levels again
+  bool meshFromBar;
+  std::string meshFile;
+
+  // 1 for free dofs and 0 for pinned or sleeping ones, 3 per particle, and
+  // where the pinned and sleeping ones are held. unpinnedDofs has only the
+  // pins, freeDofs is made from it and the sleeping islands.
+  Eigen::VectorXd freeDofs;
+  Eigen::VectorXd unpinnedDofs;
+  Eigen::VectorXd pinnedPos;
+  // Connected components of the tets, whether each sleeps and for how many
+  // steps it has been below the sleep thresholds
+  bool hasIslands;
+  std::vector<int> vertexIsland;
+  std::vector<char> islandAsleep;
+  std::vector<int> islandQuietFrames;
+  int sleepingIslands;
+  int sleepGroundMode;
+  // Whether a vertex or a tet is in a sleeping island. A tet's vertices are
+  // all in one island.
+  bool VertexAsleep(int i) const { return sleepingIslands > 0 && islandAsleep[vertexIsland[i]]; }
+  bool TetAsleep(int i) const { return VertexAsleep(tets[i].to[0]); }
+  // Diagonal of the lumped mass matrix, 3 entries per particle
+  Eigen::VectorXd massDiag;
 
-  std::vector<Eigen::Vector3d> prevPos;
-  std::vector<Eigen::Vector3d> prevVel;
-  std::vector<Eigen::Vector3d> prevFEXT;
+  Eigen::VectorXd prevPos;
+  Eigen::VectorXd prevVel;
+  Eigen::VectorXd prevFEXT;
 #ifdef COLLISION_SELFCCD
   CollisionSystem* colSys;
 #endif
@@ -106,9 +322,22 @@ class ParticleSystem {
   bool corotational;
   bool colRolBack;
   bool plastiscity;
+  double plasticYield;
+  double plasticCreep;
+  double plasticMax;
+  double plasticRefit;
+  // XPBD springs and constraint coloring are up to date with the mesh
+  bool hasConstraints;
+  SolverSettings solverSettings;
+  // Step controller state, impactTime is the earliest time of impact the
+  // CCD found in the last step as a fraction of it
+  double substep;
+  int frameSubsteps;
+  double droppedTime;
+  double impactTime;
   void AddTet(int x1, int x2, int x3, int x4);
-  void GetTetP(int i, Particle*& p1, Particle*& p2, Particle*& p3, Particle*& p4);
-  void GetPointP(int i, Particle*& x1);
+  void GetTetP(int i, ParticlePtr& p1, ParticlePtr& p2, ParticlePtr& p3, ParticlePtr& p4);
+  void GetPointP(int i, ParticlePtr& x1);
   void CalculateParticleMass(int i, float springMass);
 };
 #endif // PARTICLE_SYSTEM_H__
@@ -0,0 +1,134 @@
+#ifndef PRECONDITIONERS_H__
+#define PRECONDITIONERS_H__
+
+#include "Eigen/Sparse"
+#include "Eigen/Dense"
+#include "Eigen/SparseCholesky"
+#include <vector>
+
+// Block Jacobi preconditioner for Eigen's ConjugateGradient. Inverts the 3x3
+// diagonal block of every particle instead of only the diagonal, which keeps
+// the coupling between the x, y and z dofs of a rotated tet.
+class BlockJacobiPreconditioner {
+ public:
+  typedef Eigen::VectorXd::StorageIndex StorageIndex;
+  enum {
+    ColsAtCompileTime = Eigen::Dynamic,
+    MaxColsAtCompileTime = Eigen::Dynamic
+  };
+
+  BlockJacobiPreconditioner() : size(0) {}
+
+  template<typename MatType>
+  explicit BlockJacobiPreconditioner(const MatType& mat) {
+    compute(mat);
+  }
+
+  Eigen::Index rows() const { return size; }
+  Eigen::Index cols() const { return size; }
+
+  template<typename MatType>
+  BlockJacobiPreconditioner& analyzePattern(const MatType&) {
+    return *this;
+  }
+
+  template<typename MatType>
+  BlockJacobiPreconditioner& factorize(const MatType& mat) {
+    std::vector<Eigen::Matrix3d> blocks(mat.cols() / 3, Eigen::Matrix3d::Zero());
+    for (int j = 0; j < mat.outerSize(); ++j) {
+      for (typename MatType::InnerIterator it(mat, j); it; ++it) {
+        if (it.row() / 3 == it.col() / 3) {
+          blocks[it.col() / 3](it.row() % 3, it.col() % 3) = it.value();
+        }
+      }
+    }
+    return factorizeBlocks(blocks);
+  }
+
+  template<typename MatType>
+  BlockJacobiPreconditioner& compute(const MatType& mat) {
+    return factorize(mat);
+  }
+
+  // For solvers that accumulate the diagonal blocks themselves
+  BlockJacobiPreconditioner& factorizeBlocks(const std::vector<Eigen::Matrix3d>& blocks) {
+    size = blocks.size() * 3;
+    inverses.resize(blocks.size());
+    for (int i = 0; i < blocks.size(); ++i) {
+      bool invertible;
+      double det;
+      blocks[i].computeInverseAndDetWithCheck(inverses[i], det, invertible);
+      if (!invertible) {
+        inverses[i].setZero();
+        for (int j = 0; j < 3; ++j) {
+          inverses[i](j, j) = blocks[i](j, j) != 0 ? 1 / blocks[i](j, j) : 1;
+        }
+      }
+    }
+    return *this;
+  }
+
+  template<typename Rhs, typename Dest>
+  void _solve_impl(const Rhs& b, Dest& x) const {
+    x.resize(size);
+    for (int i = 0; i < inverses.size(); ++i) {
+      x.template segment<3>(i * 3) = inverses[i] * b.template segment<3>(i * 3);
+    }
+  }
+
+  template<typename Rhs>
+  inline const Eigen::Solve<BlockJacobiPreconditioner, Rhs> solve(const Eigen::MatrixBase<Rhs>& b) const {
+    return Eigen::Solve<BlockJacobiPreconditioner, Rhs>(*this, b.derived());
+  }
+
+  Eigen::ComputationInfo info() { return Eigen::Success; }
+
+ private:
+  int size;
+  std::vector<Eigen::Matrix3d> inverses;
+};
+
+// Uses a factorization computed elsewhere, possibly of an older system
+// matrix, as the preconditioner. compute() leaves the factorization alone.
+class FactorizationPreconditioner {
+ public:
+  typedef Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > Factorization;
+  typedef Eigen::VectorXd::StorageIndex StorageIndex;
+  enum {
+    ColsAtCompileTime = Eigen::Dynamic,
+    MaxColsAtCompileTime = Eigen::Dynamic
+  };
+
+  FactorizationPreconditioner() : factor(NULL) {}
+
+  void setFactorization(const Factorization* f) { factor = f; }
+
+  Eigen::Index rows() const { return factor->rows(); }
+  Eigen::Index cols() const { return factor->cols(); }
+
+  template<typename MatType>
+  FactorizationPreconditioner& analyzePattern(const MatType&) { return *this; }
+
+  template<typename MatType>
+  FactorizationPreconditioner& factorize(const MatType&) { return *this; }
+
+  template<typename MatType>
+  FactorizationPreconditioner& compute(const MatType&) { return *this; }
+
+  template<typename Rhs, typename Dest>
+  void _solve_impl(const Rhs& b, Dest& x) const {
+    x = factor->solve(b);
+  }
+
+  template<typename Rhs>
+  inline const Eigen::Solve<FactorizationPreconditioner, Rhs> solve(const Eigen::MatrixBase<Rhs>& b) const {
+    return Eigen::Solve<FactorizationPreconditioner, Rhs>(*this, b.derived());
+  }
+
+  Eigen::ComputationInfo info() { return factor ? factor->info() : Eigen::InvalidInput; }
+
+ private:
+  const Factorization* factor;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include "rotation_batch.h"
+#include <math.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace {
+// Newton steps X = (X + X^-T) / 2 for the polar rotation, enough for
+// singular values between about .01 and 100
+const int polarIterations = 8;
+
+// One lane, the fallback when no vector instruction set is available
+struct Scalar {
+  enum { width = 1 };
+  typedef bool Mask;
+  double v;
+  Scalar() {}
+  Scalar(double x) : v(x) {}
+  static Scalar Load(const double* p) { return Scalar(*p); }
+  void Store(double* p) const { *p = v; }
+};
+inline Scalar operator+(Scalar a, Scalar b) { return Scalar(a.v + b.v); }
+inline Scalar operator-(Scalar a, Scalar b) { return Scalar(a.v - b.v); }
+inline Scalar operator*(Scalar a, Scalar b) { return Scalar(a.v * b.v); }
+inline Scalar operator/(Scalar a, Scalar b) { return Scalar(a.v / b.v); }
+inline Scalar Sqrt(Scalar a) { return Scalar(sqrt(a.v)); }
+inline bool Positive(Scalar a) { return a.v > 0; }
+inline Scalar Select(bool m, Scalar a, Scalar b) { return m ? a : b; }
+
+#ifdef __AVX2__
+struct Avx2 {
+  enum { width = 4 };
+  typedef __m256d Mask;
+  __m256d v;
+  Avx2() {}
+  Avx2(double x) : v(_mm256_set1_pd(x)) {}
+  Avx2(__m256d x) : v(x) {}
+  static Avx2 Load(const double* p) { return Avx2(_mm256_loadu_pd(p)); }
+  void Store(double* p) const { _mm256_storeu_pd(p, v); }
+};
+inline Avx2 operator+(Avx2 a, Avx2 b) { return Avx2(_mm256_add_pd(a.v, b.v)); }
+inline Avx2 operator-(Avx2 a, Avx2 b) { return Avx2(_mm256_sub_pd(a.v, b.v)); }
+inline Avx2 operator*(Avx2 a, Avx2 b) { return Avx2(_mm256_mul_pd(a.v, b.v)); }
+inline Avx2 operator/(Avx2 a, Avx2 b) { return Avx2(_mm256_div_pd(a.v, b.v)); }
+inline Avx2 Sqrt(Avx2 a) { return Avx2(_mm256_sqrt_pd(a.v)); }
+inline __m256d Positive(Avx2 a) { return _mm256_cmp_pd(a.v, _mm256_setzero_pd(), _CMP_GT_OQ); }
+inline Avx2 Select(__m256d m, Avx2 a, Avx2 b) { return Avx2(_mm256_blendv_pd(b.v, a.v, m)); }
+#endif
+
+#ifdef __AVX512F__
+struct Avx512 {
+  enum { width = 8 };
+  typedef __mmask8 Mask;
+  __m512d v;
+  Avx512() {}
+  Avx512(double x) : v(_mm512_set1_pd(x)) {}
+  Avx512(__m512d x) : v(x) {}
+  static Avx512 Load(const double* p) { return Avx512(_mm512_loadu_pd(p)); }
+  void Store(double* p) const { _mm512_storeu_pd(p, v); }
+};
+inline Avx512 operator+(Avx512 a, Avx512 b) { return Avx512(_mm512_add_pd(a.v, b.v)); }
+inline Avx512 operator-(Avx512 a, Avx512 b) { return Avx512(_mm512_sub_pd(a.v, b.v)); }
+inline Avx512 operator*(Avx512 a, Avx512 b) { return Avx512(_mm512_mul_pd(a.v, b.v)); }
+inline Avx512 operator/(Avx512 a, Avx512 b) { return Avx512(_mm512_div_pd(a.v, b.v)); }
+inline Avx512 Sqrt(Avx512 a) { return Avx512(_mm512_sqrt_pd(a.v)); }
+inline __mmask8 Positive(Avx512 a) { return _mm512_cmp_pd_mask(a.v, _mm512_setzero_pd(), _CMP_GT_OQ); }
+inline Avx512 Select(__mmask8 m, Avx512 a, Avx512 b) { return Avx512(_mm512_mask_blend_pd(m, b.v, a.v)); }
+#endif
+
+#if defined(__AVX512F__)
+typedef Avx512 Wide;
+#elif defined(__AVX2__)
+typedef Avx2 Wide;
+#else
+typedef Scalar Wide;
+#endif
+
+// Scales a column to unit length, zero columns are left alone. Divides by
+// the norm like Eigen's normalized() rather than multiplying by its inverse,
+// which would round differently.
+template <typename V>
+inline void Normalize(V* c) {
+  V n = (c[0] * c[0] + c[1] * c[1]) + c[2] * c[2];
+  typename V::Mask nonzero = Positive(n);
+  V norm = Sqrt(n);
+  for (int k = 0; k < 3; ++k) c[k] = Select(nonzero, c[k] / norm, c[k]);
+}
+
+// Same steps as the per tet Eigen code, so for the same deformation gradient
+// the results agree bit for bit
+template <typename V>
+inline void GramSchmidt(const V* m, V* r) {
+  for (int k = 0; k < 3; ++k) r[k] = m[k];
+  Normalize(r);
+  V dot = (r[0] * m[3] + r[1] * m[4]) + r[2] * m[5];
+  for (int k = 0; k < 3; ++k) r[3 + k] = m[3 + k] - dot * r[k];
+  Normalize(r + 3);
+  r[6] = r[1] * r[5] - r[2] * r[4];
+  r[7] = r[2] * r[3] - r[0] * r[5];
+  r[8] = r[0] * r[4] - r[1] * r[3];
+}
+
+// X^-T is the cofactor matrix over the determinant, which keeps the Newton
+// step free of branches. Inverted tets (det <= 0) keep the Gram-Schmidt result.
+template <typename V>
+inline void Polar(const V* m, V* r) {
+  V x[9];
+  for (int k = 0; k < 9; ++k) x[k] = m[k];
+  V det0;
+  for (int it = 0; it < polarIterations; ++it) {
+    // x[c * 3 + row], c the cofactor of entry (row, col)
+    V c[9];
+    c[0] = x[4] * x[8] - x[7] * x[5];
+    c[3] = x[7] * x[2] - x[1] * x[8];
+    c[6] = x[1] * x[5] - x[4] * x[2];
+    c[1] = x[6] * x[5] - x[3] * x[8];
+    c[4] = x[0] * x[8] - x[6] * x[2];
+    c[7] = x[3] * x[2] - x[0] * x[5];
+    c[2] = x[3] * x[7] - x[6] * x[4];
+    c[5] = x[6] * x[1] - x[0] * x[7];
+    c[8] = x[0] * x[4] - x[3] * x[1];
+    V det = (x[0] * c[0] + x[3] * c[3]) + x[6] * c[6];
+    if (it == 0) det0 = det;
+    V half = V(.5) / det;
+    for (int k = 0; k < 9; ++k) x[k] = V(.5) * x[k] + half * c[k];
+  }
+  typename V::Mask proper = Positive(det0);
+  for (int k = 0; k < 9; ++k) r[k] = Select(proper, x[k], r[k]);
+}
+
+template <typename V>
+inline void Kernel(RotationBatch::Method method, int i, int count,
+                   const double* edges, const double* inversePos, double* rot) {
+  V e[9], inv[9], m[9], r[9];
+  for (int c = 0; c < 9; ++c) {
+    e[c] = V::Load(edges + c * count + i);
+    inv[c] = V::Load(inversePos + c * count + i);
+  }
+  // deformation gradient, edges * inversePos. Eigen's vectorised product may
+  // sum some rows in another order, so this can differ from it in the last bit.
+  for (int col = 0; col < 3; ++col) {
+    for (int row = 0; row < 3; ++row) {
+      m[col * 3 + row] = (e[row] * inv[col * 3] + e[3 + row] * inv[col * 3 + 1]) + e[6 + row] * inv[col * 3 + 2];
+    }
+  }
+  GramSchmidt(m, r);
+  if (method == RotationBatch::POLAR) Polar(m, r);
+  for (int c = 0; c < 9; ++c) r[c].Store(rot + c * count + i);
+}
+};
+
+void RotationBatch::Extract(Method method, int begin, int end, int count,
+                            const double* edges, const double* inversePos, double* rot) {
+  int i = begin;
+  for (; i + Wide::width <= end; i += Wide::width) {
+    Kernel<Wide>(method, i, count, edges, inversePos, rot);
+  }
+  for (; i < end; ++i) {
+    Kernel<Scalar>(method, i, count, edges, inversePos, rot);
+  }
+}
+
+const char* RotationBatch::InstructionSet() {
+#if defined(__AVX512F__)
+  return "AVX-512";
+#elif defined(__AVX2__)
+  return "AVX2";
+#else
+  return "scalar";
+#endif
+}
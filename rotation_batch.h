@@ -0,0 +1,24 @@
+#ifndef ROTATION_BATCH_H__
+#define ROTATION_BATCH_H__
+
+// Rotation of many tets at once for corotational FEM. Everything is stored
+// as structure of arrays: component c of tet i lives at [c * count + i] and
+// matrices are column major like Eigen. The kernels run 8 tets at a time
+// with AVX-512, 4 with AVX2 and one at a time otherwise, depending on what
+// the file was compiled for (see SIMDFLAGS in the makefiles).
+namespace RotationBatch {
+  enum Method {
+    GRAM_SCHMIDT = 0, // orthonormalise the columns of the deformation gradient
+    POLAR = 1         // rotation of the polar decomposition, by Newton iteration
+  };
+
+  // edges holds the columns x2 - x1, x3 - x1, x4 - x1 of every tet. Writes
+  // the rotation of tets [begin, end) into rot.
+  void Extract(Method method, int begin, int end, int count,
+               const double* edges, const double* inversePos, double* rot);
+
+  // Name of the instruction set the kernels were compiled for
+  const char* InstructionSet();
+};
+
+#endif
@@ -41,14 +41,41 @@
 #pragma once
 #include "vec3f.h"
 #include "feature.h"
+#include <vector>
 
 typedef void ccdEETestCallback(unsigned int e1_v1, unsigned int e1_v2, unsigned int e2_v1, unsigned int e2_v2, float t);
 typedef void ccdVFTestCallback(unsigned int vid, unsigned int fid, float t);
 
-extern void ccdInitModel(vec3f_list &, tri_list &);
-extern void ccdUpdateVtxs(vec3f_list &);
-extern void ccdQuitModel();
-extern void ccdChecking(bool);
-extern void ccdReport();
-extern void ccdSetEECallback(ccdEETestCallback *funcEE);
-extern void ccdSetVFCallback(ccdVFTestCallback *funcVF);
+struct ccdEEResult {
+	unsigned int e1_v1, e1_v2, e2_v1, e2_v2;
+	float t;
+};
+
+struct ccdVFResult {
+	unsigned int vid, fid;
+	float t;
+};
+
+// Everything one deformable needs for self-CCD: its model, BVH, candidate pair
+// lists and the results of the last check. Contexts share no state, so
+// several can be checked at the same time from different threads.
+struct ccdContext;
+
+extern ccdContext *ccdCreateContext();
+extern void ccdDestroyContext(ccdContext *);
+
+extern void ccdInitModel(ccdContext *, vec3f_list &, tri_list &);
+extern void ccdUpdateVtxs(ccdContext *, vec3f_list &);
+extern void ccdQuitModel(ccdContext *);
+extern void ccdChecking(ccdContext *, bool);
+extern void ccdReport(ccdContext *);
+
+// Called for every collision ccdChecking finds, in addition to it being
+// stored in the context's results. The calls come from the thread running
+// ccdChecking once all tests are done, the EE collisions first.
+extern void ccdSetEECallback(ccdContext *, ccdEETestCallback *funcEE);
+extern void ccdSetVFCallback(ccdContext *, ccdVFTestCallback *funcVF);
+
+// Collisions found by the last ccdChecking, valid until the next one
+extern const std::vector<ccdEEResult> &ccdGetEEResults(ccdContext *);
+extern const std::vector<ccdVFResult> &ccdGetVFResults(ccdContext *);
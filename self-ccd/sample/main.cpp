@@ -87,7 +87,8 @@ int main(int argc, char **argv)
 	BuildSession(DATA_PATH, NUM_FRAME, MODEL_SCALE,
 		vtx_num, all_vtxs, vtxs, tris);
 
-	ccdInitModel(vtxs, tris);
+	ccdContext *ctx = ccdCreateContext();
+	ccdInitModel(ctx, vtxs, tris);
 
 	float circle = SLICES*NUM_FRAME;
 	for (int i=0; i<circle; i++) {
@@ -99,22 +100,22 @@ int main(int argc, char **argv)
 			break;
 
 		GetCurrentVtxs(all_vtxs, vtx_num, prev_frame, next_frame, t-prev_frame, vtxs);
-		ccdUpdateVtxs(vtxs);
+		ccdUpdateVtxs(ctx, vtxs);
 
 //		printf("i = %d\n", i);
 		if (i == 300) {
-			ccdSetEECallback(EECallback);
-			ccdSetVFCallback(VFCallback);
+			ccdSetEECallback(ctx, EECallback);
+			ccdSetVFCallback(ctx, VFCallback);
 		} else {
-			ccdSetEECallback((ccdEETestCallback*)NULL);
-			ccdSetVFCallback((ccdVFTestCallback*)NULL);
+			ccdSetEECallback(ctx, (ccdEETestCallback*)NULL);
+			ccdSetVFCallback(ctx, (ccdVFTestCallback*)NULL);
 		}
 
-		ccdChecking(true);
+		ccdChecking(ctx, true);
 	}
 
-	ccdReport();
-	ccdQuitModel();
+	ccdReport(ctx);
+	ccdDestroyContext(ctx);
 
 	return 0;
 }
@@ -44,18 +44,16 @@
 #include "DeformBVH.h"
 #include "DeformModel.h"
 #include "aap.h"
+#include <new>
 
 extern float middle_xyz(char xyz, const vec3f &p1, const vec3f &p2, const vec3f &p3);
 
-static DeformBVHTree *s_tree;
-static bool s_part = false;
-
-#define ID(a) (s_part ? s_tree->_tri_idxes[(a)] : (a))
+// tri_idxes maps the tris of a partial tree back to the model, NULL for a full one
+#define ID(a) (tri_idxes ? tri_idxes[(a)] : (a))
 
 DeformBVHTree::DeformBVHTree(DeformModel *mdl, bool ccd, unsigned int part)
 {
 	_part = part;
-	s_part = (_part!=-1);
 
 	Construct(mdl, ccd);
 }
@@ -154,24 +152,56 @@ DeformBVHTree::Construct(DeformModel *mdl, bool ccd)
 		}
 	}
 
-	_root = new DeformBVHNode();
-	_root->_box = total;
-	//_root->_count = count;
-	s_tree = this;
+	DeformBVHNode *root = new DeformBVHNode();
+	root->_box = total;
+	//root->_count = count;
+	unsigned int *tri_idxes = _tri_idxes;
 
 	if (count == 1) {
-		_root->_id = ID(0);
-		_root->_left = _root->_right = NULL;
+		root->_id = ID(0);
+		root->_left = root->_right = NULL;
 	} else {
 		if (left_idx == 0 || left_idx == count)
 			left_idx = count/2;
 
-		_root->_left = new DeformBVHNode(_root, idx_buffer, left_idx, mdl);
-		_root->_right = new DeformBVHNode(_root, idx_buffer+left_idx, count-left_idx, mdl);
+		root->_left = new DeformBVHNode(root, idx_buffer, left_idx, mdl, tri_idxes);
+		root->_right = new DeformBVHNode(root, idx_buffer+left_idx, count-left_idx, mdl, tri_idxes);
 	}
 
 	_mdl = mdl;
 
+	// every inner node has two children
+	_num_nodes = 2*count-1;
+	_box_mem = new char[_num_nodes*sizeof(BOX)+64];
+	_boxes = (BOX *)(((size_t)_box_mem+63) & ~(size_t)63);
+	for (unsigned int i=0; i<_num_nodes; i++)
+		new (_boxes+i) BOX();
+	_links = new unsigned int[_num_nodes];
+
+	unsigned int next = 0;
+	flatten(root, next);
+	assert(next == _num_nodes);
+	delete root;
+
+	// level order for refit1
+	_level_nodes.clear();
+	_level_begin.clear();
+	_level_nodes.push_back(0);
+	for (unsigned int begin=0; begin<_level_nodes.size(); ) {
+		unsigned int end = _level_nodes.size();
+		_level_begin.push_back(begin);
+
+		for (unsigned int i=begin; i<end; i++) {
+			unsigned int n = _level_nodes[i];
+			if (!isLeaf(n)) {
+				_level_nodes.push_back(getLeftChild(n));
+				_level_nodes.push_back(getRightChild(n));
+			}
+		}
+		begin = end;
+	}
+	_level_begin.push_back(_level_nodes.size());
+
 	delete [] mdl->_tri_boxes;
 	delete [] mdl->_tri_centers;
 
@@ -179,9 +209,26 @@ DeformBVHTree::Construct(DeformModel *mdl, bool ccd)
 	mdl->_tri_centers = NULL;
 }
 
+// Stores node n and its subtree depth first from index next on
+void
+DeformBVHTree::flatten(DeformBVHNode *n, unsigned int &next)
+{
+	unsigned int i = next++;
+
+	_boxes[i] = n->_box;
+	if (n->isLeaf()) {
+		_links[i] = BVH_LEAF | n->_id;
+	} else {
+		flatten(n->getLeftChild(), next);
+		_links[i] = next-i;
+		flatten(n->getRightChild(), next);
+	}
+}
+
 DeformBVHTree::~DeformBVHTree()
 {
-	delete _root;
+	delete [] _box_mem;
+	delete [] _links;
 	delete [] idx_buffer;
 	if (_tri_idxes)
 		delete [] _tri_idxes;
@@ -213,7 +260,7 @@ DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, unsigned int id)
 }
 
 // called by nodes
-DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, unsigned int *lst, unsigned int lst_num, DeformModel *mdl)
+DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, unsigned int *lst, unsigned int lst_num, DeformModel *mdl, unsigned int *tri_idxes)
 {
 	assert(lst_num > 0);
 	_left = _right = NULL;
@@ -252,13 +299,13 @@ DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, unsigned int *lst, unsigned
 			int hal = lst_num/2;
 			if (left_idx == 0 || left_idx == lst_num)
 			{
-				_left = new DeformBVHNode(this, lst, hal, mdl);
-				_right = new DeformBVHNode(this, lst+hal, lst_num-hal, mdl);
+				_left = new DeformBVHNode(this, lst, hal, mdl, tri_idxes);
+				_right = new DeformBVHNode(this, lst+hal, lst_num-hal, mdl, tri_idxes);
 
 			}
 			else {
-				_left = new DeformBVHNode(this, lst, left_idx, mdl);
-				_right = new DeformBVHNode(this, lst+left_idx, lst_num-left_idx, mdl);
+				_left = new DeformBVHNode(this, lst, left_idx, mdl, tri_idxes);
+				_right = new DeformBVHNode(this, lst+left_idx, lst_num-left_idx, mdl, tri_idxes);
 			}
 
 		}
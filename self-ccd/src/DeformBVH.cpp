@@ -44,36 +44,40 @@
 #include "DeformBVH.h"
 #include "DeformModel.h"
 
-static DeformModel *s_mdl1, *s_mdl2;
-
-#include "tri_pair.h"
-extern non_adjacent_pair_list non_adj_list;
-
-static DeformModel *s_mdl;
-
-void
-DeformBVHNode::getChildren(DeformBVHNode *&n1, DeformBVHNode *&n2, DeformBVHNode *&n3, DeformBVHNode *&n4)
+float
+DeformBVHTree::refit(bool openmp)
 {
-	n1 = getLeftChild()->getLeftChild();
-	n2 = getLeftChild()->getRightChild();
-	n3 = getRightChild()->getLeftChild();
-	n4 = getRightChild()->getRightChild();
-}
+	if (openmp)
+		return refit1(openmp);
+
+	// children come after their parent
+	for (int i=(int)_num_nodes-1; i>=0; i--) {
+		if (isLeaf(i))
+			_boxes[i] = _mdl->_fac_boxes[getTriID(i)];
+		else
+			_boxes[i] = _boxes[getLeftChild(i)] + _boxes[getRightChild(i)];
+	}
 
-void
-DeformBVHNode::mergeBox(DeformBVHNode *n1, DeformBVHNode *n2, DeformBVHNode *n3, DeformBVHNode *n4)
-{
-	getLeftChild()->_box = n1->_box + n2->_box;
-	getRightChild()->_box = n3->_box + n4->_box;
-	_box = getLeftChild()->_box + getRightChild()->_box;
+	return 0.f;
 }
 
 float
-DeformBVHTree::refit(bool openmp)
+DeformBVHTree::refit1(bool openmp)
 {
-	s_mdl = _mdl;
-
-	getRoot()->refit();
+	// deepest level first, a node only reads the boxes of the level below
+	for (int l=(int)_level_begin.size()-2; l>=0; l--) {
+		int begin = _level_begin[l], end = _level_begin[l+1];
+
+#pragma omp parallel for if(openmp && end-begin > 256)
+		for (int k=begin; k<end; k++) {
+			unsigned int i = _level_nodes[k];
+
+			if (isLeaf(i))
+				_boxes[i] = _mdl->_fac_boxes[getTriID(i)];
+			else
+				_boxes[i] = _boxes[getLeftChild(i)] + _boxes[getRightChild(i)];
+		}
+	}
 
 	return 0.f;
 }
@@ -81,104 +85,169 @@ DeformBVHTree::refit(bool openmp)
 void
 DeformBVHTree::collide(DeformBVHTree *other)
 {
-	s_mdl1 = _mdl;
-	s_mdl2 = other->_mdl;
+	ccd_buffer buf;
+	collide(0, other, 0, buf);
 
-	getRoot()->collide(other->getRoot());
+	_mdl->_non_adj_list.insert(_mdl->_non_adj_list.end(), buf._pairs.begin(), buf._pairs.end());
+	_mdl->_num_box_tests += buf._num_box_tests;
+	_mdl->_num_tri_tests += buf._num_tri_tests;
+	_mdl->_num_cov_tests += buf._num_cov_tests;
 }
 
 void
 DeformBVHTree::self_collide()
 {
-	s_mdl1 = _mdl;
-	s_mdl2 = _mdl;
+	if (_mdl->_buffers.empty())
+		_mdl->_buffers.resize(1);
 
-	getRoot()->self_collide();
+	ccd_buffer &buf = _mdl->_buffers[0];
+	self_collide(0, buf);
+
+	_mdl->_non_adj_list.insert(_mdl->_non_adj_list.end(), buf._pairs.begin(), buf._pairs.end());
+	buf._pairs.clear();
 }
 
-BOX
-DeformBVHTree::box()
+// levels of the traversal that are split into tasks, enough for a few
+// hundred tasks to even out the threads
+#define BVH_TASK_DEPTH 8
+
+void
+DeformBVHTree::parallel_self_collide()
 {
-	return getRoot()->_box;
+	do_task_1();
+	do_task_2();
+
+	// gather the pairs in task order, which is the order of self_collide
+	for (unsigned int i=0; i<_tasks.size(); i++) {
+		bvh_task &t = _tasks[i];
+		non_adjacent_pair_list &pairs = _mdl->_buffers[t._thread]._pairs;
+
+		_mdl->_non_adj_list.insert(_mdl->_non_adj_list.end(),
+			pairs.begin()+t._begin, pairs.begin()+t._end);
+	}
+
+	for (unsigned int i=0; i<_mdl->_buffers.size(); i++)
+		_mdl->_buffers[i]._pairs.clear();
 }
 
-inline vec3f norm(vec3f &p1, vec3f &p2, vec3f &p3)
+void
+DeformBVHTree::do_task_1()
 {
-	vec3f s = p2-p1;
-	vec3f t = p3-p1;
-	vec3f n = s.cross(t);
-	return n;
+	_tasks.clear();
+	add_self_tasks(0, BVH_TASK_DEPTH);
 }
 
 void
-DeformBVHNode::refit()
+DeformBVHTree::do_task_2()
 {
-	if (isLeaf()) {
-		_box = s_mdl->_fac_boxes[getTriID()];
-	} else {
-		getLeftChild()->refit();
-		getRightChild()->refit();
+	int num_tasks = (int)_tasks.size();
+
+#pragma omp parallel for schedule(dynamic)
+	for (int i=0; i<num_tasks; i++) {
+		bvh_task &t = _tasks[i];
+		ccd_buffer &buf = _mdl->_buffers[ccd_thread_id()];
+
+		t._thread = ccd_thread_id();
+		t._begin = buf._pairs.size();
+		if (t._b == t._a)
+			self_collide(t._a, buf);
+		else
+			collide(t._a, this, t._b, buf);
+		t._end = buf._pairs.size();
+	}
+}
+
+// These follow self_collide and collide down depth levels and leave what is
+// below to tasks, in the order the recursion would get to it. The box tests
+// on the way are done on the calling thread.
 
-		_box = getLeftChild()->_box + getRightChild()->_box;
+void
+DeformBVHTree::add_self_tasks(unsigned int n, int depth)
+{
+	if (isLeaf(n))
+		return;
+
+	if (depth == 0) {
+		bvh_task t = {n, n, 0, 0, 0};
+		_tasks.push_back(t);
+		return;
 	}
+
+	add_self_tasks(getLeftChild(n), depth-1);
+	add_self_tasks(getRightChild(n), depth-1);
+	add_pair_tasks(getLeftChild(n), getRightChild(n), depth-1);
 }
 
-bool
-DeformBVHNode::find(unsigned int id)
+void
+DeformBVHTree::add_pair_tasks(unsigned int a, unsigned int b, int depth)
 {
-	if (isLeaf())
-		return getTriID() == id;
+	if (depth == 0 || (isLeaf(a) && isLeaf(b))) {
+		bvh_task t = {a, b, 0, 0, 0};
+		_tasks.push_back(t);
+		return;
+	}
 
-	if (getLeftChild()->find(id))
-		return true;
+	_mdl->_buffers[0]._num_box_tests++;
+	if (!_boxes[a].overlaps(_boxes[b]))
+		return;
 
-	if (getRightChild()->find(id))
-		return true;
+	if (isLeaf(a)) {
+		add_pair_tasks(a, getLeftChild(b), depth-1);
+		add_pair_tasks(a, getRightChild(b), depth-1);
+	} else {
+		add_pair_tasks(getLeftChild(a), b, depth-1);
+		add_pair_tasks(getRightChild(a), b, depth-1);
+	}
+}
 
-	return false;
+BOX
+DeformBVHTree::box()
+{
+	return _boxes[0];
 }
 
 void
-DeformBVHNode::self_collide()
+DeformBVHTree::self_collide(unsigned int n, ccd_buffer &buf)
 {
-	if (isLeaf())
+	if (isLeaf(n))
 		return;
 
-	getLeftChild()->self_collide();
-	getRightChild()->self_collide();
-	getLeftChild()->collide(getRightChild());
+	self_collide(getLeftChild(n), buf);
+	self_collide(getRightChild(n), buf);
+	collide(getLeftChild(n), this, getRightChild(n), buf);
 }
 
 void
-DeformBVHNode::collide(DeformBVHNode *other)
+DeformBVHTree::collide(unsigned int a, DeformBVHTree *other, unsigned int b, ccd_buffer &buf)
 {
-	if (isLeaf() && other->isLeaf()) {
-		bool cov = s_mdl1->Covertex_F(getTriID(), other->getTriID());
+	if (isLeaf(a) && other->isLeaf(b)) {
+		unsigned int id1 = getTriID(a), id2 = other->getTriID(b);
+		bool cov = _mdl->Covertex_F(id1, id2);
 
 		if (!cov) {
-			s_mdl1->_num_box_tests++;
-			if (!_box.overlaps(other->_box))
+			buf._num_box_tests++;
+			if (!_boxes[a].overlaps(other->_boxes[b]))
 				return;
 
-			s_mdl1->_num_tri_tests++;
-			non_adj_list.push_back(non_adjacent_pair(getTriID(), other->getTriID()));
+			buf._num_tri_tests++;
+			buf._pairs.push_back(non_adjacent_pair(id1, id2));
 		} else {
-			s_mdl1->_num_cov_tests++;
+			buf._num_cov_tests++;
 		}
 
 		return;
 	}
 
-	s_mdl1->_num_box_tests++;
-	if (!_box.overlaps(other->_box)) {
+	buf._num_box_tests++;
+	if (!_boxes[a].overlaps(other->_boxes[b])) {
 		return;
 	}
 
-	if (isLeaf()) {
-		collide(other->getLeftChild());
-		collide(other->getRightChild());
+	if (isLeaf(a)) {
+		collide(a, other, other->getLeftChild(b), buf);
+		collide(a, other, other->getRightChild(b), buf);
 	} else {
-		getLeftChild()->collide(other);
-		getRightChild()->collide(other);
+		collide(getLeftChild(a), other, b, buf);
+		collide(getRightChild(a), other, b, buf);
 	}
 }
@@ -41,12 +41,29 @@
 #pragma once
 
 #include "box.h"
+#include <vector>
 
 class DeformBVHNode;
 class DeformModel;
 
 class bvh_front_list;
 class non_adjacent_pair_list;
+class ccd_buffer;
+
+// One piece of parallel_self_collide: the self collision of node _a if _b
+// is _a, otherwise the collision of _a with _b. _begin and _end are where its
+// pairs went in the buffer of _thread.
+struct bvh_task {
+	unsigned int _a, _b;
+	int _thread;
+	unsigned int _begin, _end;
+};
+
+// set in DeformBVHTree::_links for leaves, the rest is the tri id
+#define BVH_LEAF 0x80000000u
+
+// Only used while building, DeformBVHTree flattens these into arrays and
+// frees them
 
 class DeformBVHNode {
 	BOX _box;
@@ -60,19 +77,10 @@ class DeformBVHNode {
 public:
 	DeformBVHNode();
 	DeformBVHNode(DeformBVHNode *, unsigned int);
-	DeformBVHNode(DeformBVHNode *, unsigned int *, unsigned int, DeformModel *);
+	DeformBVHNode(DeformBVHNode *, unsigned int *, unsigned int, DeformModel *, unsigned int *);
 
 	~DeformBVHNode();
 
-	void getChildren(DeformBVHNode *&n1, DeformBVHNode *&n2, DeformBVHNode *&n3, DeformBVHNode *&n4);
-	void mergeBox(DeformBVHNode *n1, DeformBVHNode *n2, DeformBVHNode *n3, DeformBVHNode *n4);
-
-	void collide(DeformBVHNode *);
-	void self_collide();
-
-	void refit();
-	bool find(unsigned int);
-
 	FORCEINLINE DeformBVHNode *getLeftChild() { return _left; }
 	FORCEINLINE DeformBVHNode *getRightChild() { return _right; }
 	FORCEINLINE DeformBVHNode *getParent() { return _parent; }
@@ -84,34 +92,65 @@ public:
 friend class DeformBVHTree;
 };
 
+// The nodes are stored depth first, so the left child of node i is i+1 and
+// every subtree is one contiguous range. The traversal only reads the boxes
+// and the 32 bit links, each in its own array; the level order used by the
+// refit is kept apart.
 class DeformBVHTree {
 	DeformModel		*_mdl;
-	DeformBVHNode	*_root;
 	unsigned int	_part;
 	unsigned int *idx_buffer;
 	unsigned int *_tri_idxes;
 
+	unsigned int _num_nodes;
+	// 64 byte aligned, _box_mem is the allocation
+	BOX *_boxes;
+	char *_box_mem;
+	// offset from a node to its right child, or BVH_LEAF | tri id
+	unsigned int *_links;
+
+	// the nodes level by level from the root, a level is
+	// [_level_begin[l], _level_begin[l+1]) of _level_nodes
+	std::vector<unsigned int> _level_nodes;
+	std::vector<unsigned int> _level_begin;
+
+	std::vector<bvh_task> _tasks;
+
+	void flatten(DeformBVHNode *, unsigned int &);
+	void add_self_tasks(unsigned int, int);
+	void add_pair_tasks(unsigned int, unsigned int, int);
+
+	FORCEINLINE bool isLeaf(unsigned int n) const { return (_links[n] & BVH_LEAF) != 0; }
+	FORCEINLINE unsigned int getTriID(unsigned int n) const { return _links[n] & ~BVH_LEAF; }
+	FORCEINLINE unsigned int getLeftChild(unsigned int n) const { return n+1; }
+	FORCEINLINE unsigned int getRightChild(unsigned int n) const { return n+_links[n]; }
+
+	// node a of this tree against node b of other
+	void collide(unsigned int a, DeformBVHTree *other, unsigned int b, ccd_buffer &);
+	void self_collide(unsigned int, ccd_buffer &);
+
 public:
 	DeformBVHTree(DeformModel *, bool, unsigned int = -1);
 	~DeformBVHTree();
 
 	void Construct(DeformModel *, bool);
 
-	float refit(bool = true);
-	float refit1(bool = true);
+	// refit sweeps the nodes from the back unless openmp is set, refit1 goes
+	// bottom up over the levels and splits every large one over the threads
+	float refit(bool openmp = true);
+	float refit1(bool openmp = true);
 
 	void collide(DeformBVHTree *);
 	void self_collide();
-	void self_collide_norecursive();
+	// same pairs in the same order as self_collide, found by several threads
 	void parallel_self_collide();
-	void check_connection();
 
+	// splits the top of the traversal into _tasks
 	void do_task_1();
+	// runs _tasks on all threads
 	void do_task_2();
 
 	BOX box();
-	FORCEINLINE DeformBVHNode *getRoot() { return _root; }
 
-friend class DeformBVHNode;
 friend class DeformModel;
 };
@@ -48,17 +48,10 @@
 
 using namespace std;
 
-#include "tri_pair.h"
-vector<adjacent_pair> adj_1_list;
-vector<adjacent_pair> adj_2_list;
-non_adjacent_pair_list non_adj_list;
-
 #include "DeformModel.h"
 #include "DeformBVH.h"
 
 
-#include <omp.h>
-
 DeformModel::~DeformModel()
 {
 	Clean();
@@ -108,6 +101,9 @@ DeformModel::Init()
 
 	_num_parts = 0;
 	_parts = NULL;
+
+	_cb_ee = NULL;
+	_cb_vf = NULL;
 }
 
 void
@@ -137,6 +133,8 @@ DeformModel::Clean()
 	if (_tri_flags) delete [] _tri_flags;
 
 	if (_parts) delete [] _parts;
+
+	if (_tree) delete _tree;
 }
 
 void
@@ -218,18 +216,21 @@ DeformModel::UpdateVert(unsigned int prev, unsigned int next, float t)
 void
 DeformModel::UpdateBoxes()
 {
-	for (int i=0; i<_num_vtx; i++) {
+#pragma omp parallel for
+	for (int i=0; i<(int)_num_vtx; i++) {
 		_vtx_boxes[i] = BOX(_cur_vtxs[i]) + _prev_vtxs[i];
 	}
 
-	for (int i=0; i<_num_edge; i++) {
+#pragma omp parallel for
+	for (int i=0; i<(int)_num_edge; i++) {
 		unsigned int id0 = _edges[i].vid(0);
 		unsigned int id1 = _edges[i].vid(1);
 
 		_edg_boxes[i] = _vtx_boxes[id0] + _vtx_boxes[id1];
 	}
 
-	for (int i=0; i<_num_tri; i++) {
+#pragma omp parallel for
+	for (int i=0; i<(int)_num_tri; i++) {
 		unsigned int id0 = _tris[i].id0();
 		unsigned int id1 = _tri_edges[i].id(1);
 
@@ -278,29 +279,107 @@ void DeformModel::SelfCollide(bool ccd)
 	if (_tree == NULL)
 		return;
 
-	non_adj_list.clear();
+	_buffers.resize(ccd_num_threads());
+	for (unsigned int i=0; i<_buffers.size(); i++)
+		_buffers[i].clear();
 
-	_tree->self_collide();
+	_non_adj_list.clear();
+	_ee_results.clear();
+	_vf_results.clear();
+
+	if (_buffers.size() > 1)
+		_tree->parallel_self_collide();
+	else
+		_tree->self_collide();
 
 	do_pairs();
+
+	merge_counters();
 }
 
+// non-adjacent pairs and orphans tested by one task of do_pairs
+#define CCD_BLOCK 64
+
+struct ccd_block {
+	int thread;
+	unsigned int ee_begin, ee_end;
+	unsigned int vf_begin, vf_end;
+};
+
 void
 DeformModel::do_pairs()
 {
-	do_non_adj_pairs();
+	// the non-adjacent pairs and then the orphans, in blocks handed out to
+	// the threads as they finish, every block remembers where its results
+	// went so they can be gathered in order
+	int num_pairs = (int)_non_adj_list.size();
+	int num_tests = num_pairs + (int)(_ee_keeper.size() + _vf_keeper.size());
+	int num_blocks = (num_tests + CCD_BLOCK - 1)/CCD_BLOCK;
+	vector<ccd_block> blocks(num_blocks);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int b=0; b<num_blocks; b++) {
+		int thread = ccd_thread_id();
+		ccd_buffer &buf = _buffers[thread];
+		ccd_block &blk = blocks[b];
+
+		blk.thread = thread;
+		blk.ee_begin = buf._ee_results.size();
+		blk.vf_begin = buf._vf_results.size();
+
+		int end = min((b+1)*CCD_BLOCK, num_tests);
+		for (int i=b*CCD_BLOCK; i<end; i++) {
+			if (i < num_pairs) {
+				unsigned int id1, id2;
+				_non_adj_list[i].get_param(id1, id2);
+				test_feature_0(id1, id2, buf);
+			} else
+				do_orphan(i-num_pairs, buf);
+		}
+
+		blk.ee_end = buf._ee_results.size();
+		blk.vf_end = buf._vf_results.size();
+	}
+
+	for (int b=0; b<num_blocks; b++) {
+		ccd_block &blk = blocks[b];
+		ccd_buffer &buf = _buffers[blk.thread];
+
+		_ee_results.insert(_ee_results.end(),
+			buf._ee_results.begin()+blk.ee_begin, buf._ee_results.begin()+blk.ee_end);
+		_vf_results.insert(_vf_results.end(),
+			buf._vf_results.begin()+blk.vf_begin, buf._vf_results.begin()+blk.vf_end);
+	}
 
-	do_orphans();
+	// the callbacks may not be thread safe, so they are called from here
+	if (_cb_ee)
+		for (unsigned int i=0; i<_ee_results.size(); i++) {
+			ccdEEResult &r = _ee_results[i];
+			(*_cb_ee)(r.e1_v1, r.e1_v2, r.e2_v1, r.e2_v2, r.t);
+		}
+	if (_cb_vf)
+		for (unsigned int i=0; i<_vf_results.size(); i++) {
+			ccdVFResult &r = _vf_results[i];
+			(*_cb_vf)(r.vid, r.fid, r.t);
+		}
 }
 
 void
-DeformModel::do_non_adj_pairs()
+DeformModel::merge_counters()
 {
-	for (vector<non_adjacent_pair>::iterator it=non_adj_list.begin(); it != non_adj_list.end(); it++)
-	{
-		unsigned int id1, id2;
-		(*it).get_param(id1, id2);
-		test_feature_0(id1, id2);
+	for (unsigned int i=0; i<_buffers.size(); i++) {
+		ccd_buffer &buf = _buffers[i];
+
+		_num_box_tests += buf._num_box_tests;
+		_num_tri_tests += buf._num_tri_tests;
+		_num_ccd_tests += buf._num_ccd_tests;
+		_num_cov_tests += buf._num_cov_tests;
+		_num_lp_tests += buf._num_lp_tests;
+
+		_num_vf_test += buf._num_vf_test;
+		_num_ee_test += buf._num_ee_test;
+		_num_vf_true += buf._num_vf_true;
+		_num_ee_true += buf._num_ee_true;
 	}
 }
 
@@ -447,10 +526,6 @@ DeformModel::Build(vec3f_list &vtxs, tri_list &tris)
 	BufferAdjacent();
 }
 
-
-#include "tri_pair.h"
-extern vector<adjacent_pair> adj_2_list;
-extern vector<adjacent_pair> adj_1_list;
 #define swapCoolI(a, b) {\
 	unsigned int tmp = a;\
 	a = b;\
@@ -513,7 +588,7 @@ DeformModel::get_status_2(unsigned int id1, unsigned int id2, unsigned int st1,
 void
 DeformModel::BufferAdjacent()
 {
-	adj_2_list.clear();
+	_adj_2_list.clear();
 	for (unsigned int i=0; i<_num_edge; i++) {
 		unsigned int id1 = _edges[i].fid(0);
 		unsigned int id2 = _edges[i].fid(1);
@@ -528,10 +603,10 @@ DeformModel::BufferAdjacent()
 		char status = get_status_2(id1, id2, st1, st2);
 		//if (status == 3) continue;
 
-		adj_2_list.push_back(adjacent_pair(id1, id2, st1, st2, status));
+		_adj_2_list.push_back(adjacent_pair(id1, id2, st1, st2, status));
 	}
 
-	adj_1_list.clear();
+	_adj_1_list.clear();
 	for (unsigned int i=0; i<_num_vtx; i++) {
 		for (id_list::iterator it1=_vtx_fids[i].begin(); it1!=_vtx_fids[i].end(); it1++) {
 			for (id_list::iterator it2=it1; it2!=_vtx_fids[i].end(); it2++) {
@@ -548,13 +623,13 @@ DeformModel::BufferAdjacent()
 				char status = get_status_1(id1, id2, st1, st2);
 				//if (status == 3) continue;
 
-				adj_1_list.push_back(adjacent_pair(id1, id2, st1, st2, status));
+				_adj_1_list.push_back(adjacent_pair(id1, id2, st1, st2, status));
 			}
 		}
 	}
 
-	sort(adj_1_list.begin(), adj_1_list.end());
-	adj_1_list.erase(unique(adj_1_list.begin(), adj_1_list.end()), adj_1_list.end());
+	sort(_adj_1_list.begin(), _adj_1_list.end());
+	_adj_1_list.erase(unique(_adj_1_list.begin(), _adj_1_list.end()), _adj_1_list.end());
 
 	get_orphans();
 }
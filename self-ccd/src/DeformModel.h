@@ -53,6 +53,66 @@ typedef vector<unsigned int> id_list;
 class DeformBVHTree;
 
 #include "box.h"
+#include "tri_pair.h"
+#include "feature_pair.h"
+#include "ccdAPI.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Threads the BVH refit, the traversal and the CCD tests are split over,
+// one without OpenMP
+FORCEINLINE int ccd_num_threads()
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+FORCEINLINE int ccd_thread_id()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// What one thread of SelfCollide finds, the model merges the buffers of all
+// threads in the order a single thread would have produced them
+class ccd_buffer {
+public:
+	unsigned int _num_box_tests;
+	unsigned int _num_tri_tests;
+	unsigned int _num_ccd_tests;
+	unsigned int _num_cov_tests;
+	unsigned int _num_lp_tests;
+
+	unsigned int _num_vf_test;
+	unsigned int _num_ee_test;
+	unsigned int _num_vf_true;
+	unsigned int _num_ee_true;
+
+	non_adjacent_pair_list _pairs;
+	vector<ccdEEResult> _ee_results;
+	vector<ccdVFResult> _vf_results;
+
+	// keeps the counters of neighbouring buffers off each other's cache line
+	char _pad[64];
+
+	ccd_buffer() { clear(); }
+
+	void clear() {
+		_num_box_tests = _num_tri_tests = _num_ccd_tests = _num_cov_tests = _num_lp_tests = 0;
+		_num_vf_test = _num_ee_test = _num_vf_true = _num_ee_true = 0;
+		_pairs.clear();
+		_ee_results.clear();
+		_vf_results.clear();
+	}
+};
 
 class DeformModel {
 	unsigned int _num_vtx;
@@ -107,8 +167,24 @@ class DeformModel {
 	unsigned int _num_parts;
 	unsigned int *_parts;
 
+	// candidate pairs, kept per model so several models can be checked at once
+	non_adjacent_pair_list _non_adj_list;
+	vector<adjacent_pair> _adj_1_list;
+	vector<adjacent_pair> _adj_2_list;
+	ee_list _ee_keeper;
+	vf_list _vf_keeper;
+
+	// one per thread, kept across frames so their memory is reused
+	vector<ccd_buffer> _buffers;
+
+	// results of the last SelfCollide
+	ccdEETestCallback *_cb_ee;
+	ccdVFTestCallback *_cb_vf;
+	vector<ccdEEResult> _ee_results;
+	vector<ccdVFResult> _vf_results;
+
 	void do_pairs();
-	void do_non_adj_pairs();
+	void merge_counters();
 
 	void BufferAdjacent();
 	char get_status_1(unsigned int id1, unsigned int id2, unsigned int st1, unsigned int st2);
@@ -138,6 +214,13 @@ public:
 	void ResetCounter();
 	void SelfCollide(bool ccd);
 
+	void SetCallbacks(ccdEETestCallback *funcEE, ccdVFTestCallback *funcVF) {
+		_cb_ee = funcEE;
+		_cb_vf = funcVF;
+	}
+	FORCEINLINE const vector<ccdEEResult> &EEResults() { return _ee_results; }
+	FORCEINLINE const vector<ccdVFResult> &VFResults() { return _vf_results; }
+
 	FORCEINLINE int NumTri() { return _num_tri; }
 	FORCEINLINE int NumBoxTest() { return _num_box_tests; }
 	FORCEINLINE int NumTriTest() { return _num_tri_tests; }
@@ -188,21 +271,21 @@ public:
 	friend class DeformBVHTree;
 	friend class DeformBVHNode;
 
-	float intersect_vf(unsigned int fid1, unsigned int vid2, unsigned int fid2);
+	float intersect_vf(unsigned int fid1, unsigned int vid2, unsigned int fid2, ccd_buffer &buf);
 	bool check_vf(unsigned int fid, unsigned int vid);
 
-	float intersect_ee(unsigned int e1, unsigned int e2, unsigned int fid1, unsigned int fid2);
+	float intersect_ee(unsigned int e1, unsigned int e2, unsigned int fid1, unsigned int fid2, ccd_buffer &buf);
 	bool check_ee(unsigned int e1, unsigned int e2);
 
-	float intersect_vf(unsigned int fid, unsigned int vid);
-	float intersect_ee(unsigned int e1, unsigned int e2);
-	float do_vf(unsigned int fid, unsigned int vid);
-	float do_ee(unsigned int e1, unsigned int e2);
+	float intersect_vf(unsigned int fid, unsigned int vid, ccd_buffer &buf);
+	float intersect_ee(unsigned int e1, unsigned int e2, ccd_buffer &buf);
+	float do_vf(unsigned int fid, unsigned int vid, ccd_buffer &buf);
+	float do_ee(unsigned int e1, unsigned int e2, ccd_buffer &buf);
 
-	void test_feature_0(unsigned id1, unsigned int id2);
+	void test_feature_0(unsigned id1, unsigned int id2, ccd_buffer &buf);
 
 	/// for orphan set
-	void do_orphans();
+	void do_orphan(unsigned int i, ccd_buffer &buf);
 	void get_orphans();
 	void get_feature_1(unsigned int, unsigned int, unsigned int, unsigned int);
 	void get_feature_2(unsigned int, unsigned int, unsigned int, unsigned int);
@@ -42,36 +42,62 @@
 #include "ccdAPI.h"
 #include <stdio.h>
 
-static DeformModel *mdl;
-static double g_total = 0;
+struct ccdContext {
+	DeformModel *mdl;
+	ccdEETestCallback *cbFuncEE;
+	ccdVFTestCallback *cbFuncVF;
 
-ccdEETestCallback *cbFuncEE;
-ccdVFTestCallback *cbFuncVF;
+	// returned when there is no model yet
+	std::vector<ccdEEResult> noEE;
+	std::vector<ccdVFResult> noVF;
+};
 
-void ccdSetEECallback(ccdEETestCallback *funcEE)
+ccdContext *ccdCreateContext()
 {
-	cbFuncEE = funcEE;
+	ccdContext *ctx = new ccdContext;
+	ctx->mdl = NULL;
+	ctx->cbFuncEE = NULL;
+	ctx->cbFuncVF = NULL;
+	return ctx;
 }
 
-void ccdSetVFCallback(ccdVFTestCallback *funcVF)
+void ccdDestroyContext(ccdContext *ctx)
 {
-	cbFuncVF = funcVF;
+	ccdQuitModel(ctx);
+	delete ctx;
 }
 
-void ccdInitModel(vec3f_list &vtxs, tri_list &tris)
+void ccdSetEECallback(ccdContext *ctx, ccdEETestCallback *funcEE)
 {
-	mdl = new DeformModel(vtxs, tris);
-	mdl->BuildBVH(true);
+	ctx->cbFuncEE = funcEE;
+	if (ctx->mdl)
+		ctx->mdl->SetCallbacks(ctx->cbFuncEE, ctx->cbFuncVF);
 }
 
-void ccdUpdateVtxs(vec3f_list &vtxs)
+void ccdSetVFCallback(ccdContext *ctx, ccdVFTestCallback *funcVF)
 {
-	mdl->UpdateVert(vtxs);
-	mdl->UpdateBoxes();
+	ctx->cbFuncVF = funcVF;
+	if (ctx->mdl)
+		ctx->mdl->SetCallbacks(ctx->cbFuncEE, ctx->cbFuncVF);
 }
 
-void ccdChecking(bool refit)
+void ccdInitModel(ccdContext *ctx, vec3f_list &vtxs, tri_list &tris)
 {
+	ccdQuitModel(ctx);
+	ctx->mdl = new DeformModel(vtxs, tris);
+	ctx->mdl->SetCallbacks(ctx->cbFuncEE, ctx->cbFuncVF);
+	ctx->mdl->BuildBVH(true);
+}
+
+void ccdUpdateVtxs(ccdContext *ctx, vec3f_list &vtxs)
+{
+	ctx->mdl->UpdateVert(vtxs);
+	ctx->mdl->UpdateBoxes();
+}
+
+void ccdChecking(ccdContext *ctx, bool refit)
+{
+	DeformModel *mdl = ctx->mdl;
 
 	if (!refit) {
 		mdl->RebuildBVH(true);
@@ -86,11 +112,22 @@ void ccdChecking(bool refit)
 
 }
 
-void ccdQuitModel()
+void ccdQuitModel(ccdContext *ctx)
+{
+	delete ctx->mdl;
+	ctx->mdl = NULL;
+}
+
+void ccdReport(ccdContext *ctx)
+{
+}
+
+const std::vector<ccdEEResult> &ccdGetEEResults(ccdContext *ctx)
 {
-	delete mdl;
+	return ctx->mdl ? ctx->mdl->EEResults() : ctx->noEE;
 }
 
-void ccdReport()
+const std::vector<ccdVFResult> &ccdGetVFResults(ccdContext *ctx)
 {
+	return ctx->mdl ? ctx->mdl->VFResults() : ctx->noVF;
 }
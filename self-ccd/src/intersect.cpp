@@ -41,10 +41,6 @@
 #include "DeformModel.h"
 #include "aabb.h"
 
-#include "ccdAPI.h"
-extern ccdEETestCallback *cbFuncEE;
-extern ccdVFTestCallback *cbFuncVF;
-
 #ifndef swapI
 #define swapI(a, b) {\
 	unsigned int tmp = a;\
@@ -78,8 +74,6 @@ inline bool side(vec3f &a, vec3f &b, vec3f &c, vec3f &p)
 	return norm(a, b, c).dot(p-a) > 0;
 }
 
-extern unsigned int g_frame;
-
 inline bool
 check_abcd(vec3f &a0, vec3f &b0, vec3f &c0, vec3f &d0,
 					vec3f &a1, vec3f &b1, vec3f &c1, vec3f &d1)
@@ -154,12 +148,12 @@ DeformModel::check_ee(unsigned int e1, unsigned int e2)
 }
 
 float
-DeformModel::intersect_vf(unsigned int fid1, unsigned int vid2, unsigned int fid2)
+DeformModel::intersect_vf(unsigned int fid1, unsigned int vid2, unsigned int fid2, ccd_buffer &buf)
 {
 	if (!_fac_boxes[fid1].overlaps(_vtx_boxes[vid2]))
 		return -1.f;
 
-	_num_ccd_tests++;
+	buf._num_ccd_tests++;
 
 	for (id_list::iterator it1=_vtx_fids[vid2].begin(); it1!=_vtx_fids[vid2].end(); it1++) {
 			unsigned int fid = *it1;
@@ -168,7 +162,7 @@ DeformModel::intersect_vf(unsigned int fid1, unsigned int vid2, unsigned int fid
 					if (check_vf(fid1, vid2) == false)
 						return -1.f;
 					else
-						return do_vf(fid1, vid2);
+						return do_vf(fid1, vid2, buf);
 				} else
 					return -1.f;
 			}
@@ -177,22 +171,22 @@ DeformModel::intersect_vf(unsigned int fid1, unsigned int vid2, unsigned int fid
 }
 
 float
-DeformModel::intersect_vf(unsigned int fid, unsigned int vid)
+DeformModel::intersect_vf(unsigned int fid, unsigned int vid, ccd_buffer &buf)
 {
 	if (!_fac_boxes[fid].overlaps(_vtx_boxes[vid]))
 		return -1.f;
 
-	_num_ccd_tests++;
+	buf._num_ccd_tests++;
 	if (check_vf(fid, vid) == false)
 		return -1.f;
 	else
-		return do_vf(fid, vid);
+		return do_vf(fid, vid, buf);
 }
 
 float
-DeformModel::do_vf(unsigned int fid, unsigned int vid)
+DeformModel::do_vf(unsigned int fid, unsigned int vid, ccd_buffer &buf)
 {
-	_num_vf_test++;
+	buf._num_vf_test++;
 
 	vec3f qi, baryc;
 	unsigned v0 = _tris[fid].id0();
@@ -205,17 +199,17 @@ DeformModel::do_vf(unsigned int fid, unsigned int vid)
 		_prev_vtxs[vid], _cur_vtxs[vid], qi, baryc);
 
 	if (ret> -0.5) {
-		_num_lp_tests++;
-		_num_vf_true++;
-		if (cbFuncVF)
-			(*cbFuncVF)(vid, fid, ret);
+		buf._num_lp_tests++;
+		buf._num_vf_true++;
+		ccdVFResult r = {vid, fid, ret};
+		buf._vf_results.push_back(r);
 	}
 
 	return ret;
 }
 
 float
-DeformModel::intersect_ee(unsigned int e1, unsigned int e2, unsigned int f1, unsigned int f2)
+DeformModel::intersect_ee(unsigned int e1, unsigned int e2, unsigned int f1, unsigned int f2, ccd_buffer &buf)
 {
 	if (!_edg_boxes[e1].overlaps(_edg_boxes[e2]))
 		return -1.f;
@@ -244,7 +238,7 @@ DeformModel::intersect_ee(unsigned int e1, unsigned int e2, unsigned int f1, uns
 						if (check_ee(e1, e2) == false)
 							return -1.f;
 						else
-							return do_ee(e1, e2);
+							return do_ee(e1, e2, buf);
 				}else
 					return -1.f;
 			}
@@ -254,23 +248,23 @@ DeformModel::intersect_ee(unsigned int e1, unsigned int e2, unsigned int f1, uns
 }
 
 float
-DeformModel::intersect_ee(unsigned int e1, unsigned int e2)
+DeformModel::intersect_ee(unsigned int e1, unsigned int e2, ccd_buffer &buf)
 {
 	if (!_edg_boxes[e1].overlaps(_edg_boxes[e2]))
 		return -1.f;
 
-	_num_ccd_tests++;
+	buf._num_ccd_tests++;
 
 	if (check_ee(e1, e2) == false)
 		return -1.f;
 	else
-		return do_ee(e1, e2);
+		return do_ee(e1, e2, buf);
 }
 
 float
-DeformModel::do_ee(unsigned int e1, unsigned int e2)
+DeformModel::do_ee(unsigned int e1, unsigned int e2, ccd_buffer &buf)
 {
-	_num_ee_test++;
+	buf._num_ee_test++;
 
 	vec3f qi;
 	unsigned v0 = _edges[e1].vid(0);
@@ -288,25 +282,24 @@ DeformModel::do_ee(unsigned int e1, unsigned int e2)
 	//tm.endTiming(7);
 
 	if (ret> -0.5) {
-		_num_lp_tests++;
-		_num_ee_true++;
+		buf._num_lp_tests++;
+		buf._num_ee_true++;
 
-		if (cbFuncEE) {
-			(*cbFuncEE)(v0, v1, w0, w1, ret);
-		}
+		ccdEEResult r = {v0, v1, w0, w1, ret};
+		buf._ee_results.push_back(r);
 	}
 
 	return ret;
 }
 
 void
-DeformModel::test_feature_0(unsigned id1, unsigned int id2)
+DeformModel::test_feature_0(unsigned id1, unsigned int id2, ccd_buffer &buf)
 {
 #if defined(FOR_BART) || defined(FOR_DRAGON)
 	// 6 VF test
 	for (int i=0; i<3; i++) {
-		intersect_vf(id1, _tris[id2].id(i));
-		intersect_vf(id2, _tris[id1].id(i));
+		intersect_vf(id1, _tris[id2].id(i), buf);
+		intersect_vf(id2, _tris[id1].id(i), buf);
 	}
 
 	// 9 EE test
@@ -315,7 +308,7 @@ DeformModel::test_feature_0(unsigned id1, unsigned int id2)
 		unsigned int e0 = _tri_edges[id1].id(i);
 		unsigned int e1 = _tri_edges[id2].id(j);
 		
-		intersect_ee(e0, e1);
+		intersect_ee(e0, e1, buf);
 	}
 
 	return;
@@ -323,8 +316,8 @@ DeformModel::test_feature_0(unsigned id1, unsigned int id2)
 
 	// 6 VF test
 	for (int i=0; i<3; i++) {
-		intersect_vf(id1, _tris[id2].id(i), id2);
-		intersect_vf(id2, _tris[id1].id(i), id1);
+		intersect_vf(id1, _tris[id2].id(i), id2, buf);
+		intersect_vf(id2, _tris[id1].id(i), id1, buf);
 	}
 
 	// 9 EE test
@@ -333,6 +326,6 @@ DeformModel::test_feature_0(unsigned id1, unsigned int id2)
 		unsigned int e0 = _tri_edges[id1].id(i);
 		unsigned int e1 = _tri_edges[id2].id(j);
 		
-		intersect_ee(e0, e1, id1, id2);
+		intersect_ee(e0, e1, id1, id2, buf);
 	}
 }
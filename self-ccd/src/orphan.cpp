@@ -43,14 +43,6 @@
 
 #include <algorithm>
 
-#include "tri_pair.h"
-extern vector<adjacent_pair> adj_2_list;
-extern vector<adjacent_pair> adj_1_list;
-
-#include "feature_pair.h"
-static ee_list ee_keeper;
-static vf_list vf_keeper;
-
 #ifndef swapI
 #define swapI(a, b) {\
 	unsigned int tmp = a;\
@@ -59,18 +51,18 @@ static vf_list vf_keeper;
 }
 #endif
 
+// Tests the i-th orphan, the EE ones come first
 void
-DeformModel::do_orphans()
+DeformModel::do_orphan(unsigned int i, ccd_buffer &buf)
 {
-	for (ee_list::iterator it=ee_keeper.begin(); it!=ee_keeper.end(); it++) {
+	if (i < _ee_keeper.size()) {
 		unsigned int e1, e2;
-		(*it).get_param(e1, e2);
-		intersect_ee(e1, e2);
-	}
-	for (vf_list::iterator it=vf_keeper.begin(); it!=vf_keeper.end(); it++) {
+		_ee_keeper[i].get_param(e1, e2);
+		intersect_ee(e1, e2, buf);
+	} else {
 		unsigned int v, f;
-		(*it).get_param(f, v);
-		intersect_vf(f, v);
+		_vf_keeper[i - _ee_keeper.size()].get_param(f, v);
+		intersect_vf(f, v, buf);
 	}
 }
 
@@ -80,26 +72,26 @@ DeformModel::get_orphans()
 	unsigned int id1, id2, st1, st2;
 	char status;
 
-	for (vector<adjacent_pair>::iterator it=adj_1_list.begin(); it!=adj_1_list.end(); it++) {
+	for (vector<adjacent_pair>::iterator it=_adj_1_list.begin(); it!=_adj_1_list.end(); it++) {
 		(*it).get_param(id1, id2, st1, st2, status);
 		get_feature_1(id1, id2, st1, st2);
 	}
-	sort(vf_keeper.begin(), vf_keeper.end());
-	vf_keeper.erase(unique(vf_keeper.begin(), vf_keeper.end()), vf_keeper.end());
+	sort(_vf_keeper.begin(), _vf_keeper.end());
+	_vf_keeper.erase(unique(_vf_keeper.begin(), _vf_keeper.end()), _vf_keeper.end());
 
-	sort(ee_keeper.begin(), ee_keeper.end());
-	ee_keeper.erase(unique(ee_keeper.begin(), ee_keeper.end()), ee_keeper.end());
+	sort(_ee_keeper.begin(), _ee_keeper.end());
+	_ee_keeper.erase(unique(_ee_keeper.begin(), _ee_keeper.end()), _ee_keeper.end());
 
-	for (vector<adjacent_pair>::iterator it=adj_2_list.begin(); it!=adj_2_list.end(); it++) {
+	for (vector<adjacent_pair>::iterator it=_adj_2_list.begin(); it!=_adj_2_list.end(); it++) {
 		(*it).get_param(id1, id2, st1, st2, status);
 		get_feature_2(id1, id2, st1, st2);
 	}
 
-	sort(vf_keeper.begin(), vf_keeper.end());
-	vf_keeper.erase(unique(vf_keeper.begin(), vf_keeper.end()), vf_keeper.end());
+	sort(_vf_keeper.begin(), _vf_keeper.end());
+	_vf_keeper.erase(unique(_vf_keeper.begin(), _vf_keeper.end()), _vf_keeper.end());
 
-	sort(ee_keeper.begin(), ee_keeper.end());
-	ee_keeper.erase(unique(ee_keeper.begin(), ee_keeper.end()), ee_keeper.end());
+	sort(_ee_keeper.begin(), _ee_keeper.end());
+	_ee_keeper.erase(unique(_ee_keeper.begin(), _ee_keeper.end()), _ee_keeper.end());
 }
 
 bool
@@ -137,7 +129,7 @@ void
 DeformModel::insert_ee(unsigned int e1, unsigned int e2)
 {
 	if (test_orphan_ee(e1, e2)) {
-		ee_keeper.push_back(ee_pair(e1, e2));
+		_ee_keeper.push_back(ee_pair(e1, e2));
 	}
 }
 
@@ -145,7 +137,7 @@ void
 DeformModel::insert_vf(unsigned int f, unsigned int v)
 {
 	if (test_orphan_vf(f, v)) {
-		vf_keeper.push_back(vf_pair(f, v));
+		_vf_keeper.push_back(vf_pair(f, v));
 	}
 }
 
@@ -0,0 +1,128 @@
+#include "thread_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+class Pool {
+ public:
+  Pool() : wanted(0), generation(0), running(0), quit(false), job(NULL) {
+    // hardware_concurrency can hit the filesystem, so only ask once
+    cores = std::thread::hardware_concurrency();
+  }
+  ~Pool() { Stop(); }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    for (int i = 0; i < workers.size(); ++i) {
+      workers[i].join();
+    }
+    workers.clear();
+    quit = false;
+  }
+
+  int Count() {
+    int n = wanted > 0 ? wanted : cores;
+    return n < 1 ? 1 : n;
+  }
+
+  void Start() {
+    int n = Count();
+    if (n - 1 == workers.size()) return;
+    Stop();
+    for (int i = 0; i < n - 1; ++i) {
+      workers.push_back(std::thread(&Pool::WorkerLoop, this));
+    }
+  }
+
+  void Run(int count, const std::function<void(int, int)>& fn) {
+    Start();
+    if (workers.empty() || count < 2) {
+      if (count > 0) fn(0, count);
+      return;
+    }
+    int threads = workers.size() + 1;
+    // a few chunks per thread so uneven tets still balance
+    grain = count / (threads * 4);
+    if (grain < 1) grain = 1;
+    total = count;
+    next = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &fn;
+      running = workers.size();
+      generation++;
+    }
+    wake.notify_all();
+    Work(fn);
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return running == 0; });
+    job = NULL;
+  }
+
+  int wanted;
+  int cores;
+  std::vector<std::thread> workers;
+
+ private:
+  void Work(const std::function<void(int, int)>& fn) {
+    while (true) {
+      int begin = next.fetch_add(grain);
+      if (begin >= total) break;
+      int end = begin + grain < total ? begin + grain : total;
+      fn(begin, end);
+    }
+  }
+
+  void WorkerLoop() {
+    int seen = 0;
+    while (true) {
+      const std::function<void(int, int)>* current;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this, seen] { return quit || generation != seen; });
+        if (quit) return;
+        seen = generation;
+        current = job;
+      }
+      Work(*current);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        running--;
+      }
+      finished.notify_one();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished;
+  int generation;
+  int running;
+  bool quit;
+  const std::function<void(int, int)>* job;
+  std::atomic<int> next;
+  int grain;
+  int total;
+};
+
+Pool pool;
+};
+
+void ThreadPool::SetNumThreads(int n) {
+  pool.wanted = n;
+}
+
+int ThreadPool::GetNumThreads() {
+  return pool.Count();
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int, int)>& fn) {
+  pool.Run(count, fn);
+}
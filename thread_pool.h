@@ -0,0 +1,16 @@
+#ifndef THREAD_POOL_H__
+#define THREAD_POOL_H__
+
+#include <functional>
+
+// Persistent worker threads for splitting loops over tets and vertices.
+namespace ThreadPool {
+  // 0 means one thread per hardware core
+  void SetNumThreads(int n);
+  int GetNumThreads();
+  // Calls fn(begin, end) on disjoint chunks covering [0, count) and returns
+  // once all of them are done. The calling thread works on chunks too.
+  void ParallelFor(int count, const std::function<void(int, int)>& fn);
+};
+
+#endif
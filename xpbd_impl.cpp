@@ -0,0 +1,261 @@
+#include "particle_system.h"
+#include "Eigen/Dense"
+#include "Eigen/Geometry"
+#include <algorithm>
+#include <math.h>
+#include "thread_pool.h"
+
+namespace {
+// Constraints grouped by color, no two constraints of a color share a
+// particle. Color c is constraintOrder[constraintOffsets[c]] up to
+// constraintOrder[constraintOffsets[c + 1]]. Indices below tets.size() are
+// tets, the rest are springs.
+std::vector<int> constraintOrder;
+std::vector<int> constraintOffsets;
+bool builtWithEdges = false;
+
+// Lagrange multipliers accumulated over the iterations of one step, the
+// strain and volume constraint of every tet and then every spring
+std::vector<double> lambda;
+// Size of the last correction of every constraint, for the residual
+std::vector<double> correction;
+// Rotation of every tet at its last projection, where the next one starts
+std::vector<Eigen::Quaterniond> tetQuat;
+
+// One warm started step of the rotation extraction of Mueller et al. 2016,
+// turns q towards the rotational part of A
+void ExtractRotation(const Eigen::Matrix3d& A, Eigen::Quaterniond& q) {
+  Eigen::Matrix3d R = q.matrix();
+  Eigen::Vector3d omega = R.col(0).cross(A.col(0)) + R.col(1).cross(A.col(1)) + R.col(2).cross(A.col(2));
+  omega /= fabs(R.col(0).dot(A.col(0)) + R.col(1).dot(A.col(1)) + R.col(2).dot(A.col(2))) + 1.0e-9;
+  double w = omega.norm();
+  if (w < 1.0e-9) return;
+  q = Eigen::Quaterniond(Eigen::AngleAxisd(w, omega / w)) * q;
+  q.normalize();
+}
+}; // namespace
+
+// Edge springs from the tets when asked for, then a greedy coloring of tets
+// and springs together so every color can be projected across threads.
+// Spring rest lengths come from the rest shape of the first tet with the
+// edge, not from where the particles are now.
+void ParticleSystem::BuildConstraints() {
+  springs.clear();
+  if (solverSettings.xpbdEdges) {
+    // edge, then the tet it came from and its two corners as tet * 16 + a * 4 + b
+    std::vector<std::pair<std::pair<int, int>, int> > edges;
+    for (int i = 0; i < tets.size(); i++) {
+      for (int a = 0; a < 4; ++a) {
+        for (int b = a + 1; b < 4; ++b) {
+          int lo = tets[i].to[a] < tets[i].to[b] ? a : b;
+          int hi = lo == a ? b : a;
+          edges.push_back(std::make_pair(std::make_pair(tets[i].to[lo], tets[i].to[hi]), i * 16 + lo * 4 + hi));
+        }
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+    Eigen::Vector3d rest[4];
+    for (int i = 0; i < edges.size(); i++) {
+      if (i > 0 && edges[i].first == edges[i - 1].first) continue;
+      int code = edges[i].second;
+      TetRestPositions(code / 16, rest);
+      springs.emplace_back();
+      Spring& s = springs.back();
+      s.from = edges[i].first.first;
+      s.to = edges[i].first.second;
+      s.L = (rest[code % 4] - rest[code / 4 % 4]).norm();
+      s.k = stiffness * s.L;
+      s.c = dampness;
+    }
+  }
+  builtWithEdges = solverSettings.xpbdEdges;
+
+  int count = tets.size() + springs.size();
+  std::vector<std::vector<int> > vertexConstraints(particles.size());
+  std::vector<int> vertices;
+  auto constraintVertices = [&](int i) {
+    vertices.clear();
+    if (i < tets.size()) {
+      vertices.assign(tets[i].to, tets[i].to + 4);
+    } else {
+      vertices.push_back(springs[i - tets.size()].from);
+      vertices.push_back(springs[i - tets.size()].to);
+    }
+  };
+  for (int i = 0; i < count; i++) {
+    constraintVertices(i);
+    for (int j = 0; j < vertices.size(); ++j) {
+      vertexConstraints[vertices[j]].push_back(i);
+    }
+  }
+  std::vector<int> color(count, -1);
+  std::vector<int> usedBy;
+  int colorCount = 0;
+  for (int i = 0; i < count; i++) {
+    constraintVertices(i);
+    for (int j = 0; j < vertices.size(); ++j) {
+      const std::vector<int>& neighbors = vertexConstraints[vertices[j]];
+      for (int k = 0; k < neighbors.size(); ++k) {
+        int c = color[neighbors[k]];
+        if (c >= 0) usedBy[c] = i;
+      }
+    }
+    int c = 0;
+    while (c < colorCount && usedBy[c] == i) c++;
+    if (c == colorCount) {
+      colorCount++;
+      usedBy.push_back(-1);
+    }
+    color[i] = c;
+  }
+  constraintOffsets.assign(colorCount + 1, 0);
+  for (int i = 0; i < count; i++) {
+    constraintOffsets[color[i] + 1]++;
+  }
+  for (int c = 0; c < colorCount; ++c) {
+    constraintOffsets[c + 1] += constraintOffsets[c];
+  }
+  constraintOrder.resize(count);
+  std::vector<int> fill(constraintOffsets.begin(), constraintOffsets.end() - 1);
+  for (int i = 0; i < count; i++) {
+    constraintOrder[fill[color[i]]++] = i;
+  }
+  printf("Constraint colors: %i\n", colorCount);
+
+  tetQuat.assign(tets.size(), Eigen::Quaterniond::Identity());
+  lambda.resize(tets.size() * 2 + springs.size());
+  correction.resize(count);
+  hasConstraints = true;
+}
+
+// Extended position based dynamics. Every tet has a strain constraint
+// |F - R| with compliance 1 / (2 mu V) and a volume constraint det F - 1
+// with compliance 1 / (lambda V), Lame parameters from k and volConserve.
+// V is |posDet| like in ComputeTetStiffness so the material is as stiff as
+// with the other solvers. Tets are always corotated, the constraints have no
+// linear form. Springs are distance constraints with compliance 1 / k.
+// Constraints are projected Gauss-Seidel style within a color and Jacobi
+// style across the threads working on it. Writes the new velocities into
+// newv and returns how much the last iteration still moved the particles
+// relative to the first.
+double ParticleSystem::PositionBasedStep(double timestep, Eigen::VectorXd& newv) {
+  if (!hasConstraints || builtWithEdges != solverSettings.xpbdEdges) BuildConstraints();
+  double h2 = timestep * timestep;
+  int n = particles.size();
+
+  // predict the positions from the velocities and the external forces,
+  // pinned particles stay where they are
+  Eigen::Map<Eigen::VectorXd> x = particles.Positions();
+  Eigen::VectorXd x_0 = x;
+  Eigen::VectorXd accel = particles.Forces();
+  for (int i = 0; i < n; i++) {
+    accel.segment<3>(i * 3) *= particles.iMass[i];
+    accel[i * 3 + 1] += gravity;
+  }
+  x += freeDofs.cwiseProduct(timestep * particles.Velocities() + h2 * accel);
+  std::fill(lambda.begin(), lambda.end(), 0.0);
+
+  double v = volConserve;
+  // Moves the vertices of tet i along the gradient of a constraint with
+  // dC/dF = P, value C and compliance alpha, returns the size of the move
+  auto applyTet = [&](int i, const Eigen::Matrix3d& P, double C, double alpha, double& l) {
+    Eigen::Matrix3d G = P * tets[i].inversePos.transpose();
+    Eigen::Vector3d grad[4];
+    grad[0] = -G.col(0) - G.col(1) - G.col(2);
+    grad[1] = G.col(0);
+    grad[2] = G.col(1);
+    grad[3] = G.col(2);
+    double w[4];
+    double denom = alpha / h2;
+    for (int a = 0; a < 4; ++a) {
+      int to = tets[i].to[a];
+      w[a] = freeDofs[to * 3] * particles.iMass[to];
+      denom += w[a] * grad[a].squaredNorm();
+    }
+    if (denom <= 0) return 0.0;
+    double dl = (-C - alpha / h2 * l) / denom;
+    l += dl;
+    double moved = 0;
+    for (int a = 0; a < 4; ++a) {
+      Eigen::Vector3d dx = (w[a] * dl) * grad[a];
+      x.segment<3>(tets[i].to[a] * 3) += dx;
+      moved += dx.norm();
+    }
+    return moved;
+  };
+  auto deformation = [&](int i) {
+    const int* to = tets[i].to;
+    Eigen::Matrix3d Ds;
+    Ds << x.segment<3>(to[1] * 3) - x.segment<3>(to[0] * 3),
+          x.segment<3>(to[2] * 3) - x.segment<3>(to[0] * 3),
+          x.segment<3>(to[3] * 3) - x.segment<3>(to[0] * 3);
+    return Eigen::Matrix3d(Ds * tets[i].inversePos);
+  };
+  auto project = [&](int k) {
+    // constraints of sleeping islands hold already, an island is asleep as a whole
+    if (k < tets.size() ? TetAsleep(k) : VertexAsleep(springs[k - tets.size()].to)) {
+      correction[k] = 0;
+      return;
+    }
+    if (k < tets.size()) {
+      int i = k;
+      double volume = fabs(tets[i].posDet);
+      double mu = tets[i].k / (2 * (1 + v));
+      double lame = tets[i].k * v / ((1 + v) * (1 - 2 * v));
+      double moved = 0;
+      Eigen::Matrix3d F = deformation(i);
+      ExtractRotation(F, tetQuat[i]);
+      Eigen::Matrix3d P = F - tetQuat[i].matrix();
+      double C = P.norm();
+      if (C > 1.0e-12 && mu > 0) {
+        moved += applyTet(i, P / C, C, 1 / (2 * mu * volume), lambda[i * 2]);
+        F = deformation(i);
+      }
+      if (lame > 0) {
+        // gradient of det F is its cofactor matrix
+        P << F.col(1).cross(F.col(2)), F.col(2).cross(F.col(0)), F.col(0).cross(F.col(1));
+        moved += applyTet(i, P, F.determinant() - 1, 1 / (lame * volume), lambda[i * 2 + 1]);
+      }
+      correction[k] = moved;
+    } else {
+      const Spring& s = springs[k - tets.size()];
+      Eigen::Vector3d d = x.segment<3>(s.to * 3) - x.segment<3>(s.from * 3);
+      double len = d.norm();
+      double wTo = freeDofs[s.to * 3] * particles.iMass[s.to];
+      double wFrom = freeDofs[s.from * 3] * particles.iMass[s.from];
+      double alpha = 1 / (s.k * h2);
+      correction[k] = 0;
+      if (len < 1.0e-12 || wTo + wFrom == 0) return;
+      double& l = lambda[tets.size() * 2 + (k - tets.size())];
+      double dl = (-(len - s.L) - alpha * l) / (wTo + wFrom + alpha);
+      l += dl;
+      Eigen::Vector3d dx = (dl / len) * d;
+      x.segment<3>(s.to * 3) += wTo * dx;
+      x.segment<3>(s.from * 3) -= wFrom * dx;
+      correction[k] = (wTo + wFrom) * dx.norm();
+    }
+  };
+
+  int iterations = solverSettings.xpbdIterations;
+  double first = 0, last = 0;
+  for (int it = 0; it < iterations; ++it) {
+    for (int c = 0; c + 1 < constraintOffsets.size(); ++c) {
+      const int* colored = &(constraintOrder[constraintOffsets[c]]);
+      ThreadPool::ParallelFor(constraintOffsets[c + 1] - constraintOffsets[c], [&](int begin, int end) {
+        for (int k = begin; k < end; k++) {
+          project(colored[k]);
+        }
+      });
+    }
+    last = 0;
+    for (int k = 0; k < correction.size(); k++) {
+      last += correction[k];
+    }
+    if (it == 0) first = last;
+  }
+
+  // mass proportional damping the way the implicit solvers have it
+  newv = freeDofs.cwiseProduct(x - x_0) / (timestep * (1 + timestep * dampness));
+  x = x_0;
+  return first > 0 ? last / first : 0;
+}